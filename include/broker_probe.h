@@ -0,0 +1,16 @@
+#ifndef _BROKER_PROBE_H
+#define _BROKER_PROBE_H
+
+#include <Arduino.h>
+
+#define BROKER_PROBE_MAX 8             // brokers probed at the same time
+#define BROKER_PROBE_TIMEOUT 2000      // milliseconds for the whole probe
+#define BROKER_PROBE_UNREACHABLE 0xFFFFFFFF
+
+// Opens a non-blocking TCP connection to every host at once and waits until
+// all of them have answered or the timeout has passed. rtt[index] is set to the
+// time the TCP connect took in microseconds, or BROKER_PROBE_UNREACHABLE.
+// The connections are closed again - this only measures.
+void probeBrokers(const char *const hosts[], const uint16_t ports[], uint8_t count, uint32_t timeout, uint32_t rtt[]);
+
+#endif
@@ -13,6 +13,8 @@
 #define PREFERENCES_KEY_BOTTOM_LEFT_Y "bly"
 #define PREFERENCES_KEY_BOTTOM_RIGHT_X "brx"
 #define PREFERENCES_KEY_BOTTOM_RIGHT_Y "bly"
+#define PREFERENCES_KEY_BROKER_RANKING "mqttrank"
+#define PREFERENCES_KEY_WIFI_CACHE "wificache"
 
 #define BACKGROUND_COLOUR TFT_BLACK
 #define TEXT_COLOUR TFT_WHITE
@@ -0,0 +1,53 @@
+#ifndef _CPU_GOVERNOR_H
+#define _CPU_GOVERNOR_H
+
+#include <Arduino.h>
+#include "histogram.h"
+
+// Runs the CPU at CPU_FREQ_LOW and boosts it to CPU_FREQ_HIGH for a while
+// when something needs the speed - a ring, a touch, drawing the display.
+//
+// With power management in the build (CONFIG_PM_ENABLE) this is esp_pm's
+// dynamic frequency scaling: a boost holds an ESP_PM_CPU_FREQ_MAX lock, and
+// the WiFi driver takes the locks it needs on its own. Without it the
+// governor switches with setCpuFrequencyMhz(). 80 MHz is as low as it goes,
+// below that the APB clock - SPI for the display and touch, the UART - would
+// change as well.
+//
+// Use it from one task only, it ends boosts with the scheduler of that task.
+// The statistics can be read from any task.
+
+#define CPU_FREQ_LOW 80        // MHz
+#define CPU_FREQ_HIGH 240      // MHz
+#define CPU_MILLIAMPS_LOW 25   // estimate for the CPU at CPU_FREQ_LOW, for the energy saved
+#define CPU_MILLIAMPS_HIGH 50  // the same at CPU_FREQ_HIGH
+#define CPU_MILLIVOLTS 3300
+
+// Automatic light sleep needs power management and tickless idle, stock
+// Arduino is built with neither. [env:esp32dev-lightsleep] builds Arduino on
+// ESP-IDF with both, see sdkconfig.defaults. Without them the firmware never
+// asks for light sleep.
+#if defined(CONFIG_PM_ENABLE) && defined(CONFIG_FREERTOS_USE_TICKLESS_IDLE)
+#define CPU_LIGHT_SLEEP true
+#else
+#define CPU_LIGHT_SLEEP false
+#endif
+
+void cpuGovernorBegin();
+// True if esp_pm does the work, false if setCpuFrequencyMhz() does
+bool cpuGovernorUsesPowerManagement();
+// Allows automatic light sleep between boosts, or not. False if it cannot be done.
+bool cpuGovernorLightSleep(bool enable);
+// Runs at CPU_FREQ_HIGH for at least holdMillis from now, a running boost is extended
+void cpuBoost(unsigned long holdMillis);
+
+// Milliseconds at each frequency since begin - light sleep counts as low
+uint64_t cpuTimeLow();
+uint64_t cpuTimeHigh();
+uint32_t cpuBoostCount();
+// How long it took to get to CPU_FREQ_HIGH, in microseconds
+const Histogram *cpuBoostLatency();
+// Against running at CPU_FREQ_HIGH all the time, an estimate in millijoules
+uint64_t cpuEnergySaved();
+
+#endif
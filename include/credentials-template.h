@@ -22,6 +22,25 @@ const WiFiCredentials wifiCredentials[] = {
     {"SSID1", "password1"},
     {"SSID2", "password2"}};
 
+// Brokers on port 8883 are connected with TLS. Define the CA that signed the
+// broker certificate, without it the TLS brokers are skipped.
+/*
+#define MQTT_CA_CERTIFICATE "-----BEGIN CERTIFICATE-----\n" \
+                            "...\n" \
+                            "-----END CERTIFICATE-----\n"
+*/
+// Only for testing: accept any broker certificate. Anyone on the path can
+// then pose as the broker and read the MQTT password.
+/*
+#define MQTT_TLS_INSECURE
+*/
+
+// Define a syslog server to get the log over UDP as well, see logger.h
+/*
+#define LOG_UDP_HOST "192.168.0.10"
+#define LOG_UDP_PORT 514
+*/
+
 const MqttBroker mqttBrokers[] = {
     {"SSID1", "192.168.0.1", 1883, "user1", "pass1"},
     {"SSID1", "192.168.0.2", 1883, "user2", "pass2"},
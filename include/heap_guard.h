@@ -0,0 +1,43 @@
+#ifndef _HEAP_GUARD_H
+#define _HEAP_GUARD_H
+
+#include <Arduino.h>
+
+// "No heap after boot" debugging. Built with HEAP_GUARD and the linker
+// wrapping malloc, calloc and realloc - the esp32dev-heapguard environment in
+// platformio.ini does both - every allocation after heapGuardArm() is counted
+// against the address it was called from. Turn the addresses into lines with
+//   xtensa-esp32-elf-addr2line -pfiaC -e .pio/build/esp32dev-heapguard/firmware.elf <address>
+//
+// Not every caller is a bug: lwIP, the WiFi driver and mbedTLS allocate at
+// runtime by design. new goes through malloc as well, its allocations show up
+// under operator new rather than under the caller.
+//
+// The hook runs inside malloc, it never logs or allocates itself. Callers
+// beyond HEAP_GUARD_CALLERS are only counted in heapGuardAllocations().
+//
+// Without HEAP_GUARD everything here is empty and nothing is counted.
+
+#define HEAP_GUARD_CALLERS 16
+
+struct HeapGuardEntry
+{
+  void *caller; // return address of the malloc call
+  uint32_t count;
+  uint32_t bytes;   // requested in total
+  uint32_t largest; // the largest single request
+};
+
+// Counts allocations from now on
+void heapGuardArm();
+bool heapGuardArmed();
+// Allocations since heapGuardArm() or heapGuardReset()
+uint32_t heapGuardAllocations();
+// Callers in the table
+uint8_t heapGuardCount();
+// Copies the entry, false if there is none at index
+bool heapGuardEntry(uint8_t index, HeapGuardEntry *entry);
+// Forgets the callers seen so far, it stays armed
+void heapGuardReset();
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+#include <Arduino.h>
+
+// A fixed size histogram for durations (or any other unsigned value).
+// Buckets are a quarter octave wide, so a percentile is never more than
+// about 19% off. Values from 2^27 on all land in the last bucket.
+#define HISTOGRAM_BUCKETS 104
+
+struct Histogram
+{
+  uint32_t counts[HISTOGRAM_BUCKETS];
+  uint32_t total;
+  uint32_t maximum;
+  uint64_t sum; // of all values
+};
+
+void histogramReset(Histogram *histogram);
+void histogramAdd(Histogram *histogram, uint32_t value);
+// The upper bound of the bucket holding the given percentile, 0 if empty
+uint32_t histogramPercentile(const Histogram *histogram, uint8_t percent);
+// Lowest value that lands in the bucket
+uint32_t histogramBucketLow(uint8_t bucket);
+// Highest value that lands in the bucket
+uint32_t histogramBucketHigh(uint8_t bucket);
+
+#endif
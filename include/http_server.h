@@ -0,0 +1,159 @@
+#ifndef _HTTP_SERVER_H
+#define _HTTP_SERVER_H
+
+#include <Arduino.h>
+#include "histogram.h"
+
+// A small event driven HTTP/1.1 server on non-blocking lwIP sockets. poll()
+// is called from loop() and never waits: it accepts, reads and writes only
+// what the sockets are ready for, so a slow client cannot hold up the ring or
+// touch handling, and several clients are served at the same time.
+//
+// Every connection has a fixed request and response buffer - nothing is
+// allocated per request. A handler gets the parsed request and writes its
+// response into the buffer, the server sends it once the handler returns.
+// Responses are sent with a Content-Length and the connection is closed.
+//
+// A body larger than the response buffer is sent in parts: the handler gives
+// a part writer, which is called again for the next part each time the one
+// before has been sent. Such a response has no Content-Length, it ends when
+// the connection is closed. A part that does not fit resets the connection,
+// so the client sees an error instead of a body that looks complete.
+//
+// A handler can turn its connection into a Server-Sent Events stream instead.
+// The connection then stays open and sendEvent() queues events for every
+// stream in the connection's response buffer. A client that falls more than
+// that buffer behind is dropped, the browser reconnects on its own.
+
+#define HTTP_MAX_CONNECTIONS 4
+#define HTTP_MAX_ROUTES 16
+#define HTTP_REQUEST_SIZE 768      // request line, headers and body
+#define HTTP_HEADER_SIZE 256       // status line and response headers
+#define HTTP_RESPONSE_SIZE 3072    // response body, or the send buffer of an event stream
+#define HTTP_TIMEOUT 5000          // milliseconds a connection may stay idle
+#define HTTP_MAX_EVENT_STREAMS 2   // at most, so some connections are always left for requests
+#define HTTP_EVENT_KEEPALIVE 15000 // milliseconds between comments on an idle stream
+
+#define HTTP_METHOD_ANY 0
+#define HTTP_METHOD_GET 1
+#define HTTP_METHOD_POST 2
+#define HTTP_METHOD_OTHER 3
+
+class HttpRequest;
+
+// Writes the given part of a response, false if there is no such part - the body is complete
+typedef bool (*HttpPartWriter)(HttpRequest &request, uint8_t part);
+
+class HttpRequest
+{
+public:
+  uint8_t method();
+  const char *path();
+  // Value of a query string or form (application/x-www-form-urlencoded) argument, URL decoded
+  bool arg(const char *name, char *value, size_t size);
+  // The raw request body, empty if there is none
+  const char *body();
+  bool header(const char *name, char *value, size_t size);
+
+  // Starts the response. Headers can be added until the first write.
+  void beginResponse(int status, const char *type);
+  void addHeader(const char *name, const char *value);
+  void write(const char *data, size_t length);
+  void print(const char *text);
+  // Sends length bytes from flash after what was written, without copying them into the buffer
+  void writeFlash(const uint8_t *data, size_t length);
+  // Shorthand for a complete response
+  void send(int status, const char *type, const char *text);
+  // Starts a response whose body writer() writes part by part, each part has to fit the response buffer
+  void beginParts(int status, const char *type, HttpPartWriter writer);
+  // Answers with a text/event-stream and keeps the connection open.
+  // Events written now are the first ones the client gets.
+  void beginEventStream();
+  void writeEvent(const char *event, const char *data);
+
+private:
+  friend class HttpServer;
+
+  int fd;
+  uint8_t state;
+  unsigned long lastActivity;
+  int64_t started;
+  char request[HTTP_REQUEST_SIZE + 1];
+  size_t requestUsed;
+  uint8_t requestMethod;
+  char *requestPath;
+  char *requestQuery;
+  char *requestHeaders;
+  char *requestBody;
+  char responseHeader[HTTP_HEADER_SIZE];
+  size_t responseHeaderUsed;
+  char response[HTTP_RESPONSE_SIZE];
+  size_t responseUsed;
+  bool responseStarted;
+  bool overflow;
+  bool streaming;
+  const uint8_t *flashBody;
+  size_t flashLength;
+  HttpPartWriter partWriter;
+  uint8_t part; // the one in the response buffer
+  size_t sent; // of responseHeader, response and flashBody together
+
+  void reset();
+  void appendHeader(const char *text);
+};
+
+typedef void (*HttpHandler)(HttpRequest &request);
+
+class HttpServer
+{
+public:
+  HttpServer(uint16_t port);
+
+  void on(const char *path, uint8_t method, HttpHandler handler);
+  void on(const char *path, HttpHandler handler);
+  void begin();
+  // Call often - does whatever the sockets are ready for and returns at once
+  void poll();
+
+  uint8_t openConnections();
+  uint32_t requestCount();
+  uint32_t bytesSent();
+  // Time from accepting a connection until the response was sent, in microseconds
+  const Histogram *latency();
+
+  // Queues an event for every open event stream
+  void sendEvent(const char *event, const char *data);
+  uint8_t eventStreams();
+
+private:
+  struct Route
+  {
+    const char *path;
+    uint8_t method;
+    HttpHandler handler;
+  };
+
+  uint16_t port;
+  int listenFd;
+  Route routes[HTTP_MAX_ROUTES];
+  uint8_t routeCount;
+  HttpRequest connections[HTTP_MAX_CONNECTIONS];
+  uint32_t requests;
+  uint32_t bytes;
+  Histogram latencyHistogram;
+
+  void acceptConnections();
+  void receive(HttpRequest &connection);
+  void transmit(HttpRequest &connection);
+  void discard(HttpRequest &connection);
+  void keepAlive(HttpRequest &connection, unsigned long now);
+  bool compact(HttpRequest &connection, size_t needed);
+  int parse(HttpRequest &connection);
+  void dispatch(HttpRequest &connection);
+  void finish(HttpRequest &connection);
+  bool nextPart(HttpRequest &connection);
+  void release(HttpRequest &connection);
+  void abort(HttpRequest &connection);
+};
+
+#endif
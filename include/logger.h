@@ -0,0 +1,82 @@
+#ifndef _LOGGER_H
+#define _LOGGER_H
+
+#include <Arduino.h>
+
+// printf style logging that never waits. logInfo() and friends format the
+// line straight into a slot of a lock-free ring buffer and return; a low
+// priority task drains the buffer to the serial port and, if set, to a
+// syslog server over UDP. If the buffer is full the line is dropped and
+// counted, the caller is never held up by a slow UART or network.
+//
+// Any task may log - the ring buffer takes several producers. Interrupt
+// handlers may not, formatting is too slow for them anyway.
+//
+// Lines above LOG_LEVEL or of a module missing from LOG_MODULES_ENABLED are
+// compiled out. What is compiled in can be turned down per module at runtime
+// with logSetLevel().
+
+#define LOG_ERROR 1
+#define LOG_WARNING 2
+#define LOG_INFO 3
+#define LOG_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO // the most detailed level compiled in
+#endif
+
+#define LOG_MAIN 0 // setup, boot and the periodic reports
+#define LOG_DISPLAY 1
+#define LOG_TOUCH 2
+#define LOG_INTERCOM 3
+#define LOG_WIFI 4
+#define LOG_MQTT 5
+#define LOG_HTTP 6
+#define LOG_POWER 7
+#define LOG_MODULES 8
+
+#ifndef LOG_MODULES_ENABLED
+#define LOG_MODULES_ENABLED 0xFF // bit per module
+#endif
+
+// Comment out to keep the log off the serial port
+#define LOG_SERIAL
+
+#define LOG_QUEUE_SIZE 64  // lines, a power of two
+#define LOG_LINE_SIZE 120  // characters per line, longer ones are cut
+#define LOG_TASK_STACK 3072
+#define LOG_TASK_PRIORITY 0 // the same as the idle task, it only runs when nothing else wants to
+
+#define LOG_AT(level, module, ...)                                              \
+  do                                                                            \
+  {                                                                             \
+    if ((level) <= LOG_LEVEL && (LOG_MODULES_ENABLED & (1 << (module))) != 0) \
+    {                                                                           \
+      logWrite(level, module, __VA_ARGS__);                                     \
+    }                                                                           \
+  } while (0)
+
+#define logError(module, ...) LOG_AT(LOG_ERROR, module, __VA_ARGS__)
+#define logWarning(module, ...) LOG_AT(LOG_WARNING, module, __VA_ARGS__)
+#define logInfo(module, ...) LOG_AT(LOG_INFO, module, __VA_ARGS__)
+#define logDebug(module, ...) LOG_AT(LOG_DEBUG, module, __VA_ARGS__)
+
+// Starts the task that drains the buffer. Lines logged before are kept.
+void logBegin();
+// Use the macros above, they compile out
+void logWrite(uint8_t level, uint8_t module, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+// The most detailed level a module logs at runtime, 0 turns it off
+void logSetLevel(uint8_t module, uint8_t level);
+uint8_t logLevel(uint8_t module);
+const char *logModuleName(uint8_t module);
+// The module called name, -1 if there is none
+int8_t logModule(const char *name);
+
+// Sends every line to a syslog server as well, an ip of 0 stops it
+void logSetUdpSink(uint32_t ip, uint16_t port, const char *hostname);
+
+uint32_t logDropped();
+uint32_t logMaxDepth();
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef _LOOP_WATCHDOG_H
+#define _LOOP_WATCHDOG_H
+
+#include <Arduino.h>
+#include "histogram.h"
+
+// Times the phases of a task's loop to find what blocks it. Every iteration
+// is cut into phases with mark(); each phase has a histogram of its times.
+// endIteration() checks the whole iteration against a threshold. If it took
+// longer, it is counted against the phase that took the most of it, and the
+// caller can log it. The time a loop waits for work is not an iteration.
+//
+// endIteration() also feeds the ESP-IDF task watchdog, which resets the
+// device if a watched task has not finished an iteration for
+// LOOP_WATCHDOG_TIMEOUT seconds.
+//
+// Call begin(), mark() and endIteration() from the watched task only. The
+// statistics can be read from any task.
+
+#define LOOP_WATCHDOG_MAX_PHASES 8
+#define LOOP_WATCHDOG_TIMEOUT 30 // seconds
+
+class LoopWatchdog
+{
+public:
+  // phaseNames is not copied, it has to stay valid
+  LoopWatchdog(const char *task, const char *const *phaseNames, uint8_t phases, uint32_t thresholdMicros);
+
+  // Adds the calling task to the task watchdog and starts the first iteration
+  void begin();
+  // Starts an iteration, after the loop has waited
+  void startIteration();
+  // Ends a phase: the time since the last mark, or the start, goes to it
+  void mark(uint8_t phase);
+  // Feeds the task watchdog. True if the iteration took longer than the threshold.
+  bool endIteration();
+
+  const char *task();
+  uint8_t phases();
+  const char *phaseName(uint8_t phase);
+  const Histogram *phaseHistogram(uint8_t phase);
+  // Iterations over the threshold that this phase took the most of
+  uint32_t phaseOverruns(uint8_t phase);
+  uint32_t overruns();
+  // The last iteration over the threshold, and the phase that took the most of it
+  uint32_t lastOverrunMicros();
+  uint8_t lastOverrunPhase();
+  uint32_t lastOverrunPhaseMicros();
+
+private:
+  const char *taskName;
+  const char *const *names;
+  uint8_t phaseCount;
+  uint32_t threshold;
+  unsigned long iterationStart;
+  unsigned long phaseStart;
+  uint32_t iterationPhases[LOOP_WATCHDOG_MAX_PHASES]; // of the current iteration
+  Histogram histograms[LOOP_WATCHDOG_MAX_PHASES];
+  uint32_t phaseOverrunCounts[LOOP_WATCHDOG_MAX_PHASES];
+  uint32_t overrunCount;
+  uint32_t lastOverrun;
+  uint8_t lastPhase;
+  uint32_t lastPhaseMicros;
+};
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef _MQTT_CLIENT_H
+#define _MQTT_CLIENT_H
+
+#include <Arduino.h>
+#include <Client.h>
+
+// A small MQTT 3.1.1 client. It is call compatible with the parts of
+// PubSubClient we used, but can also publish at QoS 1. QoS 1 messages are kept
+// in a small in-flight window until the broker acknowledges them with a PUBACK.
+// The session is not clean, so the broker keeps it across reconnects and
+// anything still in the window is sent again (with DUP set) after a reconnect.
+//
+// A retained QoS 1 message replaces one for the same topic still in the
+// window - the broker would only keep the newer one anyway - and a full window
+// drops its oldest message, so the latest state always gets through.
+//
+// Incoming packets are read as far as they have arrived and finished on a
+// later loop(). Nothing but connect() waits for the broker.
+
+#define MQTT_BUFFER_SIZE 256
+#define MQTT_MAX_HEADER_SIZE 5
+#define MQTT_KEEPALIVE 15      // seconds
+#define MQTT_SOCKET_TIMEOUT 15 // seconds for the CONNACK, and for the rest of a packet once it has started
+
+#define MQTT_INFLIGHT_WINDOW 4        // unacknowledged QoS 1 messages we hold on to
+#define MQTT_ACK_HISTORY 8            // the last PUBACKs, to find when a given message got through
+#define MQTT_INFLIGHT_TOPIC_SIZE 32   // our topics are all short
+#define MQTT_INFLIGHT_PAYLOAD_SIZE 32 // and so are the payloads
+
+// Same values as PubSubClient so existing state handling keeps working
+#define MQTT_CONNECTION_TIMEOUT -4
+#define MQTT_CONNECTION_LOST -3
+#define MQTT_CONNECT_FAILED -2
+#define MQTT_DISCONNECTED -1
+#define MQTT_CONNECTED 0
+#define MQTT_CONNECT_BAD_PROTOCOL 1
+#define MQTT_CONNECT_BAD_CLIENT_ID 2
+#define MQTT_CONNECT_UNAVAILABLE 3
+#define MQTT_CONNECT_BAD_CREDENTIALS 4
+#define MQTT_CONNECT_UNAUTHORIZED 5
+
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBLISH 0x30
+#define MQTT_PUBACK 0x40
+#define MQTT_SUBSCRIBE 0x80
+#define MQTT_SUBACK 0x90
+#define MQTT_PINGREQ 0xC0
+#define MQTT_PINGRESP 0xD0
+#define MQTT_DISCONNECT 0xE0
+
+#define MQTT_FLAG_DUP 0x08
+#define MQTT_FLAG_QOS1 0x02
+#define MQTT_FLAG_RETAIN 0x01
+
+typedef void (*MqttCallback)(char *topic, uint8_t *payload, unsigned int length);
+
+struct MqttInflightMessage
+{
+  uint16_t packetId;
+  bool retained;
+  bool sent; // transmitted at least once - a retransmit gets the DUP flag
+  char topic[MQTT_INFLIGHT_TOPIC_SIZE];
+  uint8_t payload[MQTT_INFLIGHT_PAYLOAD_SIZE];
+  uint8_t payloadLength;
+};
+
+class MqttClient
+{
+public:
+  MqttClient(Client &client);
+
+  // Switch the transport, e.g. to a TLS client. Only while disconnected.
+  MqttClient &setClient(Client &client);
+  MqttClient &setServer(const char *host, uint16_t port);
+  MqttClient &setCallback(MqttCallback callback);
+  MqttClient &setKeepAlive(uint16_t seconds);
+  MqttClient &setSocketTimeout(uint16_t seconds);
+
+  // Connects with a persistent (not clean) session and resends the in-flight window
+  bool connect(const char *id, const char *username, const char *password);
+  void disconnect();
+  bool connected();
+  int state();
+  // Call often - reads incoming packets and keeps the connection alive
+  bool loop();
+
+  bool subscribe(const char *topic, uint8_t qos = 0);
+  // QoS 0 needs a connection. QoS 1 is queued in the in-flight window and
+  // sent now if connected or after the next reconnect. Returns false if the
+  // message does not fit.
+  bool publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained, uint8_t qos = 0);
+
+  uint8_t inflightCount();
+  uint32_t publishedCount();
+  uint32_t acknowledgedCount();
+  uint32_t retransmitCount();
+  uint32_t droppedCount();    // pushed out of a full window
+  uint32_t supersededCount(); // replaced by a newer retained message for the topic
+  // When the last PUBACK arrived (esp_timer microseconds)
+  int64_t lastAckMicros();
+  // Packet id of the last QoS 1 message publish() queued, 0 if it refused the message
+  uint16_t lastPacketId();
+  // True if the message is still waiting for its PUBACK
+  bool pending(uint16_t packetId);
+  // True if one of the last MQTT_ACK_HISTORY PUBACKs was for the message, with when it arrived
+  bool findAck(uint16_t packetId, int64_t *micros);
+  // Keep alive round trips - PINGREQ to PINGRESP
+  uint32_t pingCount();
+  uint32_t lastPingMicros();
+
+private:
+  Client *client;
+  const char *host;
+  uint16_t port;
+  MqttCallback callback;
+  uint16_t keepAlive;
+  uint16_t socketTimeout;
+  int currentState;
+  uint8_t buffer[MQTT_BUFFER_SIZE];        // outgoing packets
+  uint8_t receiveBuffer[MQTT_BUFFER_SIZE]; // incoming packets - separate so a callback can publish
+  unsigned long lastOutActivity;
+  unsigned long lastInActivity;
+  bool pingOutstanding;
+  uint16_t nextPacketId;
+  // The incoming packet read so far
+  size_t receiveUsed;
+  uint8_t receiveOffset; // start of the variable header, 0 while the length is incomplete
+  uint32_t receiveRemaining;
+  uint32_t receiveMultiplier;
+  bool receiveTooLarge; // read and thrown away
+  unsigned long receiveStart;
+
+  MqttInflightMessage inflight[MQTT_INFLIGHT_WINDOW];
+  uint8_t inflightUsed;
+  uint32_t published;
+  uint32_t acknowledged;
+  uint32_t retransmits;
+  uint32_t dropped;
+  uint32_t superseded;
+  int64_t lastAck;
+  uint16_t lastQueued;
+  uint16_t ackIds[MQTT_ACK_HISTORY];
+  int64_t ackTimes[MQTT_ACK_HISTORY];
+  uint8_t ackNext;
+  int64_t pingSent;
+  uint32_t pings;
+  uint32_t lastPing;
+
+  uint16_t allocatePacketId();
+  bool readPacket(size_t *length, uint8_t *offset);
+  void resetReceive();
+  void removeInflight(uint8_t index);
+  bool write(uint8_t header, size_t length);
+  size_t writeString(const char *string, size_t position);
+  bool sendInflight(MqttInflightMessage *message);
+  void resendInflight();
+  void handlePacket(size_t length, uint8_t offset);
+  void handlePuback(uint16_t packetId);
+};
+
+#endif
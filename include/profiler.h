@@ -0,0 +1,74 @@
+#ifndef _PROFILER_H
+#define _PROFILER_H
+
+#include <Arduino.h>
+#include <esp_timer.h>
+
+// A flat profile of the hot paths. PROFILE_SCOPE("name") at the top of a
+// block times it until the block is left and adds the time to the name's
+// entry in a static table: count, minimum, maximum and the total for the
+// mean. Each scope takes its slot the first time it runs.
+//
+// Times are esp_timer microseconds, not ESP.getCycleCount(): the CPU
+// governor changes the clock, so cycles would not add up to time.
+//
+// A scope belongs to the task that runs it, entries are updated without a
+// lock. Reading them from another task may give a moment old numbers.
+
+// Comment out to compile the profiling out, PROFILE_SCOPE() is empty then
+#define PROFILING
+
+#define PROFILE_SLOTS 16
+
+struct ProfileEntry
+{
+  const char *name;
+  uint32_t count;
+  uint32_t minimum; // microseconds
+  uint32_t maximum;
+  uint64_t total;
+};
+
+#ifdef PROFILING
+
+// The slot for name, -1 if all are taken
+int8_t profileRegister(const char *name);
+void profileAdd(int8_t slot, uint32_t micros);
+
+class ProfileScope
+{
+public:
+  ProfileScope(int8_t slot) : slot(slot), start(esp_timer_get_time())
+  {
+  }
+
+  ~ProfileScope()
+  {
+    profileAdd(slot, esp_timer_get_time() - start);
+  }
+
+private:
+  int8_t slot;
+  int64_t start;
+};
+
+#define PROFILE_JOIN2(a, b) a##b
+#define PROFILE_JOIN(a, b) PROFILE_JOIN2(a, b)
+#define PROFILE_SCOPE(name)                                                    \
+  static int8_t PROFILE_JOIN(profileSlot, __LINE__) = profileRegister(name); \
+  ProfileScope PROFILE_JOIN(profileScope, __LINE__)(PROFILE_JOIN(profileSlot, __LINE__))
+
+#else
+
+#define PROFILE_SCOPE(name)
+
+#endif
+
+// Slots in use, 0 if profiling is compiled out
+uint8_t profileCount();
+// Copies the entry, false if there is none at index
+bool profileEntry(uint8_t index, ProfileEntry *entry);
+// Starts counting again, the slots stay
+void profileReset();
+
+#endif
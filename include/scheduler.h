@@ -0,0 +1,43 @@
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+#include <Arduino.h>
+
+// Deferred actions for loop(). Instead of waiting with delay() a function is
+// scheduled to run later and loop() carries on with touch, ring and network
+// handling in the meantime. An action can be pending only once - scheduling
+// it again moves it to the new time - and can be cancelled until it runs.
+// Actions that need to repeat schedule themselves again.
+//
+// Deadlines are 64 bit esp_timer microseconds, they do not wrap like millis()
+// does after 49 days. With a handful of timers a flat table is all the wheel
+// we need: finding the next deadline is one pass over it.
+//
+// An action runs on the task that scheduled it: the network task and the UI
+// task are pinned to different cores and each core has its own table. Cancel
+// and check an action from the task that scheduled it.
+//
+// The clock and the choice of table can be replaced, the host tests run the
+// scheduler on a virtual clock with schedulerUse().
+
+#define SCHEDULER_SLOTS 12
+#define SCHEDULER_IDLE -1 // scheduledActionWait() when nothing is pending
+
+typedef void (*ScheduledAction)();
+typedef int64_t (*SchedulerClock)();  // microseconds, never wraps
+typedef uint8_t (*SchedulerTable)();  // 0 to portNUM_PROCESSORS - 1, the table of the caller
+
+// NULL keeps the default: esp_timer_get_time() and the calling core's table
+void schedulerUse(SchedulerClock clock, SchedulerTable table);
+
+// Runs action once, delayMillis from now. False if all slots are in use.
+bool scheduleAction(ScheduledAction action, unsigned long delayMillis);
+// True if the action was pending
+bool cancelAction(ScheduledAction action);
+bool actionPending(ScheduledAction action);
+// Call from loop() - runs every action that is due
+void runScheduledActions();
+// Microseconds until the next action is due, 0 if one is due now, SCHEDULER_IDLE if none is pending
+int64_t scheduledActionWait();
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef _SPSC_QUEUE_H
+#define _SPSC_QUEUE_H
+
+#include <Arduino.h>
+#include <atomic>
+
+// A lock-free queue between exactly two tasks: one only pushes, the other
+// only pops. head is written by the producer alone and tail by the consumer
+// alone, so neither ever waits for the other, also when they run on different
+// cores. Items are copied in and out - nothing is allocated.
+//
+// SIZE has to be a power of two. head and tail count up forever and wrap
+// around together, their difference is the depth.
+
+template <typename T, uint32_t SIZE>
+class SpscQueue
+{
+  static_assert(SIZE > 0 && (SIZE & (SIZE - 1)) == 0, "SIZE must be a power of two");
+
+public:
+  SpscQueue() : head(0), tail(0), highWater(0), drops(0)
+  {
+  }
+
+  // Producer only. False if the queue is full, the item is dropped and counted.
+  bool push(const T &item)
+  {
+    uint32_t position = head.load(std::memory_order_relaxed);
+    uint32_t depth = position - tail.load(std::memory_order_acquire);
+    if (depth >= SIZE)
+    {
+      drops += 1;
+      return false;
+    }
+    items[position & (SIZE - 1)] = item;
+    // the item has to be in place before the consumer can see it
+    head.store(position + 1, std::memory_order_release);
+    if (depth + 1 > highWater)
+    {
+      highWater = depth + 1;
+    }
+    return true;
+  }
+
+  // Consumer only. False if the queue is empty.
+  bool pop(T &item)
+  {
+    uint32_t position = tail.load(std::memory_order_relaxed);
+    if (position == head.load(std::memory_order_acquire))
+    {
+      return false;
+    }
+    item = items[position & (SIZE - 1)];
+    // only now the producer may use the slot again
+    tail.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Any task - a snapshot that may be out of date right away
+  uint32_t depth()
+  {
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+  }
+
+  uint32_t maxDepth()
+  {
+    return highWater;
+  }
+
+  uint32_t dropped()
+  {
+    return drops;
+  }
+
+private:
+  T items[SIZE];
+  std::atomic<uint32_t> head; // next position to write
+  std::atomic<uint32_t> tail; // next position to read
+  uint32_t highWater;         // written by the producer only
+  uint32_t drops;             // written by the producer only
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef _TELEMETRY_H
+#define _TELEMETRY_H
+
+#include <Arduino.h>
+
+// Telemetry record layout (version 1), published on /intercom/telemetry
+//
+//   byte 0    version, currently 1
+//   varint    field mask, bit n set = field n follows
+//   varint    value of every field in the mask, lowest bit first
+//
+// A varint is LEB128: 7 bits per byte, least significant first, the top bit
+// set on all but the last byte. Every value is zigzag encoded first
+// ((n << 1) ^ (n >> 31)) so small negative numbers like the RSSI stay short.
+//
+// Fields that did not change since the previous record are left out, the
+// decoder keeps the last value it has seen. Every TELEMETRY_FULL_EVERY records
+// (and the first one after boot) all fields are sent so a decoder can start
+// from any point. Records go out at QoS 0: after a lost one the decoder has
+// wrong values until the next full record. tools/decode_telemetry.py decodes
+// the records.
+
+#define TELEMETRY_VERSION 1
+
+#define TELEMETRY_UPTIME 0          // seconds
+#define TELEMETRY_RSSI 1            // dBm
+#define TELEMETRY_FREE_HEAP 2       // bytes
+#define TELEMETRY_LOOP_P50 3        // microseconds
+#define TELEMETRY_LOOP_P99 4        // microseconds
+#define TELEMETRY_LOOP_MAX 5        // microseconds
+#define TELEMETRY_MQTT_RECONNECTS 6 // since boot
+#define TELEMETRY_WIFI_RECONNECTS 7 // since boot
+#define TELEMETRY_RING_COUNT 8      // since boot
+#define TELEMETRY_FIELD_COUNT 9
+
+#define TELEMETRY_MAX_SIZE (1 + 2 + TELEMETRY_FIELD_COUNT * 5)
+#define TELEMETRY_FULL_EVERY 10
+
+struct TelemetryRecord
+{
+  int32_t values[TELEMETRY_FIELD_COUNT];
+};
+
+// Is current different enough from previous to be worth sending? The uptime
+// always changes and is ignored, small RSSI, heap and latency jitter as well.
+bool telemetryChanged(const TelemetryRecord *current, const TelemetryRecord *previous);
+
+// Encodes current into buffer (at least TELEMETRY_MAX_SIZE bytes). Only fields
+// that differ from previous are written unless full is set. Returns the length.
+size_t encodeTelemetry(const TelemetryRecord *current, const TelemetryRecord *previous, bool full, uint8_t *buffer);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef _TLS_CLIENT_H
+#define _TLS_CLIENT_H
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+
+// A TLS client (mbedTLS on top of a WiFiClient) that remembers the TLS session
+// of the last successful handshake and offers it on the next connect, so the
+// broker can resume it (session ID or session ticket) instead of doing a full
+// handshake. The session is kept in RTC memory and survives ESP.restart().
+// WiFiClientSecure cannot do this - it always starts from scratch.
+//
+// The broker certificate is verified against the CA from setCACert(). Without
+// one connect() fails, unless setInsecure() was called on purpose.
+
+#define TLS_HANDSHAKE_TIMEOUT 10000   // milliseconds
+#define TLS_WRITE_TIMEOUT 5000        // milliseconds a write may wait for the peer to take the data
+#define TLS_SESSION_CACHE_SIZE 2048   // serialised session incl. ticket and peer certificate
+
+class TlsClient : public Client
+{
+public:
+  TlsClient();
+  ~TlsClient();
+
+  // PEM of the CA that signed the broker certificate
+  void setCACert(const char *pem);
+  // Accept any broker certificate. Anyone on the path can then read the MQTT credentials.
+  void setInsecure();
+
+  int connect(IPAddress ip, uint16_t port) override;
+  int connect(const char *host, uint16_t port) override;
+  size_t write(uint8_t byte) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+  int available() override;
+  int read() override;
+  int read(uint8_t *buffer, size_t size) override;
+  int peek() override;
+  void flush() override;
+  void stop() override;
+  uint8_t connected() override;
+  operator bool() override;
+
+  // Duration of the last successful handshake in microseconds
+  uint32_t handshakeMicros();
+  // Did the last handshake resume a cached session?
+  bool handshakeResumed();
+  // Drop the cached session - the next handshake is a full one
+  void forgetSession();
+
+private:
+  WiFiClient tcp;
+  const char *caCert;
+  bool insecure;
+  bool tlsUp;
+  int peeked; // -1 or a byte read ahead by peek()
+  uint32_t lastHandshakeMicros;
+  bool lastHandshakeResumed;
+  mbedtls_ssl_context ssl;
+  mbedtls_ssl_config config;
+  mbedtls_ctr_drbg_context drbg;
+  mbedtls_entropy_context entropy;
+  mbedtls_x509_crt ca;
+
+  void initContexts();
+  void freeContexts();
+  bool offerCachedSession();
+  void storeSession();
+};
+
+#endif
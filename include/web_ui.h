@@ -0,0 +1,80 @@
+#ifndef _WEB_UI_H
+#define _WEB_UI_H
+
+#include <Arduino.h>
+
+// Generated by tools/embed_web.py from web/index.html - do not edit.
+// 2244 bytes, 1028 gzipped.
+
+#define WEB_UI_INDEX_SIZE 1028
+#define WEB_UI_INDEX_ETAG "\"b7e3d9472a00b3f2\""
+
+static const uint8_t WEB_UI_INDEX[] PROGMEM = {
+  0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x7d, 0x56, 0x59, 0x6f, 0xe3, 0x36,
+  0x10, 0x7e, 0xd7, 0xaf, 0x98, 0x32, 0x2f, 0x12, 0x6c, 0xcb, 0xf6, 0xd6, 0x5b, 0xa4, 0x3e, 0xb2,
+  0x40, 0xd2, 0x2c, 0x10, 0x20, 0x6d, 0xd2, 0xc4, 0x45, 0xd1, 0x47, 0x5a, 0x1a, 0xd9, 0x6c, 0x24,
+  0x52, 0x25, 0x29, 0x3b, 0x69, 0xe0, 0xff, 0xbe, 0x43, 0x51, 0xf2, 0x95, 0x23, 0x0f, 0x11, 0x8f,
+  0x99, 0x6f, 0xae, 0x6f, 0x86, 0x9e, 0xfe, 0xf4, 0xdb, 0xdd, 0xd5, 0xfc, 0x9f, 0xfb, 0x6b, 0x58,
+  0xd9, 0x22, 0xbf, 0x08, 0xa6, 0xed, 0x07, 0x79, 0x4a, 0x9f, 0x02, 0x2d, 0x07, 0xc9, 0x0b, 0x9c,
+  0xb1, 0xb5, 0xc0, 0x4d, 0xa9, 0xb4, 0x65, 0x90, 0x28, 0x69, 0x51, 0xda, 0x19, 0xdb, 0x88, 0xd4,
+  0xae, 0x66, 0x29, 0xae, 0x45, 0x82, 0xbd, 0x7a, 0xd3, 0x05, 0x21, 0x85, 0x15, 0x3c, 0xef, 0x99,
+  0x84, 0xe7, 0x38, 0x1b, 0xc6, 0x03, 0x46, 0x30, 0x56, 0xd8, 0x1c, 0x2f, 0x2e, 0x2f, 0xe1, 0x86,
+  0x34, 0x75, 0xa2, 0x8a, 0x69, 0xdf, 0x1f, 0x05, 0x53, 0x63, 0x5f, 0xdc, 0x77, 0xa1, 0xd2, 0x17,
+  0x78, 0x85, 0x8c, 0xa0, 0x7b, 0x19, 0x2f, 0x44, 0xfe, 0x32, 0x06, 0xc3, 0xa5, 0xe9, 0x19, 0xd4,
+  0x22, 0x9b, 0x40, 0xc1, 0xf5, 0x52, 0xc8, 0x31, 0x0c, 0xb1, 0x98, 0xc0, 0x82, 0x27, 0x4f, 0x4b,
+  0xad, 0x2a, 0x99, 0x8e, 0xe1, 0x6c, 0x38, 0x1c, 0x4e, 0xc8, 0xa5, 0x5c, 0x69, 0xda, 0x20, 0xe2,
+  0x04, 0xb6, 0x35, 0x5a, 0xac, 0x85, 0x24, 0x95, 0x25, 0xa1, 0x1e, 0xc9, 0x67, 0xc9, 0x60, 0x2f,
+  0x5f, 0x2b, 0x6f, 0x83, 0xb3, 0x5c, 0x48, 0x34, 0x90, 0x8a, 0x75, 0xeb, 0x83, 0x11, 0xff, 0x23,
+  0x59, 0x8b, 0x47, 0xce, 0x5e, 0xc9, 0xd3, 0x94, 0x90, 0xc6, 0x30, 0x88, 0xbf, 0x60, 0x01, 0xa4,
+  0xbf, 0x50, 0x3a, 0x45, 0xdd, 0x5b, 0x28, 0x6b, 0x55, 0x41, 0x72, 0xe5, 0x33, 0x18, 0x95, 0x8b,
+  0x14, 0xce, 0x46, 0xa3, 0x11, 0x79, 0x2b, 0x64, 0x6f, 0x85, 0x62, 0xb9, 0xb2, 0x0e, 0xe3, 0x8b,
+  0xc3, 0x20, 0xa7, 0x2a, 0x12, 0x96, 0xa7, 0x06, 0xea, 0x80, 0xda, 0xe8, 0x06, 0xf1, 0x57, 0x87,
+  0xef, 0xff, 0x3b, 0x3b, 0x07, 0x96, 0xc9, 0x13, 0x1f, 0x3d, 0xb9, 0x6b, 0x2c, 0xb7, 0x48, 0x48,
+  0x5e, 0xaf, 0x67, 0x55, 0xd9, 0x64, 0xe6, 0x00, 0x7a, 0x10, 0xff, 0xea, 0x4e, 0xda, 0x48, 0xcf,
+  0xcf, 0xcf, 0x9d, 0xea, 0xb4, 0xdf, 0x24, 0x7c, 0xda, 0x6f, 0x4a, 0xec, 0x72, 0xe5, 0x0a, 0x3e,
+  0x3c, 0xae, 0x0f, 0xed, 0x83, 0xa9, 0x4b, 0x88, 0x48, 0x67, 0xac, 0x4e, 0x0f, 0xbb, 0x98, 0xf6,
+  0xe9, 0xc0, 0xa9, 0xf8, 0x48, 0x94, 0x4c, 0x72, 0x91, 0x3c, 0xcd, 0x98, 0x68, 0xb4, 0xc2, 0x61,
+  0xc4, 0x2e, 0x1e, 0xc8, 0xdf, 0x69, 0xdf, 0x8b, 0x7c, 0x26, 0x3b, 0x20, 0xd9, 0x9b, 0x34, 0xc7,
+  0x4f, 0x64, 0x35, 0x52, 0xa0, 0xda, 0x86, 0x0e, 0xd5, 0x2f, 0x0f, 0x84, 0x5b, 0xdf, 0xea, 0x5c,
+  0xec, 0x7d, 0x33, 0x89, 0x16, 0xa5, 0xbd, 0x08, 0xd6, 0x5c, 0x83, 0xaf, 0xea, 0x0c, 0x52, 0x95,
+  0x54, 0x05, 0x31, 0x36, 0x5e, 0xa2, 0xbd, 0xce, 0xd1, 0x2d, 0x2f, 0x5f, 0x6e, 0xd2, 0xb0, 0x89,
+  0x2b, 0x9a, 0x04, 0x99, 0xd2, 0x10, 0x3a, 0x15, 0x21, 0x53, 0x7c, 0x26, 0x15, 0xa2, 0x85, 0x5f,
+  0x4e, 0x67, 0x70, 0xde, 0xac, 0x3b, 0x9d, 0x08, 0x5e, 0x03, 0xf0, 0xb0, 0x31, 0x2f, 0x4b, 0x94,
+  0xe9, 0xd5, 0x4a, 0xe4, 0x69, 0xb8, 0x33, 0x90, 0x68, 0x24, 0x6f, 0x1a, 0x1b, 0x21, 0x23, 0x97,
+  0x58, 0x14, 0xc5, 0xc4, 0x8b, 0x19, 0xb0, 0x9c, 0x41, 0xc7, 0x03, 0x4d, 0x82, 0x6d, 0x10, 0x64,
+  0x95, 0x4c, 0xac, 0xa0, 0x70, 0x0d, 0xda, 0x5b, 0x42, 0x0c, 0x1d, 0x6c, 0x17, 0x2c, 0x3e, 0x5b,
+  0x6f, 0xe6, 0x63, 0xaf, 0x1d, 0x90, 0x93, 0x8e, 0x62, 0x27, 0x7d, 0xe5, 0xdb, 0x91, 0x4c, 0xb8,
+  0xdd, 0x1b, 0xec, 0x07, 0xdf, 0x06, 0x61, 0xd3, 0x0e, 0x27, 0xd8, 0x75, 0xa7, 0x24, 0x39, 0x37,
+  0xe6, 0x0f, 0xea, 0x72, 0xc2, 0x68, 0xbb, 0xe6, 0x1b, 0xb0, 0x66, 0xc9, 0x60, 0x0c, 0x8c, 0x9d,
+  0xe0, 0x52, 0xd2, 0x2b, 0x13, 0x7a, 0xb0, 0x0c, 0x6d, 0xb2, 0x0a, 0x59, 0x9f, 0x97, 0xa2, 0xef,
+  0x2f, 0x18, 0x79, 0xb6, 0x42, 0x19, 0xee, 0xe4, 0x43, 0x2a, 0x65, 0xa9, 0xa4, 0x41, 0xaf, 0x01,
+  0xa0, 0xd1, 0x56, 0x5a, 0x42, 0x7b, 0x1c, 0xff, 0x6b, 0x94, 0x0c, 0xa9, 0x10, 0x00, 0xdb, 0x37,
+  0xba, 0x1e, 0xb3, 0xd5, 0xf4, 0xbb, 0xd8, 0x17, 0x81, 0xea, 0x76, 0xcd, 0xc9, 0xf8, 0x5e, 0xd8,
+  0xe5, 0xa0, 0xeb, 0xd3, 0xdc, 0x6a, 0xc0, 0x2e, 0xc5, 0xbe, 0xa4, 0x1d, 0x18, 0x36, 0x79, 0x9e,
+  0xd4, 0xf7, 0xdb, 0xe6, 0x7b, 0x90, 0xac, 0xc6, 0x48, 0x9b, 0x33, 0x7f, 0xff, 0x61, 0x41, 0x3c,
+  0x05, 0x4f, 0xab, 0xc1, 0xfe, 0x16, 0xdf, 0x05, 0xb8, 0x5a, 0xb5, 0x70, 0x1b, 0x91, 0x89, 0x98,
+  0xa6, 0xa7, 0xc4, 0xc4, 0x62, 0x4a, 0x29, 0x3e, 0x3c, 0x17, 0xa5, 0xcb, 0x73, 0xaa, 0x36, 0x92,
+  0x45, 0xd0, 0x69, 0x1c, 0x67, 0x5d, 0xf8, 0xfd, 0xcf, 0xf9, 0xfc, 0x08, 0xa5, 0xf8, 0xcf, 0xda,
+  0xf7, 0x50, 0xea, 0xf3, 0x85, 0x56, 0x4f, 0xa8, 0x49, 0x9a, 0x8d, 0x9d, 0xce, 0xe1, 0x95, 0x1b,
+  0xde, 0xa7, 0x30, 0x36, 0x37, 0xae, 0xd2, 0x10, 0xce, 0x6f, 0x1f, 0x23, 0x5f, 0xe8, 0xe8, 0x7d,
+  0x37, 0xaa, 0x12, 0x0e, 0x00, 0xab, 0xd2, 0x8a, 0x02, 0x7d, 0xb9, 0x8e, 0x99, 0xb1, 0xeb, 0xef,
+  0x3a, 0x29, 0xc7, 0x04, 0x69, 0xef, 0x08, 0x8e, 0x66, 0x17, 0xda, 0x95, 0xa2, 0x81, 0xcc, 0xee,
+  0xef, 0x1e, 0xe7, 0x74, 0xe2, 0x98, 0x38, 0x06, 0x89, 0x1b, 0xf8, 0xeb, 0xe1, 0xf6, 0x11, 0xb9,
+  0x4e, 0x56, 0xf7, 0x5c, 0xf3, 0xc2, 0x84, 0xaf, 0x3b, 0xd0, 0x31, 0xf8, 0xc9, 0xb7, 0x8d, 0xde,
+  0xd8, 0xdd, 0xcd, 0x8a, 0xda, 0xa2, 0xc8, 0x20, 0xa4, 0x14, 0x65, 0x42, 0x17, 0x21, 0x6b, 0x66,
+  0x07, 0x10, 0xad, 0x76, 0x48, 0xdf, 0xa8, 0x2f, 0x1b, 0x7a, 0xb4, 0xde, 0x35, 0x08, 0xcc, 0xb3,
+  0xd0, 0x81, 0xbb, 0x81, 0x80, 0x6b, 0xaa, 0xa6, 0x1b, 0x22, 0xce, 0xb3, 0x6b, 0xb7, 0x79, 0x54,
+  0x95, 0x4e, 0x90, 0x14, 0xfc, 0x95, 0x93, 0xf7, 0xab, 0x98, 0x86, 0x75, 0x2d, 0x71, 0x2b, 0x0c,
+  0x71, 0x00, 0xb5, 0x1f, 0x30, 0x14, 0xdb, 0x9e, 0x9e, 0xb5, 0xa4, 0xb7, 0xec, 0xd0, 0x4d, 0xc9,
+  0x13, 0xd7, 0x75, 0xf5, 0x71, 0x9c, 0x72, 0xcb, 0xe3, 0x9a, 0xa3, 0x77, 0x59, 0xc8, 0xc0, 0x7b,
+  0xd2, 0x72, 0xf7, 0x40, 0xc4, 0x54, 0x0b, 0x63, 0x1d, 0x37, 0xc3, 0x41, 0xd7, 0x43, 0x44, 0x5d,
+  0x78, 0xf7, 0xde, 0xe3, 0x13, 0xe1, 0x23, 0x97, 0xae, 0xcf, 0x3c, 0x75, 0xe2, 0x1f, 0x79, 0x7a,
+  0xd0, 0x18, 0x7b, 0x2b, 0x30, 0x23, 0x8a, 0x0f, 0xd9, 0x31, 0xae, 0x92, 0x8a, 0xa6, 0x22, 0x05,
+  0xe4, 0x79, 0x32, 0x09, 0xda, 0x41, 0x41, 0x2b, 0xb4, 0xf5, 0xeb, 0xb2, 0xe6, 0x79, 0x43, 0xc1,
+  0x2e, 0xfc, 0x32, 0xa0, 0xbf, 0x68, 0x02, 0xfd, 0x3e, 0x24, 0xf4, 0x1c, 0x95, 0x44, 0x33, 0x99,
+  0xac, 0xb8, 0x5c, 0x12, 0xaf, 0xbd, 0x0c, 0x08, 0x03, 0x1c, 0x7e, 0x1e, 0x8c, 0xdc, 0xcb, 0xd5,
+  0x8c, 0x76, 0x7a, 0x04, 0xfc, 0x9b, 0xd5, 0xf7, 0x3f, 0x56, 0x7e, 0x00, 0xf5, 0x87, 0x30, 0xb6,
+  0xc4, 0x08, 0x00, 0x00,
+};
+
+#endif
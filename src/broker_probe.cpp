@@ -0,0 +1,104 @@
+#include <WiFi.h>
+#include <lwip/sockets.h>
+#include "broker_probe.h"
+
+void probeBrokers(const char *const hosts[], const uint16_t ports[], uint8_t count, uint32_t timeout, uint32_t rtt[])
+{
+  int sockets[BROKER_PROBE_MAX];
+  int64_t started[BROKER_PROBE_MAX];
+  int64_t deadline = esp_timer_get_time() + (int64_t)timeout * 1000;
+  if (count > BROKER_PROBE_MAX)
+  {
+    count = BROKER_PROBE_MAX;
+  }
+  // Start all connects without waiting for any of them
+  for (uint8_t index = 0; index < count; index += 1)
+  {
+    rtt[index] = BROKER_PROBE_UNREACHABLE;
+    sockets[index] = -1;
+    IPAddress ip;
+    if (!WiFi.hostByName(hosts[index], ip))
+    {
+      continue;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0)
+    {
+      continue;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(ports[index]);
+    address.sin_addr.s_addr = (uint32_t)ip;
+    started[index] = esp_timer_get_time();
+    int result = connect(fd, (struct sockaddr *)&address, sizeof(address));
+    if (result == 0)
+    {
+      // connected right away
+      rtt[index] = esp_timer_get_time() - started[index];
+      close(fd);
+    }
+    else if (errno == EINPROGRESS)
+    {
+      sockets[index] = fd;
+    }
+    else
+    {
+      close(fd);
+    }
+  }
+  // Then wait for them together - each one is done when it becomes writable
+  while (true)
+  {
+    fd_set writable;
+    FD_ZERO(&writable);
+    int maxFd = -1;
+    for (uint8_t index = 0; index < count; index += 1)
+    {
+      if (sockets[index] >= 0)
+      {
+        FD_SET(sockets[index], &writable);
+        maxFd = max(maxFd, sockets[index]);
+      }
+    }
+    int64_t remaining = deadline - esp_timer_get_time();
+    if (maxFd < 0 || remaining <= 0)
+    {
+      break;
+    }
+    struct timeval wait;
+    wait.tv_sec = remaining / 1000000;
+    wait.tv_usec = remaining % 1000000;
+    int ready = select(maxFd + 1, NULL, &writable, NULL, &wait);
+    int64_t now = esp_timer_get_time();
+    if (ready <= 0)
+    {
+      break;
+    }
+    for (uint8_t index = 0; index < count; index += 1)
+    {
+      if (sockets[index] >= 0 && FD_ISSET(sockets[index], &writable))
+      {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(sockets[index], SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error == 0)
+        {
+          rtt[index] = now - started[index];
+        }
+        close(sockets[index]);
+        sockets[index] = -1;
+      }
+    }
+  }
+  // Whatever did not answer in time is unreachable
+  for (uint8_t index = 0; index < count; index += 1)
+  {
+    if (sockets[index] >= 0)
+    {
+      close(sockets[index]);
+    }
+  }
+}
@@ -0,0 +1,145 @@
+#include <esp_pm.h>
+#include "cpu_governor.h"
+#include "scheduler.h"
+
+static bool usePowerManagement = false;
+static esp_pm_lock_handle_t boostLock = NULL;
+static bool boosted = false;
+static int64_t boostEnd = 0;   // esp_timer microseconds
+static int64_t stateSince = 0; // when boosted last changed
+static uint64_t lowMicros = 0;
+static uint64_t highMicros = 0;
+static uint32_t boosts = 0;
+static Histogram latency;
+
+static bool configure(bool lightSleep)
+{
+  esp_pm_config_esp32_t config;
+  config.max_freq_mhz = CPU_FREQ_HIGH;
+  config.min_freq_mhz = CPU_FREQ_LOW;
+  config.light_sleep_enable = lightSleep;
+  return esp_pm_configure(&config) == ESP_OK;
+}
+
+// Adds the time since the last change to the frequency we were at
+static void account(int64_t now)
+{
+  if (boosted)
+  {
+    highMicros += now - stateSince;
+  }
+  else
+  {
+    lowMicros += now - stateSince;
+  }
+  stateSince = now;
+}
+
+static void endBoost()
+{
+  int64_t now = esp_timer_get_time();
+  if (now < boostEnd)
+  {
+    // extended in the meantime
+    scheduleAction(endBoost, (boostEnd - now + 999) / 1000);
+    return;
+  }
+  account(now);
+  boosted = false;
+  if (usePowerManagement)
+  {
+    esp_pm_lock_release(boostLock);
+  }
+  else
+  {
+    setCpuFrequencyMhz(CPU_FREQ_LOW);
+  }
+}
+
+void cpuGovernorBegin()
+{
+  cancelAction(endBoost); // of a boost before begin, the frequency is set below
+  boostEnd = 0;
+  usePowerManagement = configure(false) && esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "boost", &boostLock) == ESP_OK;
+  if (!usePowerManagement)
+  {
+    setCpuFrequencyMhz(CPU_FREQ_LOW);
+  }
+  histogramReset(&latency);
+  boosted = false;
+  stateSince = esp_timer_get_time();
+}
+
+bool cpuGovernorUsesPowerManagement()
+{
+  return usePowerManagement;
+}
+
+bool cpuGovernorLightSleep(bool enable)
+{
+  if (!usePowerManagement)
+  {
+    return !enable;
+  }
+  if (configure(enable))
+  {
+    return true;
+  }
+  // The build has no tickless idle - keep the frequency scaling at least
+  configure(false);
+  return !enable;
+}
+
+void cpuBoost(unsigned long holdMillis)
+{
+  int64_t start = esp_timer_get_time();
+  int64_t end = start + holdMillis * 1000LL;
+  if (end > boostEnd)
+  {
+    boostEnd = end;
+  }
+  if (boosted)
+  {
+    return; // endBoost() waits for the new end
+  }
+  account(start);
+  boosted = true;
+  boosts += 1;
+  if (usePowerManagement)
+  {
+    esp_pm_lock_acquire(boostLock);
+  }
+  else
+  {
+    setCpuFrequencyMhz(CPU_FREQ_HIGH);
+  }
+  histogramAdd(&latency, esp_timer_get_time() - start);
+  scheduleAction(endBoost, holdMillis);
+}
+
+uint64_t cpuTimeLow()
+{
+  return (lowMicros + (boosted ? 0 : esp_timer_get_time() - stateSince)) / 1000;
+}
+
+uint64_t cpuTimeHigh()
+{
+  return (highMicros + (boosted ? esp_timer_get_time() - stateSince : 0)) / 1000;
+}
+
+uint32_t cpuBoostCount()
+{
+  return boosts;
+}
+
+const Histogram *cpuBoostLatency()
+{
+  return &latency;
+}
+
+uint64_t cpuEnergySaved()
+{
+  // milliseconds * milliamps * millivolts are nanojoules. Light sleep counts
+  // as low, so with light sleep on this is an upper bound.
+  return cpuTimeLow() * (CPU_MILLIAMPS_HIGH - CPU_MILLIAMPS_LOW) * CPU_MILLIVOLTS / 1000000;
+}
@@ -0,0 +1,145 @@
+#include "heap_guard.h"
+
+#ifdef HEAP_GUARD
+
+// -Wl,--wrap=malloc sends every call of malloc() to __wrap_malloc() and
+// __real_malloc() to the real one
+extern "C" void *__real_malloc(size_t size);
+extern "C" void *__real_calloc(size_t count, size_t size);
+extern "C" void *__real_realloc(void *pointer, size_t size);
+
+static HeapGuardEntry entries[HEAP_GUARD_CALLERS];
+static uint8_t used = 0;
+static uint32_t allocations = 0;
+static volatile bool armed = false;
+// Both cores allocate. A spinlock, a mutex would need the heap.
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+// In IRAM: malloc may be called while the flash cache is off
+static void IRAM_ATTR record(void *caller, size_t size)
+{
+  portENTER_CRITICAL_SAFE(&lock);
+  allocations += 1;
+  uint8_t index = 0;
+  while (index < used && entries[index].caller != caller)
+  {
+    index += 1;
+  }
+  if (index == used && used < HEAP_GUARD_CALLERS)
+  {
+    entries[index].caller = caller;
+    entries[index].count = 0;
+    entries[index].bytes = 0;
+    entries[index].largest = 0;
+    used += 1;
+  }
+  if (index < used)
+  {
+    entries[index].count += 1;
+    entries[index].bytes += size;
+    if (size > entries[index].largest)
+    {
+      entries[index].largest = size;
+    }
+  }
+  portEXIT_CRITICAL_SAFE(&lock);
+}
+
+extern "C" void *IRAM_ATTR __wrap_malloc(size_t size)
+{
+  if (armed)
+  {
+    record(__builtin_return_address(0), size);
+  }
+  return __real_malloc(size);
+}
+
+extern "C" void *IRAM_ATTR __wrap_calloc(size_t count, size_t size)
+{
+  if (armed)
+  {
+    record(__builtin_return_address(0), count * size);
+  }
+  return __real_calloc(count, size);
+}
+
+extern "C" void *IRAM_ATTR __wrap_realloc(void *pointer, size_t size)
+{
+  if (armed && size > 0)
+  {
+    record(__builtin_return_address(0), size);
+  }
+  return __real_realloc(pointer, size);
+}
+
+void heapGuardArm()
+{
+  armed = true;
+}
+
+bool heapGuardArmed()
+{
+  return armed;
+}
+
+uint32_t heapGuardAllocations()
+{
+  return allocations;
+}
+
+uint8_t heapGuardCount()
+{
+  return used;
+}
+
+bool heapGuardEntry(uint8_t index, HeapGuardEntry *entry)
+{
+  portENTER_CRITICAL_SAFE(&lock);
+  bool found = index < used;
+  if (found)
+  {
+    *entry = entries[index];
+  }
+  portEXIT_CRITICAL_SAFE(&lock);
+  return found;
+}
+
+void heapGuardReset()
+{
+  portENTER_CRITICAL_SAFE(&lock);
+  used = 0;
+  allocations = 0;
+  portEXIT_CRITICAL_SAFE(&lock);
+}
+
+#else
+
+void heapGuardArm()
+{
+}
+
+bool heapGuardArmed()
+{
+  return false;
+}
+
+uint32_t heapGuardAllocations()
+{
+  return 0;
+}
+
+uint8_t heapGuardCount()
+{
+  return 0;
+}
+
+bool heapGuardEntry(uint8_t, HeapGuardEntry *)
+{
+  return false;
+}
+
+void heapGuardReset()
+{
+}
+
+#endif
@@ -0,0 +1,80 @@
+#include "histogram.h"
+
+// 0..3 have a bucket each, above that every octave has four buckets
+static uint8_t bucketIndex(uint32_t value)
+{
+  if (value < 4)
+  {
+    return value;
+  }
+  if (value >= (1UL << 27))
+  {
+    return HISTOGRAM_BUCKETS - 1;
+  }
+  uint8_t octave = 31 - __builtin_clz(value);
+  return 4 * (octave - 1) + ((value >> (octave - 2)) & 3);
+}
+
+uint32_t histogramBucketLow(uint8_t bucket)
+{
+  if (bucket < 4)
+  {
+    return bucket;
+  }
+  uint8_t octave = bucket / 4 + 1;
+  return (uint32_t)(4 + bucket % 4) << (octave - 2);
+}
+
+uint32_t histogramBucketHigh(uint8_t bucket)
+{
+  if (bucket < 4)
+  {
+    return bucket;
+  }
+  if (bucket == HISTOGRAM_BUCKETS - 1)
+  {
+    return 0xFFFFFFFF;
+  }
+  uint8_t octave = bucket / 4 + 1;
+  return histogramBucketLow(bucket) + (1UL << (octave - 2)) - 1;
+}
+
+void histogramReset(Histogram *histogram)
+{
+  memset(histogram, 0, sizeof(Histogram));
+}
+
+void histogramAdd(Histogram *histogram, uint32_t value)
+{
+  histogram->counts[bucketIndex(value)] += 1;
+  histogram->total += 1;
+  histogram->sum += value;
+  if (value > histogram->maximum)
+  {
+    histogram->maximum = value;
+  }
+}
+
+uint32_t histogramPercentile(const Histogram *histogram, uint8_t percent)
+{
+  if (histogram->total == 0)
+  {
+    return 0;
+  }
+  // rank of the wanted value, rounded up
+  uint32_t rank = ((uint64_t)histogram->total * percent + 99) / 100;
+  if (rank == 0)
+  {
+    rank = 1;
+  }
+  uint32_t seen = 0;
+  for (uint8_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket += 1)
+  {
+    seen += histogram->counts[bucket];
+    if (seen >= rank)
+    {
+      return min(histogramBucketHigh(bucket), histogram->maximum);
+    }
+  }
+  return histogram->maximum;
+}
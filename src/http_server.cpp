@@ -0,0 +1,829 @@
+#include <lwip/sockets.h>
+#include "http_server.h"
+
+#define HTTP_STATE_FREE 0
+#define HTTP_STATE_READING 1
+#define HTTP_STATE_SENDING 2
+#define HTTP_STATE_STREAMING 3
+
+#define HTTP_INCOMPLETE 0
+#define HTTP_PARSED 200
+
+static char noText[1] = "";
+
+// Finds a header in "Name: value\r\n" lines before end, the name is not case sensitive.
+// Returns the start of the value (ended by \r) or NULL.
+static const char *findHeader(const char *line, const char *end, const char *name)
+{
+  size_t nameLength = strlen(name);
+  while (line != NULL && line < end && *line != '\0')
+  {
+    if (strncasecmp(line, name, nameLength) == 0 && line[nameLength] == ':')
+    {
+      const char *value = line + nameLength + 1;
+      while (*value == ' ')
+      {
+        value += 1;
+      }
+      return value;
+    }
+    line = strstr(line, "\r\n");
+    if (line != NULL)
+    {
+      line += 2;
+    }
+  }
+  return NULL;
+}
+
+static int hexDigit(char character)
+{
+  if (character >= '0' && character <= '9')
+  {
+    return character - '0';
+  }
+  if (character >= 'a' && character <= 'f')
+  {
+    return character - 'a' + 10;
+  }
+  if (character >= 'A' && character <= 'F')
+  {
+    return character - 'A' + 10;
+  }
+  return -1;
+}
+
+// Copies a URL encoded text of the given length, decoding %xx and +
+static void urlDecode(const char *from, size_t length, char *to, size_t size)
+{
+  size_t used = 0;
+  for (size_t index = 0; index < length && used + 1 < size; index += 1)
+  {
+    char character = from[index];
+    if (character == '+')
+    {
+      character = ' ';
+    }
+    else if (character == '%' && index + 2 < length && hexDigit(from[index + 1]) >= 0 && hexDigit(from[index + 2]) >= 0)
+    {
+      character = hexDigit(from[index + 1]) * 16 + hexDigit(from[index + 2]);
+      index += 2;
+    }
+    to[used] = character;
+    used += 1;
+  }
+  to[used] = '\0';
+}
+
+// Looks for name in "a=1&b=2" style arguments
+static bool findArg(const char *arguments, const char *name, char *value, size_t size)
+{
+  size_t nameLength = strlen(name);
+  const char *argument = arguments;
+  while (*argument != '\0')
+  {
+    const char *end = strchr(argument, '&');
+    if (end == NULL)
+    {
+      end = argument + strlen(argument);
+    }
+    if (strncmp(argument, name, nameLength) == 0 && (argument[nameLength] == '=' || argument + nameLength == end))
+    {
+      const char *start = argument + nameLength;
+      if (*start == '=')
+      {
+        start += 1;
+      }
+      urlDecode(start, end - start, value, size);
+      return true;
+    }
+    argument = *end == '&' ? end + 1 : end;
+  }
+  return false;
+}
+
+static const char *statusText(int status)
+{
+  switch (status)
+  {
+  case 200:
+    return "OK";
+  case 204:
+    return "No Content";
+  case 304:
+    return "Not Modified";
+  case 400:
+    return "Bad Request";
+  case 404:
+    return "Not Found";
+  case 413:
+    return "Payload Too Large";
+  case 500:
+    return "Internal Server Error";
+  case 503:
+    return "Service Unavailable";
+  default:
+    return "";
+  }
+}
+
+void HttpRequest::reset()
+{
+  fd = -1;
+  state = HTTP_STATE_FREE;
+  request[0] = '\0';
+  requestUsed = 0;
+  requestMethod = HTTP_METHOD_OTHER;
+  requestPath = noText;
+  requestQuery = noText;
+  requestHeaders = noText;
+  requestBody = noText;
+  responseHeaderUsed = 0;
+  responseUsed = 0;
+  responseStarted = false;
+  overflow = false;
+  streaming = false;
+  flashBody = NULL;
+  flashLength = 0;
+  partWriter = NULL;
+  part = 0;
+  sent = 0;
+}
+
+uint8_t HttpRequest::method()
+{
+  return requestMethod;
+}
+
+const char *HttpRequest::path()
+{
+  return requestPath;
+}
+
+bool HttpRequest::arg(const char *name, char *value, size_t size)
+{
+  return findArg(requestQuery, name, value, size) || (requestMethod == HTTP_METHOD_POST && findArg(requestBody, name, value, size));
+}
+
+const char *HttpRequest::body()
+{
+  return requestBody;
+}
+
+bool HttpRequest::header(const char *name, char *value, size_t size)
+{
+  const char *start = findHeader(requestHeaders, requestHeaders + strlen(requestHeaders), name);
+  if (start == NULL)
+  {
+    return false;
+  }
+  const char *end = strchr(start, '\r');
+  size_t length = end != NULL ? end - start : strlen(start);
+  if (length >= size)
+  {
+    length = size - 1;
+  }
+  memcpy(value, start, length);
+  value[length] = '\0';
+  return true;
+}
+
+void HttpRequest::appendHeader(const char *text)
+{
+  size_t length = strlen(text);
+  if (responseHeaderUsed + length > HTTP_HEADER_SIZE)
+  {
+    overflow = true;
+    return;
+  }
+  memcpy(responseHeader + responseHeaderUsed, text, length);
+  responseHeaderUsed += length;
+}
+
+void HttpRequest::beginResponse(int status, const char *type)
+{
+  char line[64];
+  responseStarted = true;
+  responseHeaderUsed = 0;
+  responseUsed = 0;
+  overflow = false;
+  streaming = false;
+  flashBody = NULL;
+  flashLength = 0;
+  partWriter = NULL;
+  part = 0;
+  sprintf(line, "HTTP/1.1 %d %s\r\n", status, statusText(status));
+  appendHeader(line);
+  addHeader("Content-Type", type);
+}
+
+void HttpRequest::addHeader(const char *name, const char *value)
+{
+  appendHeader(name);
+  appendHeader(": ");
+  appendHeader(value);
+  appendHeader("\r\n");
+}
+
+void HttpRequest::write(const char *data, size_t length)
+{
+  if (responseUsed + length > HTTP_RESPONSE_SIZE)
+  {
+    overflow = true;
+    return;
+  }
+  memcpy(response + responseUsed, data, length);
+  responseUsed += length;
+}
+
+void HttpRequest::print(const char *text)
+{
+  write(text, strlen(text));
+}
+
+void HttpRequest::writeFlash(const uint8_t *data, size_t length)
+{
+  flashBody = data;
+  flashLength = length;
+}
+
+void HttpRequest::send(int status, const char *type, const char *text)
+{
+  beginResponse(status, type);
+  print(text);
+}
+
+void HttpRequest::beginParts(int status, const char *type, HttpPartWriter writer)
+{
+  beginResponse(status, type);
+  partWriter = writer;
+}
+
+void HttpRequest::beginEventStream()
+{
+  beginResponse(200, "text/event-stream");
+  addHeader("Cache-Control", "no-cache");
+  streaming = true;
+}
+
+// data must be a single line
+void HttpRequest::writeEvent(const char *event, const char *data)
+{
+  print("event: ");
+  print(event);
+  print("\ndata: ");
+  print(data);
+  print("\n\n");
+}
+
+HttpServer::HttpServer(uint16_t port)
+{
+  this->port = port;
+  listenFd = -1;
+  routeCount = 0;
+  requests = 0;
+  bytes = 0;
+  histogramReset(&latencyHistogram);
+  for (uint8_t index = 0; index < HTTP_MAX_CONNECTIONS; index += 1)
+  {
+    connections[index].reset();
+  }
+}
+
+void HttpServer::on(const char *path, uint8_t method, HttpHandler handler)
+{
+  if (routeCount < HTTP_MAX_ROUTES)
+  {
+    routes[routeCount].path = path;
+    routes[routeCount].method = method;
+    routes[routeCount].handler = handler;
+    routeCount += 1;
+  }
+}
+
+void HttpServer::on(const char *path, HttpHandler handler)
+{
+  on(path, HTTP_METHOD_ANY, handler);
+}
+
+void HttpServer::begin()
+{
+  listenFd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listenFd < 0)
+  {
+    return;
+  }
+  int enable = 1;
+  setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(listenFd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listenFd, HTTP_MAX_CONNECTIONS) != 0)
+  {
+    ::close(listenFd);
+    listenFd = -1;
+    return;
+  }
+  fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+void HttpServer::poll()
+{
+  fd_set readable;
+  fd_set writable;
+  FD_ZERO(&readable);
+  FD_ZERO(&writable);
+  int maxFd = -1;
+  bool slotFree = false;
+  for (uint8_t index = 0; index < HTTP_MAX_CONNECTIONS; index += 1)
+  {
+    HttpRequest &connection = connections[index];
+    if (connection.state == HTTP_STATE_READING)
+    {
+      FD_SET(connection.fd, &readable);
+      maxFd = max(maxFd, connection.fd);
+    }
+    else if (connection.state == HTTP_STATE_SENDING)
+    {
+      FD_SET(connection.fd, &writable);
+      maxFd = max(maxFd, connection.fd);
+    }
+    else if (connection.state == HTTP_STATE_STREAMING)
+    {
+      // readable tells us when the browser went away
+      FD_SET(connection.fd, &readable);
+      if (connection.sent < connection.responseHeaderUsed + connection.responseUsed)
+      {
+        FD_SET(connection.fd, &writable);
+      }
+      maxFd = max(maxFd, connection.fd);
+    }
+    else
+    {
+      slotFree = true;
+    }
+  }
+  // New connections wait in the listen backlog while all slots are busy
+  if (listenFd >= 0 && slotFree)
+  {
+    FD_SET(listenFd, &readable);
+    maxFd = max(maxFd, listenFd);
+  }
+  if (maxFd < 0)
+  {
+    return;
+  }
+  struct timeval noWait;
+  noWait.tv_sec = 0;
+  noWait.tv_usec = 0;
+  if (select(maxFd + 1, &readable, &writable, NULL, &noWait) > 0)
+  {
+    for (uint8_t index = 0; index < HTTP_MAX_CONNECTIONS; index += 1)
+    {
+      HttpRequest &connection = connections[index];
+      if (connection.state == HTTP_STATE_READING && FD_ISSET(connection.fd, &readable))
+      {
+        receive(connection);
+      }
+      else if (connection.state == HTTP_STATE_SENDING && FD_ISSET(connection.fd, &writable))
+      {
+        transmit(connection);
+      }
+      else if (connection.state == HTTP_STATE_STREAMING)
+      {
+        if (FD_ISSET(connection.fd, &readable))
+        {
+          discard(connection);
+        }
+        if (connection.state == HTTP_STATE_STREAMING && FD_ISSET(connection.fd, &writable))
+        {
+          transmit(connection);
+        }
+      }
+    }
+    // Last, so a new connection cannot pick up the result of a closed one
+    if (listenFd >= 0 && slotFree && FD_ISSET(listenFd, &readable))
+    {
+      acceptConnections();
+    }
+  }
+  unsigned long now = millis();
+  for (uint8_t index = 0; index < HTTP_MAX_CONNECTIONS; index += 1)
+  {
+    HttpRequest &connection = connections[index];
+    if (connection.state == HTTP_STATE_STREAMING)
+    {
+      keepAlive(connection, now);
+    }
+    else if (connection.state != HTTP_STATE_FREE && now - connection.lastActivity > HTTP_TIMEOUT)
+    {
+      release(connection);
+    }
+  }
+}
+
+void HttpServer::acceptConnections()
+{
+  for (uint8_t index = 0; index < HTTP_MAX_CONNECTIONS; index += 1)
+  {
+    HttpRequest &connection = connections[index];
+    if (connection.state != HTTP_STATE_FREE)
+    {
+      continue;
+    }
+    int fd = ::accept(listenFd, NULL, NULL);
+    if (fd < 0)
+    {
+      return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    connection.reset();
+    connection.fd = fd;
+    connection.state = HTTP_STATE_READING;
+    connection.lastActivity = millis();
+    connection.started = esp_timer_get_time();
+  }
+}
+
+void HttpServer::receive(HttpRequest &connection)
+{
+  int received = recv(connection.fd, connection.request + connection.requestUsed, HTTP_REQUEST_SIZE - connection.requestUsed, MSG_DONTWAIT);
+  if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+  {
+    release(connection);
+    return;
+  }
+  if (received < 0)
+  {
+    return;
+  }
+  connection.requestUsed += received;
+  connection.request[connection.requestUsed] = '\0';
+  connection.lastActivity = millis();
+  int status = parse(connection);
+  if (status == HTTP_PARSED)
+  {
+    dispatch(connection);
+    finish(connection);
+  }
+  else if (status != HTTP_INCOMPLETE)
+  {
+    connection.send(status, "text/plain", status == 413 ? "Request too large" : "Bad request");
+    finish(connection);
+  }
+  else if (connection.requestUsed == HTTP_REQUEST_SIZE)
+  {
+    connection.send(413, "text/plain", "Request too large");
+    finish(connection);
+  }
+}
+
+// HTTP_PARSED when the request is complete, HTTP_INCOMPLETE while it is not,
+// otherwise the error status to answer with
+int HttpServer::parse(HttpRequest &connection)
+{
+  char *request = connection.request;
+  char *headerEnd = strstr(request, "\r\n\r\n");
+  if (headerEnd == NULL)
+  {
+    return HTTP_INCOMPLETE; // not all of it yet
+  }
+  char *lineEnd = strstr(request, "\r\n");
+  char *body = headerEnd + 4;
+  size_t headerLength = body - request;
+  const char *length = findHeader(lineEnd + 2, headerEnd + 2, "Content-Length");
+  size_t contentLength = 0;
+  if (length != NULL)
+  {
+    // Plain decimal digits only - strtoul() would take a sign or 0x and wrap around
+    const char *digit = length;
+    while (*digit >= '0' && *digit <= '9')
+    {
+      if (contentLength > HTTP_REQUEST_SIZE)
+      {
+        return 413; // before it can overflow
+      }
+      contentLength = contentLength * 10 + (*digit - '0');
+      digit += 1;
+    }
+    if (digit == length || (*digit != '\r' && *digit != ' '))
+    {
+      return 400;
+    }
+  }
+  if (contentLength > HTTP_REQUEST_SIZE - headerLength)
+  {
+    return 413; // it would never fit the request buffer
+  }
+  if (contentLength > connection.requestUsed - headerLength)
+  {
+    return HTTP_INCOMPLETE;
+  }
+  body[contentLength] = '\0';
+  headerEnd[2] = '\0'; // the headers keep their last \r\n
+  *lineEnd = '\0';
+  connection.requestHeaders = lineEnd + 2;
+  connection.requestBody = body;
+  // Request line: METHOD /path?query HTTP/1.1
+  char *target = strchr(request, ' ');
+  if (target == NULL)
+  {
+    return HTTP_PARSED; // dispatch() answers it with a 404
+  }
+  *target = '\0';
+  target += 1;
+  if (strcmp(request, "GET") == 0)
+  {
+    connection.requestMethod = HTTP_METHOD_GET;
+  }
+  else if (strcmp(request, "POST") == 0)
+  {
+    connection.requestMethod = HTTP_METHOD_POST;
+  }
+  char *version = strchr(target, ' ');
+  if (version != NULL)
+  {
+    *version = '\0';
+  }
+  char *query = strchr(target, '?');
+  if (query != NULL)
+  {
+    *query = '\0';
+    connection.requestQuery = query + 1;
+  }
+  connection.requestPath = target;
+  return HTTP_PARSED;
+}
+
+void HttpServer::dispatch(HttpRequest &connection)
+{
+  for (uint8_t index = 0; index < routeCount; index += 1)
+  {
+    Route &route = routes[index];
+    if (strcmp(route.path, connection.requestPath) == 0 && (route.method == HTTP_METHOD_ANY || route.method == connection.requestMethod))
+    {
+      route.handler(connection);
+      return;
+    }
+  }
+  connection.send(404, "text/plain", "Not found");
+}
+
+void HttpServer::finish(HttpRequest &connection)
+{
+  if (connection.partWriter != NULL)
+  {
+    connection.partWriter(connection, 0);
+  }
+  if (!connection.responseStarted)
+  {
+    connection.send(500, "text/plain", "No response");
+  }
+  if (connection.overflow)
+  {
+    connection.send(500, "text/plain", "Response too large");
+  }
+  if (connection.streaming && eventStreams() >= HTTP_MAX_EVENT_STREAMS)
+  {
+    connection.send(503, "text/plain", "Too many event streams");
+  }
+  if (connection.streaming)
+  {
+    // No length - the stream ends when one side closes it
+    connection.appendHeader("\r\n");
+    connection.state = HTTP_STATE_STREAMING;
+  }
+  else if (connection.partWriter != NULL)
+  {
+    // No length either - the body ends when we close the connection
+    connection.appendHeader("Connection: close\r\n\r\n");
+    connection.state = HTTP_STATE_SENDING;
+  }
+  else
+  {
+    char line[48];
+    sprintf(line, "Content-Length: %u\r\n", (unsigned int)(connection.responseUsed + connection.flashLength));
+    connection.appendHeader(line);
+    connection.appendHeader("Connection: close\r\n\r\n");
+    connection.state = HTTP_STATE_SENDING;
+  }
+  connection.sent = 0;
+  transmit(connection);
+}
+
+void HttpServer::transmit(HttpRequest &connection)
+{
+  size_t buffered = connection.responseHeaderUsed + connection.responseUsed;
+  size_t total = buffered + connection.flashLength;
+  while (connection.sent < total || (connection.partWriter != NULL && nextPart(connection)))
+  {
+    if (connection.overflow)
+    {
+      abort(connection); // the headers are out, a 500 is too late
+      return;
+    }
+    buffered = connection.responseHeaderUsed + connection.responseUsed;
+    total = buffered + connection.flashLength;
+    const void *data;
+    size_t length;
+    if (connection.sent < connection.responseHeaderUsed)
+    {
+      data = connection.responseHeader + connection.sent;
+      length = connection.responseHeaderUsed - connection.sent;
+    }
+    else if (connection.sent < buffered)
+    {
+      data = connection.response + connection.sent - connection.responseHeaderUsed;
+      length = buffered - connection.sent;
+    }
+    else
+    {
+      // lwIP copies from flash straight into its send buffer
+      data = connection.flashBody + connection.sent - buffered;
+      length = total - connection.sent;
+    }
+    int written = ::send(connection.fd, data, length, MSG_DONTWAIT);
+    if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      return; // the socket buffer is full, poll() comes back when it is writable
+    }
+    if (written < 0)
+    {
+      release(connection);
+      return;
+    }
+    if (written == 0)
+    {
+      abort(connection); // nothing was sent, a FIN would pass the rest off as complete
+      return;
+    }
+    connection.sent += written;
+    bytes += written;
+    connection.lastActivity = millis();
+  }
+  if (connection.started != 0)
+  {
+    requests += 1;
+    histogramAdd(&latencyHistogram, esp_timer_get_time() - connection.started);
+    connection.started = 0;
+  }
+  if (connection.state != HTTP_STATE_STREAMING)
+  {
+    release(connection);
+  }
+}
+
+// Puts the next part of a parted response into the emptied response buffer, false when the body is complete
+bool HttpServer::nextPart(HttpRequest &connection)
+{
+  connection.responseHeaderUsed = 0;
+  connection.responseUsed = 0;
+  connection.sent = 0;
+  // Empty parts are skipped, send() of nothing would return 0 like a closed connection
+  do
+  {
+    connection.part += 1;
+    if (connection.part == 0 || !connection.partWriter(connection, connection.part))
+    {
+      connection.partWriter = NULL;
+      return false;
+    }
+  } while (connection.responseUsed == 0 && !connection.overflow);
+  return true;
+}
+
+// Browsers send nothing on an event stream, so anything readable is the end of it
+void HttpServer::discard(HttpRequest &connection)
+{
+  char scratch[32];
+  int received = recv(connection.fd, scratch, sizeof(scratch), MSG_DONTWAIT);
+  if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+  {
+    release(connection);
+  }
+}
+
+// A comment now and then finds dead streams, a stream that cannot send is dropped
+void HttpServer::keepAlive(HttpRequest &connection, unsigned long now)
+{
+  if (now - connection.lastActivity <= HTTP_EVENT_KEEPALIVE)
+  {
+    return;
+  }
+  if (connection.sent < connection.responseHeaderUsed + connection.responseUsed)
+  {
+    release(connection);
+    return;
+  }
+  if (compact(connection, 3))
+  {
+    connection.print(":\n\n");
+    connection.lastActivity = now;
+  }
+}
+
+// Moves what is still unsent to the front of the send buffer. False if needed bytes do not fit after that.
+bool HttpServer::compact(HttpRequest &connection, size_t needed)
+{
+  if (connection.sent >= connection.responseHeaderUsed)
+  {
+    size_t done = connection.sent - connection.responseHeaderUsed;
+    memmove(connection.response, connection.response + done, connection.responseUsed - done);
+    connection.responseUsed -= done;
+    connection.responseHeaderUsed = 0;
+    connection.sent = 0;
+  }
+  return connection.responseUsed + needed <= HTTP_RESPONSE_SIZE;
+}
+
+void HttpServer::sendEvent(const char *event, const char *data)
+{
+  // "event: " event "\ndata: " data "\n\n"
+  size_t length = 7 + strlen(event) + 7 + strlen(data) + 2;
+  for (uint8_t index = 0; index < HTTP_MAX_CONNECTIONS; index += 1)
+  {
+    HttpRequest &connection = connections[index];
+    if (connection.state != HTTP_STATE_STREAMING)
+    {
+      continue;
+    }
+    if (!compact(connection, length))
+    {
+      release(connection); // too far behind
+      continue;
+    }
+    if (connection.sent == connection.responseHeaderUsed + connection.responseUsed)
+    {
+      connection.lastActivity = millis(); // nothing was waiting, the timeout starts now
+    }
+    connection.writeEvent(event, data);
+    transmit(connection);
+  }
+}
+
+uint8_t HttpServer::eventStreams()
+{
+  uint8_t count = 0;
+  for (uint8_t index = 0; index < HTTP_MAX_CONNECTIONS; index += 1)
+  {
+    if (connections[index].state == HTTP_STATE_STREAMING)
+    {
+      count += 1;
+    }
+  }
+  return count;
+}
+
+void HttpServer::release(HttpRequest &connection)
+{
+  if (connection.fd >= 0)
+  {
+    ::close(connection.fd);
+  }
+  connection.reset();
+}
+
+// Closes with a reset instead of a FIN, the client must not take what it got as the whole body
+void HttpServer::abort(HttpRequest &connection)
+{
+  if (connection.fd >= 0)
+  {
+    struct linger reset;
+    reset.l_onoff = 1;
+    reset.l_linger = 0;
+    setsockopt(connection.fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+  }
+  release(connection);
+}
+
+uint8_t HttpServer::openConnections()
+{
+  uint8_t count = 0;
+  for (uint8_t index = 0; index < HTTP_MAX_CONNECTIONS; index += 1)
+  {
+    if (connections[index].state != HTTP_STATE_FREE)
+    {
+      count += 1;
+    }
+  }
+  return count;
+}
+
+uint32_t HttpServer::requestCount()
+{
+  return requests;
+}
+
+uint32_t HttpServer::bytesSent()
+{
+  return bytes;
+}
+
+const Histogram *HttpServer::latency()
+{
+  return &latencyHistogram;
+}
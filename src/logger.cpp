@@ -0,0 +1,231 @@
+#include <atomic>
+#include <stdarg.h>
+#include <lwip/sockets.h>
+#include "logger.h"
+
+static_assert(LOG_QUEUE_SIZE > 0 && (LOG_QUEUE_SIZE & (LOG_QUEUE_SIZE - 1)) == 0, "LOG_QUEUE_SIZE must be a power of two");
+
+// A bounded queue for several producers and one consumer. Every slot has a
+// sequence number: a producer may claim a slot whose sequence equals the
+// position, it publishes the line by setting the sequence to position + 1,
+// and the drain task frees the slot for the next round with position +
+// LOG_QUEUE_SIZE. Producers only race each other for head, with a
+// compare-and-swap that never waits. A slot stores its sequence less its own
+// index, so the all zero state of a static is an empty queue.
+struct LogRecord
+{
+  std::atomic<uint32_t> sequence;
+  uint8_t level;
+  uint8_t module;
+  uint32_t millis;
+  char text[LOG_LINE_SIZE];
+};
+
+static LogRecord records[LOG_QUEUE_SIZE];
+static std::atomic<uint32_t> head(0); // next position to claim
+static uint32_t tail = 0;             // next position to drain, log task only
+static std::atomic<uint32_t> drops(0);
+static uint32_t dropsReported = 0;
+static uint32_t highWater = 0;
+static TaskHandle_t logTask = NULL;
+static_assert(LOG_MODULES == 8, "one level and one name per module");
+static uint8_t levels[LOG_MODULES] = {LOG_LEVEL, LOG_LEVEL, LOG_LEVEL, LOG_LEVEL, LOG_LEVEL, LOG_LEVEL, LOG_LEVEL, LOG_LEVEL};
+
+static const char *moduleNames[LOG_MODULES] = {"main", "display", "touch", "intercom", "wifi", "mqtt", "http", "power"};
+static const char levelLetters[] = "?EWID";
+static const uint8_t syslogSeverities[] = {7, 3, 4, 6, 7};
+#define LOG_SYSLOG_FACILITY 16 // local0
+
+static volatile uint32_t udpIp = 0;
+static volatile uint16_t udpPort = 0;
+static char udpHostname[32] = "intercom"; // no spaces, syslog ends the host name at one
+static int udpSocket = -1;
+
+// All of the state above is constant initialised, there is no constructor to
+// run first. Global constructors in other files may log.
+
+// The sequence of position as its slot stores it
+static uint32_t slotSequence(uint32_t position)
+{
+  return position & ~(uint32_t)(LOG_QUEUE_SIZE - 1);
+}
+
+void logWrite(uint8_t level, uint8_t module, const char *format, ...)
+{
+  if (module >= LOG_MODULES || level > levels[module])
+  {
+    return;
+  }
+  uint32_t position = head.load(std::memory_order_relaxed);
+  LogRecord *record;
+  while (true)
+  {
+    record = &records[position & (LOG_QUEUE_SIZE - 1)];
+    int32_t difference = (int32_t)(record->sequence.load(std::memory_order_acquire) - slotSequence(position));
+    if (difference == 0)
+    {
+      // on failure position is the current head and we try that
+      if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+      {
+        break;
+      }
+    }
+    else if (difference < 0)
+    {
+      // the drain task has not freed the slot yet: full
+      drops.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    else
+    {
+      position = head.load(std::memory_order_relaxed); // another task took it
+    }
+  }
+  record->level = level;
+  record->module = module;
+  record->millis = millis();
+  va_list arguments;
+  va_start(arguments, format);
+  vsnprintf(record->text, sizeof(record->text), format, arguments);
+  va_end(arguments);
+  record->sequence.store(slotSequence(position) + 1, std::memory_order_release);
+  if (logTask != NULL)
+  {
+    xTaskNotifyGive(logTask);
+  }
+}
+
+static void output(uint8_t level, uint8_t module, uint32_t time, const char *text)
+{
+  char line[LOG_LINE_SIZE + 48];
+  int length;
+#ifdef LOG_SERIAL
+  length = snprintf(line, sizeof(line), "%lu %c %s: %s\n", (unsigned long)time, levelLetters[level], moduleNames[module], text);
+  Serial.write((const uint8_t *)line, min(length, (int)sizeof(line) - 1));
+#endif
+  if (udpIp == 0)
+  {
+    return;
+  }
+  if (udpSocket < 0)
+  {
+    udpSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (udpSocket < 0)
+    {
+      return;
+    }
+  }
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(udpPort);
+  address.sin_addr.s_addr = udpIp;
+  length = snprintf(line, sizeof(line), "<%u>%s %s: %s", LOG_SYSLOG_FACILITY * 8 + syslogSeverities[level], udpHostname,
+                    moduleNames[module], text);
+  // without a link this fails at once, the line is lost for the syslog server only
+  sendto(udpSocket, line, min(length, (int)sizeof(line) - 1), MSG_DONTWAIT, (struct sockaddr *)&address, sizeof(address));
+}
+
+static void drain()
+{
+  while (true)
+  {
+    LogRecord *record = &records[tail & (LOG_QUEUE_SIZE - 1)];
+    if (record->sequence.load(std::memory_order_acquire) != slotSequence(tail) + 1)
+    {
+      break; // empty, or the next line is still being written
+    }
+    uint32_t depth = head.load(std::memory_order_relaxed) - tail;
+    if (depth > highWater)
+    {
+      highWater = depth;
+    }
+    uint8_t level = record->level;
+    uint8_t module = record->module;
+    uint32_t time = record->millis;
+    char text[LOG_LINE_SIZE];
+    memcpy(text, record->text, sizeof(text));
+    record->sequence.store(slotSequence(tail) + LOG_QUEUE_SIZE, std::memory_order_release);
+    tail += 1;
+    output(level, module, time, text);
+  }
+  uint32_t dropped = drops.load(std::memory_order_relaxed);
+  if (dropped != dropsReported)
+  {
+    char text[48];
+    sprintf(text, "%lu lines dropped", (unsigned long)(dropped - dropsReported));
+    dropsReported = dropped;
+    output(LOG_WARNING, LOG_MAIN, millis(), text);
+  }
+}
+
+static void runLogTask(void *parameter)
+{
+  while (true)
+  {
+    drain();
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  }
+}
+
+void logBegin()
+{
+  if (logTask == NULL)
+  {
+    xTaskCreate(runLogTask, "log", LOG_TASK_STACK, NULL, LOG_TASK_PRIORITY, &logTask);
+  }
+}
+
+void logSetLevel(uint8_t module, uint8_t level)
+{
+  if (module < LOG_MODULES)
+  {
+    levels[module] = min(level, (uint8_t)LOG_DEBUG);
+  }
+}
+
+uint8_t logLevel(uint8_t module)
+{
+  return module < LOG_MODULES ? levels[module] : 0;
+}
+
+const char *logModuleName(uint8_t module)
+{
+  return module < LOG_MODULES ? moduleNames[module] : "";
+}
+
+int8_t logModule(const char *name)
+{
+  for (uint8_t module = 0; module < LOG_MODULES; module += 1)
+  {
+    if (strcmp(moduleNames[module], name) == 0)
+    {
+      return module;
+    }
+  }
+  return -1;
+}
+
+void logSetUdpSink(uint32_t ip, uint16_t port, const char *hostname)
+{
+  strncpy(udpHostname, hostname, sizeof(udpHostname) - 1);
+  for (char *character = udpHostname; *character; character += 1)
+  {
+    if (*character == ' ')
+    {
+      *character = '-';
+    }
+  }
+  udpPort = port;
+  udpIp = ip;
+}
+
+uint32_t logDropped()
+{
+  return drops.load(std::memory_order_relaxed);
+}
+
+uint32_t logMaxDepth()
+{
+  return highWater;
+}
@@ -0,0 +1,112 @@
+#include <esp_task_wdt.h>
+#include "loop_watchdog.h"
+
+LoopWatchdog::LoopWatchdog(const char *task, const char *const *phaseNames, uint8_t phases, uint32_t thresholdMicros)
+    : taskName(task), names(phaseNames), phaseCount(min(phases, (uint8_t)LOOP_WATCHDOG_MAX_PHASES)), threshold(thresholdMicros),
+      iterationStart(0), phaseStart(0), overrunCount(0), lastOverrun(0), lastPhase(0), lastPhaseMicros(0)
+{
+  for (uint8_t phase = 0; phase < LOOP_WATCHDOG_MAX_PHASES; phase += 1)
+  {
+    iterationPhases[phase] = 0;
+    histogramReset(&histograms[phase]);
+    phaseOverrunCounts[phase] = 0;
+  }
+}
+
+void LoopWatchdog::begin()
+{
+  // Updates the timeout if the core has set the watchdog up already
+  esp_task_wdt_init(LOOP_WATCHDOG_TIMEOUT, true);
+  esp_task_wdt_add(NULL);
+  startIteration();
+}
+
+void LoopWatchdog::startIteration()
+{
+  iterationStart = micros();
+  phaseStart = iterationStart;
+  for (uint8_t phase = 0; phase < phaseCount; phase += 1)
+  {
+    iterationPhases[phase] = 0;
+  }
+}
+
+void LoopWatchdog::mark(uint8_t phase)
+{
+  unsigned long now = micros();
+  if (phase < phaseCount)
+  {
+    iterationPhases[phase] += now - phaseStart;
+  }
+  phaseStart = now;
+}
+
+bool LoopWatchdog::endIteration()
+{
+  esp_task_wdt_reset();
+  uint32_t total = micros() - iterationStart;
+  uint8_t slowest = 0;
+  for (uint8_t phase = 0; phase < phaseCount; phase += 1)
+  {
+    histogramAdd(&histograms[phase], iterationPhases[phase]);
+    if (iterationPhases[phase] > iterationPhases[slowest])
+    {
+      slowest = phase;
+    }
+  }
+  if (total <= threshold)
+  {
+    return false;
+  }
+  overrunCount += 1;
+  phaseOverrunCounts[slowest] += 1;
+  lastOverrun = total;
+  lastPhase = slowest;
+  lastPhaseMicros = iterationPhases[slowest];
+  return true;
+}
+
+const char *LoopWatchdog::task()
+{
+  return taskName;
+}
+
+uint8_t LoopWatchdog::phases()
+{
+  return phaseCount;
+}
+
+const char *LoopWatchdog::phaseName(uint8_t phase)
+{
+  return phase < phaseCount ? names[phase] : "";
+}
+
+const Histogram *LoopWatchdog::phaseHistogram(uint8_t phase)
+{
+  return &histograms[phase < phaseCount ? phase : 0];
+}
+
+uint32_t LoopWatchdog::phaseOverruns(uint8_t phase)
+{
+  return phase < phaseCount ? phaseOverrunCounts[phase] : 0;
+}
+
+uint32_t LoopWatchdog::overruns()
+{
+  return overrunCount;
+}
+
+uint32_t LoopWatchdog::lastOverrunMicros()
+{
+  return lastOverrun;
+}
+
+uint8_t LoopWatchdog::lastOverrunPhase()
+{
+  return lastPhase;
+}
+
+uint32_t LoopWatchdog::lastOverrunPhaseMicros()
+{
+  return lastPhaseMicros;
+}
@@ -23,12 +23,29 @@
 #include <XPT2046_Touchscreen.h> // Not working with my board
 #include <TFT_eSPI.h>
 #include <Preferences.h>
-#include <WebServer.h>
-#include <PubSubClient.h> // MQTT
 #include "Free_Fonts.h"
 #include "constants.h"
 #include "credentials.h"
 #include "logo.h"
+#include "mqtt_client.h"
+#include "broker_probe.h"
+#include "histogram.h"
+#include "cpu_governor.h"
+#include "loop_watchdog.h"
+#include "profiler.h"
+#include "logger.h"
+#include "heap_guard.h"
+#include "telemetry.h"
+#include "tls_client.h"
+#include "http_server.h"
+#include "web_ui.h"
+#include "scheduler.h"
+#include "spsc_queue.h"
+#include <esp_pm.h>
+#include <esp_wifi.h>
+#include <esp_sleep.h>
+#include <driver/gpio.h>
+#include <hal/gpio_ll.h>
 
 #define BACKLIGHT_PIN 21
 #define INTERCOM_PIN 22
@@ -40,21 +57,8 @@
 #define XPT2046_CLK 25  // T_CLK
 #define XPT2046_CS 33   // T_CS
 
-// We can globally disable Serial comms by undefining this
-#define USE_SERIAL
-void print(const char *text)
-{
-#ifdef USE_SERIAL
-  Serial.print(text);
-#endif
-}
-
-void println(const char *text)
-{
-#ifdef USE_SERIAL
-  Serial.println(text);
-#endif
-}
+// Show the logo only until the network is up instead of for 3 seconds first
+#define FAST_BOOT
 
 SPIClass mySPI = SPIClass(VSPI);
 XPT2046_Touchscreen touchscreen(XPT2046_CS /*, XPT2046_IRQ*/);
@@ -68,7 +72,8 @@ char uptime[32] = "";
 
 #define INTERCOM_IDLE ""
 #define INTERCOM_RINGING "DING DONG"
-char intercomState[32] = INTERCOM_IDLE;
+char intercomState[32] = INTERCOM_IDLE; // network task
+bool ringing = false;                    // UI task: the ringing screen is up
 
 #define UNCALIBRATED TS_Point(-1, -1, 0);
 TS_Point touchPoint;
@@ -88,7 +93,7 @@ TS_Point calibrationBottomRight = UNCALIBRATED;
 #define TOUCH_ACTION_RESET 3
 #define TOUCH_ACTION_RECONNECT 4
 
-#define SCREEN_TIMEOUT 1000 * 60 * 5; // 5 minutes sounds reasonable
+#define SCREEN_TIMEOUT (1000 * 60 * 5) // 5 minutes sounds reasonable
 
 // #define FONT_HEIGHT 30
 #define FONT_NUMBER 4 // Use GFXFF to use an Adafruit free font - I like font 4
@@ -96,12 +101,95 @@ TS_Point calibrationBottomRight = UNCALIBRATED;
 #define FONT_HEIGHT 26
 #define DISPLAY_LINES 8
 
-char lines[DISPLAY_LINES][32];
-char displayed[DISPLAY_LINES][32];
+char lines[DISPLAY_LINES][32];       // network task: what HTTP and the event streams show
+char screenLines[DISPLAY_LINES][32]; // UI task: what the display should show
+char displayed[DISPLAY_LINES][32];   // UI task: what it shows right now
+uint32_t statusVersion = 0; // changes with the lines and the intercom state, the ETag of /api/status
 
 uint8_t displayMode = DISPLAY_OFF;
 uint8_t touchAction = TOUCH_ACTION_NONE;
 
+// The network task (WiFi, MQTT and HTTP) runs on core 0, the UI task - the
+// Arduino loop() with the display, touch and the intercom pin - on core 1, so
+// a stalled TCP connection cannot freeze the screen. The tasks share no state:
+// each owns its variables and they send each other messages about changes
+// through two lock-free queues.
+#define NETWORK_CORE 0
+#define NETWORK_TASK_STACK 8192 // bytes, a TLS handshake needs most of it
+#define NETWORK_TASK_PRIORITY 1 // the same as loop()
+#define TASK_QUEUE_SIZE 32      // messages per direction
+
+#define MESSAGE_LINE 1      // both ways: line <value> is now <text>
+#define MESSAGE_RING 2      // to the network: the intercom rang (1) or stopped (0), to the UI: ring or stop as if it had
+#define MESSAGE_ACTIVITY 3  // to the network: the screen was touched
+#define MESSAGE_DISPLAY 4   // to the network: the display was turned on (1) or off (0)
+#define MESSAGE_BACKLIGHT 5 // to the UI: turn the display on (1) or off (0)
+#define MESSAGE_SLEEP 6     // to the UI: allow light sleep (1) or not (0), to the network: it is on (1) or off (0)
+#define MESSAGE_BOOTED 7    // to the UI: the broker is connected, the boot logo can go
+
+struct TaskMessage
+{
+  uint8_t type;
+  int32_t value;
+  int64_t time; // esp_timer microseconds when it was sent
+  char text[32];
+};
+typedef SpscQueue<TaskMessage, TASK_QUEUE_SIZE> TaskQueue;
+
+TaskQueue uiQueue;      // network task to UI task
+TaskQueue networkQueue; // UI task to network task
+TaskHandle_t uiTask = NULL;
+TaskHandle_t networkTask = NULL;
+
+void wakeTask(TaskHandle_t task)
+{
+  if (task != NULL)
+  {
+    xTaskNotifyGive(task);
+  }
+}
+
+bool onNetworkTask()
+{
+  return networkTask != NULL && xTaskGetCurrentTaskHandle() == networkTask;
+}
+
+// False if the queue is full. Lines, the ring and the sleep state are sent
+// again later, see resendToUi() and resendToNetwork().
+bool sendMessage(TaskQueue &queue, TaskHandle_t task, uint8_t type, int32_t value, const char *text, int64_t time)
+{
+  TaskMessage message;
+  message.type = type;
+  message.value = value;
+  message.time = time;
+  message.text[0] = '\0';
+  if (text != NULL)
+  {
+    strncpy(message.text, text, sizeof(message.text) - 1);
+    message.text[sizeof(message.text) - 1] = '\0';
+  }
+  bool queued = queue.push(message);
+  wakeTask(task);
+  return queued;
+}
+
+bool sendToUi(uint8_t type, int32_t value, const char *text)
+{
+  return sendMessage(uiQueue, uiTask, type, value, text, esp_timer_get_time());
+}
+
+bool sendToNetwork(uint8_t type, int32_t value, const char *text)
+{
+  return sendMessage(networkQueue, networkTask, type, value, text, esp_timer_get_time());
+}
+
+uint8_t linesNotSent = 0;       // network task: bit per line the UI has not been told about
+int8_t sleepNotSent = -1;       // network task: the light sleep permission the UI has not been told about
+uint8_t screenLinesNotSent = 0; // UI task: the same the other way round
+int8_t ringNotSent = -1;        // UI task: the ring state the network task has not been told about
+int64_t ringNotSentTime = 0;
+int8_t sleepStateNotSent = -1;  // UI task: the light sleep state the network task has not been told about
+
 void clearDisplay()
 {
   tft.fillScreen(BACKGROUND_COLOUR);
@@ -112,30 +200,72 @@ void clearDisplay()
   }
 }
 
+// Boot phases, each marked once with the esp_timer time it was reached at.
+// The UI task marks the ones up to BOOT_READY and BOOT_SCREEN, the network
+// task BOOT_WIFI and BOOT_MQTT, so every slot has a single writer. A ring can
+// be delivered - the device is alert capable - once BOOT_READY and BOOT_MQTT
+// are both reached.
+#define BOOT_PREFERENCES 0 // calibration loaded
+#define BOOT_DISPLAY 1     // display and touch initialised
+#define BOOT_LOGO 2        // logo drawn
+#define BOOT_READY 3       // setup() done: the intercom pin and touch are watched
+#define BOOT_SCREEN 4      // the logo made way for the status or ringing screen
+#define BOOT_WIFI 5        // WiFi connected
+#define BOOT_MQTT 6        // broker connected
+#define BOOT_PHASES 7
+#define BOOT_LOGO_TIMEOUT 10000 // milliseconds - fast boot shows the status screen after this, connected or not
+
+const char *bootPhaseNames[BOOT_PHASES] = {"preferences", "display", "logo", "ready", "screen", "wifi", "mqtt"};
+int64_t bootPhaseTimes[BOOT_PHASES]; // 0 until reached
+
+void markBootPhase(uint8_t phase)
+{
+  if (bootPhaseTimes[phase] == 0)
+  {
+    bootPhaseTimes[phase] = esp_timer_get_time();
+  }
+}
+
+// Microseconds from boot until a ring can be delivered, 0 if not yet
+int64_t bootAlertCapableMicros()
+{
+  if (bootPhaseTimes[BOOT_READY] == 0 || bootPhaseTimes[BOOT_MQTT] == 0)
+  {
+    return 0;
+  }
+  return max(bootPhaseTimes[BOOT_READY], bootPhaseTimes[BOOT_MQTT]);
+}
+
 void setDisplayMode(uint8_t mode)
 {
   if (mode != displayMode)
   {
+    if (displayMode == DISPLAY_LOGO)
+    {
+      markBootPhase(BOOT_SCREEN);
+    }
     displayMode = mode;
-    print("Display mode set to ");
-    println(String(displayMode).c_str());
+    logDebug(LOG_DISPLAY, "Display mode set to %u", displayMode);
     clearDisplay();
   }
 }
 
-unsigned long screenTimeout = 0;  // 0 or timestamp when last released
 unsigned long touchStartTime = 0; // 0 or timestamp when pressed
-unsigned long nextTouchTimer = 0; // 0 or or timestamp
-unsigned long uptimeUpdateMillis = 0;
 const long uptimeUpdateInterval = 60000; // every minute
+const long telemetryCheckInterval = 5000; // look for changes this often
+const long loopReportInterval = 3600000; // print the loop phases and the profile every hour
+const long heapReportInterval = 3600000; // publish the heap low-water marks every hour
+int64_t telemetrySentMicros = 0; // esp_timer, millis() would wrap after 49 days
+unsigned long telemetryInterval = 300; // seconds - send a record at least this often
 
 #define IDLE 1
 #define RINGING 0
 int lastIntercomState = IDLE;
 int currentIntercomState = IDLE;
 
-Preferences preferences;
-WebServer server(80);
+Preferences preferences;            // network task
+Preferences calibrationPreferences; // its own handle, so the two tasks never share one
+HttpServer server(80);
 
 int orientation = 3;
 
@@ -153,8 +283,12 @@ int calibrating = 0; // The point currently being calibrated or 0
 #define CLOCK_LINE 8
 
 WiFiClient wifiClient;               // The Wifi connection
-PubSubClient mqttClient(wifiClient); // The MQTT connection
+TlsClient tlsClient;                 // TLS on top of it for brokers on MQTT_TLS_PORT
+MqttClient mqttClient(wifiClient);   // The MQTT connection
+#define MQTT_TLS_PORT 8883
+bool mqttTls = false;
 const char *mqttBroker = "";
+const char *mqttBrokerSsid = ""; // network of the broker we use
 int mqttPort = 0;
 const char *mqttUsername = "";
 const char *mqttPassword = "";
@@ -163,9 +297,64 @@ const char *MQTT_TOPIC_ALERT = "/intercom/active";
 const char *MQTT_TOPIC_INFO = "/intercom/info";
 const char *MQTT_TOPIC_TIME = "/intercom/time"; // incoming
 const char *MQTT_TOPIC_UPTIME = "/intercom/uptime";
+const char *MQTT_TOPIC_BOOT_TIME = "/intercom/boottime"; // milliseconds from boot until alert capable
+const char *MQTT_TOPIC_BOOT_PHASES = "/intercom/boot/phases"; // "<phase>=<ms> ..." milliseconds from boot
+const char *MQTT_TOPIC_COMMAND = "/intercom/command";    // incoming "<id> <command> [argument]"
+const char *MQTT_TOPIC_ACK = "/intercom/ack";            // "<id> ok" or "<id> error <reason>"
+const char *MQTT_TOPIC_TELEMETRY = "/intercom/telemetry"; // binary, see telemetry.h
+const char *MQTT_TOPIC_TLS_FULL = "/intercom/tls/full";       // microseconds of the last full TLS handshake
+const char *MQTT_TOPIC_TLS_RESUMED = "/intercom/tls/resumed"; // microseconds of the last resumed TLS handshake
+const char *MQTT_TOPIC_WIFI_RECOVERY = "/intercom/wifi/recovery"; // milliseconds the last WiFi outage lasted
+const char *MQTT_TOPIC_POWER = "/intercom/power"; // average current, per mode stats below it
+const char *MQTT_TOPIC_HEAP = "/intercom/heap"; // free, largest block and fragmentation, now and at worst since boot
+
+Histogram loopHistogram; // network loop iteration times in microseconds since the last telemetry record
+Histogram loopHistogramSinceBoot; // the same for /metrics, never reset
+Histogram uiLoopHistogram; // loop() - the UI task - iteration times since boot
+Histogram renderHistogram; // updateDisplay() times since boot, including the CPU boost
+
+// How long the CPU governor runs at full speed after each of these, in milliseconds
+#define CPU_BOOST_RING 1000  // the ring screen and the messages to the network task
+#define CPU_BOOST_TOUCH 500  // the touch and whatever it redraws
+#define CPU_BOOST_RENDER 100 // a display update, one after the other extend it
+
+// The phases of both loops, for their watchdogs. An iteration that takes
+// longer than LOOP_SLOW_THRESHOLD is logged with the phase to blame.
+#define LOOP_SLOW_THRESHOLD 100000 // microseconds
+#define NETWORK_PHASE_MESSAGES 0   // from the UI task, and the ones that did not fit before
+#define NETWORK_PHASE_WIFI 1
+#define NETWORK_PHASE_POWER 2
+#define NETWORK_PHASE_MQTT 3
+#define NETWORK_PHASE_HTTP 4
+#define NETWORK_PHASE_ACTIONS 5
+#define NETWORK_PHASES 6
+#define UI_PHASE_MESSAGES 0 // from the network task, with the redraws they cause
+#define UI_PHASE_INTERCOM 1
+#define UI_PHASE_TOUCH 2
+#define UI_PHASE_ACTIONS 3
+#define UI_PHASES 4
+
+const char *networkPhaseNames[NETWORK_PHASES] = {"messages", "wifi", "power", "mqtt", "http", "actions"};
+const char *uiPhaseNames[UI_PHASES] = {"messages", "intercom", "touch", "actions"};
+LoopWatchdog networkWatchdog("network", networkPhaseNames, NETWORK_PHASES, LOOP_SLOW_THRESHOLD);
+LoopWatchdog uiWatchdog("ui", uiPhaseNames, UI_PHASES, LOOP_SLOW_THRESHOLD);
+
+uint32_t ringCount = 0;
+uint32_t mqttConnectCount = 0;
+uint32_t wifiConnectCount = 0;
+uint32_t publishFailureCount = 0; // publishes that did not reach the client, e.g. while disconnected
+uint32_t displayUpdateCount = 0;  // calls of updateDisplay()
+uint32_t lineRedrawCount = 0;     // status lines actually drawn
+uint32_t fullRedrawCount = 0;     // logo and ringing screens drawn
+uint32_t telemetryRecordCount = 0;
+TelemetryRecord lastTelemetry;
+// The worst the heap has been since boot, sampled with the telemetry checks
+uint32_t heapMinLargestBlock = UINT32_MAX;
+uint8_t heapMaxFragmentation = 0; // percent
+uint64_t heapMaxFragmentationMillis = 0; // esp_timer, millis() would wrap after 49 days
 
 char uptimeText[32];
-void updateUptimeText(unsigned long milliseconds)
+void updateUptimeText(uint64_t milliseconds)
 {
   unsigned long seconds = milliseconds / 1000;
   unsigned long minutes = seconds / 60;
@@ -195,6 +384,7 @@ void drawCrosshair(int position)
 
 void displayRinging()
 {
+  PROFILE_SCOPE("displayRinging");
   clearDisplay();
   uint8_t offset = tft.height() / 10;
   tft.setTextFont(GFXFF);
@@ -211,32 +401,75 @@ void displayRinging()
 
 void displayLogo()
 {
+  PROFILE_SCOPE("displayLogo");
   clearDisplay();
   tft.pushImage((tft.width() - LOGO_WIDTH) / 2, 0, LOGO_WIDTH, LOGO_HEIGHT, logo);
 }
 
-void setLineText(int line, const char *text)
+// "<line> <text>" on a single line, data needs 40 bytes
+void lineEventData(int line, char *data)
+{
+  sprintf(data, "%d %.36s", line, lines[line - 1]);
+  for (char *character = data; *character; character += 1)
+  {
+    if (*character == '\r' || *character == '\n')
+    {
+      *character = ' ';
+    }
+  }
+}
+
+// Lines longer than the display are cut
+void copyLine(char *target, const char *text)
 {
-  print("Set line #");
-  print(String(line).c_str());
-  print(" to ");
-  println(text);
+  strncpy(target, text, sizeof(lines[0]) - 1);
+  target[sizeof(lines[0]) - 1] = '\0';
+}
+
+// The network task's copy is the reference - every change of it goes to the
+// UI, also the ones the UI made itself, so both end up with the same lines
+void updateLine(int line, const char *text)
+{
+  char updated[sizeof(lines[0])];
+  copyLine(updated, text);
   // Lines start at 1, the array at 0
-  strncpy(lines[line - 1], text, strlen(text));
-  lines[line - 1][strlen(text)] = '\0';
-  /*
-  // print lines to serial on every update - for debugging - comment out most of the time
-  for (uint8_t index = 0; index < DISPLAY_LINES; index += 1)
+  if (strcmp(lines[line - 1], updated) == 0)
+  {
+    return;
+  }
+  strcpy(lines[line - 1], updated);
+  statusVersion += 1;
+  char data[40];
+  lineEventData(line, data);
+  server.sendEvent("line", data);
+  if (!sendToUi(MESSAGE_LINE, line, updated))
+  {
+    linesNotSent |= 1 << (line - 1);
+  }
+}
+
+// Either task can set a line. The UI shows its own changes at once and tells
+// the network task, the network task's changes reach the display as messages.
+void setLineText(int line, const char *text)
+{
+  logDebug(LOG_DISPLAY, "Set line #%d to %s", line, text);
+  if (onNetworkTask())
   {
-    print(String(index + 1).c_str());
-    print(": ");
-    println(lines[index]);
+    updateLine(line, text);
+  }
+  else
+  {
+    copyLine(screenLines[line - 1], text);
+    if (!sendToNetwork(MESSAGE_LINE, line, text))
+    {
+      screenLinesNotSent |= 1 << (line - 1);
+    }
   }
-  */
 }
 
 void drawDisplayLine(int line, const char *text)
 {
+  PROFILE_SCOPE("drawDisplayLine");
   int displayHeight = tft.height();
   int lineHeight = displayHeight / DISPLAY_LINES;
   int gap = lineHeight - FONT_HEIGHT;
@@ -250,22 +483,28 @@ void drawDisplayLine(int line, const char *text)
 // display the connection info (and cross hair if calibrating)
 void updateDisplay()
 {
-  print("Update Display status: ");
+  int64_t renderStart = esp_timer_get_time();
+  if (displayMode != DISPLAY_OFF)
+  {
+    cpuBoost(CPU_BOOST_RENDER); // its latency counts as render time
+  }
+  displayUpdateCount += 1;
   switch (displayMode)
   {
   case DISPLAY_LOGO:
-    println("Logo");
+    logDebug(LOG_DISPLAY, "Update display: logo");
+    fullRedrawCount += 1;
     displayLogo();
     break;
   case DISPLAY_STATUS:
-    println("Status");
+    logDebug(LOG_DISPLAY, "Update display: status");
     for (uint8_t index = 0; index < DISPLAY_LINES; index += 1)
     {
-      if (strcmp(lines[index], displayed[index]) != 0 || calibrating)
+      if (strcmp(screenLines[index], displayed[index]) != 0 || calibrating)
       {
-        drawDisplayLine(index, lines[index]);
-        strncpy(displayed[index], lines[index], strlen(lines[index]));
-        displayed[index][strlen(lines[index])] = '\0';
+        lineRedrawCount += 1;
+        drawDisplayLine(index, screenLines[index]);
+        strcpy(displayed[index], screenLines[index]);
       }
     }
     if (calibrating)
@@ -274,97 +513,112 @@ void updateDisplay()
     }
     break;
   case DISPLAY_RINGING:
-    println("Ringing");
+    logDebug(LOG_DISPLAY, "Update display: ringing");
+    fullRedrawCount += 1;
     displayRinging();
     break;
   default:
-    println("Display Off");
+    logDebug(LOG_DISPLAY, "Update display: off");
     // do nothing
     break;
   }
+  histogramAdd(&renderHistogram, esp_timer_get_time() - renderStart);
 }
 
+void screenTimeoutExpired();
+
 void displayOn()
 {
   digitalWrite(BACKLIGHT_PIN, HIGH);
-  screenTimeout = millis() + SCREEN_TIMEOUT;
+  scheduleAction(screenTimeoutExpired, SCREEN_TIMEOUT);
+  sendToNetwork(MESSAGE_DISPLAY, 1, NULL);
 }
 
 void displayOff()
 {
   digitalWrite(BACKLIGHT_PIN, LOW);
   clearDisplay();
-  screenTimeout = 0;
+  cancelAction(screenTimeoutExpired);
   setDisplayMode(DISPLAY_OFF);
+  sendToNetwork(MESSAGE_DISPLAY, 0, NULL);
+}
+
+// Turns the display off once nothing keeps it on, until then it looks again every second
+void screenTimeoutExpired()
+{
+  if (currentIntercomState == IDLE && displayMode == DISPLAY_STATUS && !calibrating)
+  {
+    displayOff();
+  }
+  else if (displayMode != DISPLAY_OFF)
+  {
+    scheduleAction(screenTimeoutExpired, 1000);
+  }
 }
 
 void printCalibrationInfo()
 {
-  char buffer[40];
-  sprintf(buffer, "Cal: %i,%i %i,%i", calibrationTopLeft.x, calibrationTopLeft.y, calibrationTopRight.x, calibrationTopRight.y);
-  println(buffer);
-  sprintf(buffer, "Cal: %i,%i %i,%i", calibrationBottomLeft.x, calibrationBottomLeft.y, calibrationBottomRight.x, calibrationBottomRight.y);
-  println(buffer);
+  logInfo(LOG_TOUCH, "Cal: %i,%i %i,%i", calibrationTopLeft.x, calibrationTopLeft.y, calibrationTopRight.x, calibrationTopRight.y);
+  logInfo(LOG_TOUCH, "Cal: %i,%i %i,%i", calibrationBottomLeft.x, calibrationBottomLeft.y, calibrationBottomRight.x, calibrationBottomRight.y);
 }
 
 void resetStoredCalibration()
 {
-  preferences.begin(PREFERENCES_NAMESPACE);
-  preferences.putBool(PREFERENCES_KEY_CALIBRATED, false);
-  preferences.putInt(PREFERENCES_KEY_TOP_LEFT_X, -1);
-  preferences.putInt(PREFERENCES_KEY_TOP_LEFT_Y, -1);
-  preferences.putInt(PREFERENCES_KEY_TOP_RIGHT_X, -1);
-  preferences.putInt(PREFERENCES_KEY_TOP_RIGHT_Y, -1);
-  preferences.putInt(PREFERENCES_KEY_BOTTOM_LEFT_X, -1);
-  preferences.putInt(PREFERENCES_KEY_BOTTOM_LEFT_Y, -1);
-  preferences.putInt(PREFERENCES_KEY_BOTTOM_RIGHT_X, -1);
-  preferences.putInt(PREFERENCES_KEY_BOTTOM_RIGHT_Y, -1);
-  preferences.end();
+  calibrationPreferences.begin(PREFERENCES_NAMESPACE);
+  calibrationPreferences.putBool(PREFERENCES_KEY_CALIBRATED, false);
+  calibrationPreferences.putInt(PREFERENCES_KEY_TOP_LEFT_X, -1);
+  calibrationPreferences.putInt(PREFERENCES_KEY_TOP_LEFT_Y, -1);
+  calibrationPreferences.putInt(PREFERENCES_KEY_TOP_RIGHT_X, -1);
+  calibrationPreferences.putInt(PREFERENCES_KEY_TOP_RIGHT_Y, -1);
+  calibrationPreferences.putInt(PREFERENCES_KEY_BOTTOM_LEFT_X, -1);
+  calibrationPreferences.putInt(PREFERENCES_KEY_BOTTOM_LEFT_Y, -1);
+  calibrationPreferences.putInt(PREFERENCES_KEY_BOTTOM_RIGHT_X, -1);
+  calibrationPreferences.putInt(PREFERENCES_KEY_BOTTOM_RIGHT_Y, -1);
+  calibrationPreferences.end();
 }
 
 void storeCalibration()
 {
-  preferences.begin(PREFERENCES_NAMESPACE);
-  preferences.putBool(PREFERENCES_KEY_CALIBRATED, true);
-  preferences.putInt(PREFERENCES_KEY_TOP_LEFT_X, calibrationTopLeft.x);
-  preferences.putInt(PREFERENCES_KEY_TOP_LEFT_Y, calibrationTopLeft.y);
-  preferences.putInt(PREFERENCES_KEY_TOP_RIGHT_X, calibrationTopRight.x);
-  preferences.putInt(PREFERENCES_KEY_TOP_RIGHT_Y, calibrationTopRight.y);
-  preferences.putInt(PREFERENCES_KEY_BOTTOM_LEFT_X, calibrationBottomLeft.x);
-  preferences.putInt(PREFERENCES_KEY_BOTTOM_LEFT_Y, calibrationBottomLeft.y);
-  preferences.putInt(PREFERENCES_KEY_BOTTOM_RIGHT_X, calibrationBottomRight.x);
-  preferences.putInt(PREFERENCES_KEY_BOTTOM_RIGHT_Y, calibrationBottomRight.y);
-  preferences.end();
+  calibrationPreferences.begin(PREFERENCES_NAMESPACE);
+  calibrationPreferences.putBool(PREFERENCES_KEY_CALIBRATED, true);
+  calibrationPreferences.putInt(PREFERENCES_KEY_TOP_LEFT_X, calibrationTopLeft.x);
+  calibrationPreferences.putInt(PREFERENCES_KEY_TOP_LEFT_Y, calibrationTopLeft.y);
+  calibrationPreferences.putInt(PREFERENCES_KEY_TOP_RIGHT_X, calibrationTopRight.x);
+  calibrationPreferences.putInt(PREFERENCES_KEY_TOP_RIGHT_Y, calibrationTopRight.y);
+  calibrationPreferences.putInt(PREFERENCES_KEY_BOTTOM_LEFT_X, calibrationBottomLeft.x);
+  calibrationPreferences.putInt(PREFERENCES_KEY_BOTTOM_LEFT_Y, calibrationBottomLeft.y);
+  calibrationPreferences.putInt(PREFERENCES_KEY_BOTTOM_RIGHT_X, calibrationBottomRight.x);
+  calibrationPreferences.putInt(PREFERENCES_KEY_BOTTOM_RIGHT_Y, calibrationBottomRight.y);
+  calibrationPreferences.end();
 }
 
 // Load or initialize preferences
 void setupPreferences()
 {
-  preferences.begin(PREFERENCES_NAMESPACE);
-  if (preferences.isKey(PREFERENCES_KEY_CALIBRATED))
+  calibrationPreferences.begin(PREFERENCES_NAMESPACE);
+  if (calibrationPreferences.isKey(PREFERENCES_KEY_CALIBRATED))
   {
-    calibrated = preferences.getBool(PREFERENCES_KEY_CALIBRATED);
-    Serial.print("Calibrated: ");
-    Serial.println(calibrated);
+    calibrated = calibrationPreferences.getBool(PREFERENCES_KEY_CALIBRATED);
+    logInfo(LOG_TOUCH, "Calibrated: %d", calibrated);
   }
   else
   {
-    preferences.putBool(PREFERENCES_KEY_CALIBRATED, false);
+    calibrationPreferences.putBool(PREFERENCES_KEY_CALIBRATED, false);
   }
-  if (preferences.isKey(PREFERENCES_KEY_TOP_LEFT_X))
+  if (calibrationPreferences.isKey(PREFERENCES_KEY_TOP_LEFT_X))
   {
     // if that key exists all the other should as well
-    int x = preferences.getInt(PREFERENCES_KEY_TOP_LEFT_X);
-    int y = preferences.getInt(PREFERENCES_KEY_TOP_LEFT_Y);
+    int x = calibrationPreferences.getInt(PREFERENCES_KEY_TOP_LEFT_X);
+    int y = calibrationPreferences.getInt(PREFERENCES_KEY_TOP_LEFT_Y);
     calibrationTopLeft = TS_Point(x, y, 0);
-    x = preferences.getInt(PREFERENCES_KEY_TOP_RIGHT_X);
-    y = preferences.getInt(PREFERENCES_KEY_TOP_RIGHT_Y);
+    x = calibrationPreferences.getInt(PREFERENCES_KEY_TOP_RIGHT_X);
+    y = calibrationPreferences.getInt(PREFERENCES_KEY_TOP_RIGHT_Y);
     calibrationTopRight = TS_Point(x, y, 0);
-    x = preferences.getInt(PREFERENCES_KEY_BOTTOM_LEFT_X);
-    y = preferences.getInt(PREFERENCES_KEY_BOTTOM_LEFT_Y);
+    x = calibrationPreferences.getInt(PREFERENCES_KEY_BOTTOM_LEFT_X);
+    y = calibrationPreferences.getInt(PREFERENCES_KEY_BOTTOM_LEFT_Y);
     calibrationBottomLeft = TS_Point(x, y, 0);
-    x = preferences.getInt(PREFERENCES_KEY_BOTTOM_RIGHT_X);
-    y = preferences.getInt(PREFERENCES_KEY_BOTTOM_RIGHT_Y);
+    x = calibrationPreferences.getInt(PREFERENCES_KEY_BOTTOM_RIGHT_X);
+    y = calibrationPreferences.getInt(PREFERENCES_KEY_BOTTOM_RIGHT_Y);
     calibrationBottomRight = TS_Point(x, y, 0);
   }
   else
@@ -373,30 +627,70 @@ void setupPreferences()
     printCalibrationInfo();
   }
   printCalibrationInfo();
-  preferences.end();
+  calibrationPreferences.end();
 }
 
-// called when an MQTT topic we subscribe to gets an update
-void mqttCallback(char *topic, byte *message, unsigned int length)
+void handleMqttCommand(const byte *message, unsigned int length);
+void requestRestart(bool reset);
+void setupMQTT();
+void publishInteger(const char *topic, long value);
+
+// <hostname>-<MAC>, the same on every connect so the broker keeps our session. clientId needs 52 bytes.
+void mqttClientId(char *clientId)
+{
+  uint8_t mac[6];
+  WiFi.macAddress(mac);
+  sprintf(clientId, "%s-%02X:%02X:%02X:%02X:%02X:%02X", hostname, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+// The SSID we are connected to, empty if none. text needs 33 bytes.
+void connectedSsid(char *text)
+{
+  wifi_ap_record_t accessPoint;
+  text[0] = '\0';
+  if (esp_wifi_sta_get_ap_info(&accessPoint) == ESP_OK)
+  {
+    strncpy(text, (const char *)accessPoint.ssid, 32);
+    text[32] = '\0';
+  }
+}
+
+// text needs 16 bytes
+void formatIp(IPAddress ip, char *text)
+{
+  sprintf(text, "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+}
+
+// FNV-1a, to tell what we kept in RTC memory from the garbage found there after power on
+uint32_t checksum(const void *data, size_t length)
 {
-  // Convert the byte* message to a String
-  String messageString;
-  for (int index = 0; index < length; index += 1)
+  uint32_t hash = 2166136261UL;
+  for (size_t index = 0; index < length; index += 1)
   {
-    messageString += (char)message[index];
+    hash = (hash ^ ((const uint8_t *)data)[index]) * 16777619UL;
   }
-  print("Received ");
-  print(topic);
-  print("=");
-  println(messageString.c_str());
+  return hash;
+}
+
+// called when an MQTT topic we subscribe to gets an update
+void mqttCallback(char *topic, byte *message, unsigned int length)
+{
+  PROFILE_SCOPE("mqttCallback");
+  // The message is not terminated, longer ones are cut
+  char text[64];
+  unsigned int textLength = min(length, (unsigned int)sizeof(text) - 1);
+  memcpy(text, message, textLength);
+  text[textLength] = '\0';
+  logInfo(LOG_MQTT, "Received %s=%s", topic, text);
   if (strcmp(topic, MQTT_TOPIC_TIME) == 0)
   {
-    strncpy(lastTimeReceived, messageString.c_str(), strlen(messageString.c_str()));
-    lastTimeReceived[strlen(messageString.c_str())] = '\0';
+    strncpy(lastTimeReceived, text, sizeof(lastTimeReceived) - 1);
     setLineText(CLOCK_LINE, lastTimeReceived);
-    updateDisplay();
-    print("Time is ");
-    println(lastTimeReceived);
+    logDebug(LOG_MQTT, "Time is %s", lastTimeReceived);
+  }
+  else if (strcmp(topic, MQTT_TOPIC_COMMAND) == 0)
+  {
+    handleMqttCommand(message, length);
   }
 }
 
@@ -404,19 +698,32 @@ uint16_t connectBrokerCounter = 0;
 
 void connectBroker()
 {
+  if (WiFi.status() != WL_CONNECTED)
+  {
+    // superviseWifi() reconnects once the WiFi is back - QoS 1 messages wait till then
+    return;
+  }
   connectBrokerCounter += 1;
-  String clientId = String(hostname) + "-" + String(WiFi.macAddress());
-  if (mqttClient.connect(clientId.c_str(), mqttUsername, mqttPassword))
+  char clientId[52];
+  mqttClientId(clientId);
+  if (mqttClient.connect(clientId, mqttUsername, mqttPassword))
   {
     connectBrokerCounter = 0;
-    println("MQTT broker connected");
+    mqttConnectCount += 1;
+    logInfo(LOG_MQTT, "MQTT broker connected");
     setLineText(BROKER_TEXT_LINE, "MQTT broker:");
     setLineText(BROKER_STATUS_LINE, "MQTT connected");
     mqttClient.setCallback(mqttCallback);
     mqttClient.subscribe(MQTT_TOPIC_TIME);
-    print("Subscribed to ");
-    println(MQTT_TOPIC_TIME);
-    updateDisplay();
+    logInfo(LOG_MQTT, "Subscribed to %s", MQTT_TOPIC_TIME);
+    mqttClient.subscribe(MQTT_TOPIC_COMMAND, 1);
+    logInfo(LOG_MQTT, "Subscribed to %s", MQTT_TOPIC_COMMAND);
+    if (mqttTls)
+    {
+      bool resumed = tlsClient.handshakeResumed();
+      logInfo(LOG_MQTT, "TLS handshake (%s) %luus", resumed ? "resumed" : "full", (unsigned long)tlsClient.handshakeMicros());
+      publishInteger(resumed ? MQTT_TOPIC_TLS_RESUMED : MQTT_TOPIC_TLS_FULL, tlsClient.handshakeMicros());
+    }
   }
   else
   {
@@ -434,66 +741,55 @@ void connectBroker()
       sprintf(buffer, "Failed %i", mqttClient.state());
       break;
     }
-    println(buffer);
+    logWarning(LOG_MQTT, "%s", buffer);
     setLineText(BROKER_STATUS_LINE, buffer);
-    updateDisplay();
-    if (connectBrokerCounter > 15)
-    {
-      // We publish one uptime message every minute
-      // so after 15 failed attempts (minutes) we restart
-      ESP.restart();
-    }
   }
 }
 // publish an (long) integer to the MQTT broker
-void publishInteger(const char *topic, long value, bool retain)
+// QoS 1 messages are kept until the broker acknowledges them, even across reconnects
+// superviseMqtt() reconnects, publishing never does
+void publishInteger(const char *topic, long value, bool retain, uint8_t qos)
 {
-  if (!mqttClient.connected())
-  {
-    connectBroker();
-  }
-  if (mqttClient.connected())
+  if (mqttClient.connected() || qos > 0)
   {
     char message[20];
     sprintf(message, "%d", value);
     boolean result;
-    result = mqttClient.publish(topic, (const uint8_t *)message, strlen(message), retain);
-    /*
-    print("Publish ");
-    print(topic);
-    print("=");
-    print(message);
-    print(" : ");
-    println(result == true ? "OK" : "FAIL");
-    */
+    result = mqttClient.publish(topic, (const uint8_t *)message, strlen(message), retain, qos);
+    if (!result)
+    {
+      publishFailureCount += 1;
+    }
+    logDebug(LOG_MQTT, "Publish %s=%s : %s", topic, message, result ? "OK" : "FAIL");
+  }
+  else
+  {
+    publishFailureCount += 1;
   }
 }
 
 // publish an (long) integer to the MQTT broker - default is to retain the value
 void publishInteger(const char *topic, long value)
 {
-  publishInteger(topic, value, true);
+  publishInteger(topic, value, true, 0);
 }
 
 // publish a string to the MQTT broker
 void publishString(const char *topic, char *value, bool retain)
 {
-  if (!mqttClient.connected())
-  {
-    connectBroker();
-  }
   if (mqttClient.connected())
   {
     boolean result;
     result = mqttClient.publish(topic, (const uint8_t *)value, strlen(value), retain);
-    /*
-    print("Publish ");
-    print(topic);
-    print("=");
-    print(value);
-    print(" : ");
-    println(result == true ? "OK" : "FAIL");
-    */
+    if (!result)
+    {
+      publishFailureCount += 1;
+    }
+    logDebug(LOG_MQTT, "Publish %s=%s : %s", topic, value, result ? "OK" : "FAIL");
+  }
+  else
+  {
+    publishFailureCount += 1;
   }
 }
 
@@ -503,620 +799,2554 @@ void publishString(const char *topic, char *value)
   publishString(topic, value, true);
 }
 
-void WiFiEvent(WiFiEvent_t event)
+// The WiFi supervisor state. The link flags are set from WiFiEvent(), which
+// runs in the WiFi event task, everything else only in loop(). Times are
+// esp_timer milliseconds, millis() would wrap after 49 days.
+#define WIFI_BACKOFF_MIN 1000    // milliseconds until the first reconnect attempt
+#define WIFI_BACKOFF_MAX 60000   // the wait doubles after every attempt up to this
+#define WIFI_ROAM_RSSI -75       // below this we look for a better access point
+#define WIFI_ROAM_MARGIN 8       // dB a new access point has to be better by
+#define WIFI_ROAM_INTERVAL 120000 // milliseconds between roaming scans
+volatile bool wifiLinkUp = false;
+volatile bool wifiInOutage = false;
+volatile int64_t wifiOutageStart = 0; // when the link went down, while wifiInOutage
+int64_t wifiNextAttempt = 0;
+unsigned long wifiBackoff = WIFI_BACKOFF_MIN;
+uint16_t wifiAttempts = 0;
+bool wifiScanning = false;
+int64_t wifiRoamCheckMillis = 0;
+uint32_t wifiOutageCount = 0;
+unsigned long wifiLastRecoveryMillis = 0; // how long the last outage took to recover
+unsigned long wifiMaxRecoveryMillis = 0;
+
+// An outage that is going on keeps its start. The start is written before the
+// flag and only while the flag is clear, so superviseWifi() never reads it
+// half written.
+void startWifiOutage(int64_t now)
 {
-  Serial.printf("WIFI EVENT %d: ", event);
+  if (!wifiInOutage)
+  {
+    wifiOutageStart = now;
+    wifiInOutage = true;
+  }
+}
 
+void WiFiEvent(WiFiEvent_t event)
+{
+  wakeTask(networkTask); // superviseWifi() reacts at once instead of after the next poll
+  const char *text;
   switch (event)
   {
   case ARDUINO_EVENT_WIFI_READY:
-    Serial.println("WiFi interface ready");
+    text = "WiFi interface ready";
     break;
   case ARDUINO_EVENT_WIFI_SCAN_DONE:
-    Serial.println("Completed scan for access points");
+    text = "Completed scan for access points";
     break;
   case ARDUINO_EVENT_WIFI_STA_START:
-    Serial.println("WiFi client started");
+    text = "WiFi client started";
     break;
   case ARDUINO_EVENT_WIFI_STA_STOP:
-    Serial.println("WiFi clients stopped");
+    text = "WiFi clients stopped";
     break;
   case ARDUINO_EVENT_WIFI_STA_CONNECTED:
-    Serial.println("Connected to access point");
+    text = "Connected to access point";
     break;
   case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
-    Serial.println("Disconnected from WiFi access point");
+    wifiLinkUp = false;
+    startWifiOutage(esp_timer_get_time() / 1000);
+    text = "Disconnected from WiFi access point";
     break;
   case ARDUINO_EVENT_WIFI_STA_AUTHMODE_CHANGE:
-    Serial.println("Authentication mode of access point has changed");
+    text = "Authentication mode of access point has changed";
     break;
   case ARDUINO_EVENT_WIFI_STA_GOT_IP:
-    Serial.print("Obtained IP address: ");
-    Serial.println(WiFi.localIP());
+    wifiConnectCount += 1;
+    wifiLinkUp = true;
+    text = "Obtained IP address";
     break;
   case ARDUINO_EVENT_WIFI_STA_LOST_IP:
-    Serial.println("Lost IP address and IP address is reset to 0");
+    wifiLinkUp = false;
+    startWifiOutage(esp_timer_get_time() / 1000);
+    text = "Lost IP address and IP address is reset to 0";
     break;
   case ARDUINO_EVENT_WPS_ER_SUCCESS:
-    Serial.println("WiFi Protected Setup (WPS): succeeded in enrollee mode");
+    text = "WiFi Protected Setup (WPS): succeeded in enrollee mode";
     break;
   case ARDUINO_EVENT_WPS_ER_FAILED:
-    Serial.println("WiFi Protected Setup (WPS): failed in enrollee mode");
+    text = "WiFi Protected Setup (WPS): failed in enrollee mode";
     break;
   case ARDUINO_EVENT_WPS_ER_TIMEOUT:
-    Serial.println("WiFi Protected Setup (WPS): timeout in enrollee mode");
+    text = "WiFi Protected Setup (WPS): timeout in enrollee mode";
     break;
   case ARDUINO_EVENT_WPS_ER_PIN:
-    Serial.println("WiFi Protected Setup (WPS): pin code in enrollee mode");
+    text = "WiFi Protected Setup (WPS): pin code in enrollee mode";
     break;
   case ARDUINO_EVENT_WIFI_AP_START:
-    Serial.println("WiFi access point started");
+    text = "WiFi access point started";
     break;
   case ARDUINO_EVENT_WIFI_AP_STOP:
-    Serial.println("WiFi access point  stopped");
+    text = "WiFi access point stopped";
     break;
   case ARDUINO_EVENT_WIFI_AP_STACONNECTED:
-    Serial.println("Client connected");
+    text = "Client connected";
     break;
   case ARDUINO_EVENT_WIFI_AP_STADISCONNECTED:
-    Serial.println("Client disconnected");
+    text = "Client disconnected";
     break;
   case ARDUINO_EVENT_WIFI_AP_STAIPASSIGNED:
-    Serial.println("Assigned IP address to client");
+    text = "Assigned IP address to client";
     break;
   case ARDUINO_EVENT_WIFI_AP_PROBEREQRECVED:
-    Serial.println("Received probe request");
+    text = "Received probe request";
     break;
   case ARDUINO_EVENT_WIFI_AP_GOT_IP6:
-    Serial.println("AP IPv6 is preferred");
+    text = "AP IPv6 is preferred";
     break;
   case ARDUINO_EVENT_WIFI_STA_GOT_IP6:
-    Serial.println("STA IPv6 is preferred");
+    text = "STA IPv6 is preferred";
     break;
   case ARDUINO_EVENT_ETH_GOT_IP6:
-    Serial.println("Ethernet IPv6 is preferred");
+    text = "Ethernet IPv6 is preferred";
     break;
   case ARDUINO_EVENT_ETH_START:
-    Serial.println("Ethernet started");
+    text = "Ethernet started";
     break;
   case ARDUINO_EVENT_ETH_STOP:
-    Serial.println("Ethernet stopped");
+    text = "Ethernet stopped";
     break;
   case ARDUINO_EVENT_ETH_CONNECTED:
-    Serial.println("Ethernet connected");
+    text = "Ethernet connected";
     break;
   case ARDUINO_EVENT_ETH_DISCONNECTED:
-    Serial.println("Ethernet disconnected");
+    text = "Ethernet disconnected";
     break;
   case ARDUINO_EVENT_ETH_GOT_IP:
-    Serial.println("Obtained IP address");
+    text = "Obtained IP address";
     break;
   default:
-    Serial.println("Other");
+    text = "Other";
     break;
   }
+  logInfo(LOG_WIFI, "WiFi event %d: %s", event, text);
 }
 
-// Called on setup or if Wifi connection has been lost
-void setupWifi()
+// What we need to connect again without scanning: the access point and its
+// channel. The IP address is not kept, every connect asks DHCP - a reused
+// address may have been handed to someone else since.
+struct WifiCache
 {
-  setLineText(SSID_LINE, "Connecting to Wifi");
-  size_t wifiCredentialCount = sizeof(wifiCredentials) / sizeof(WiFiCredentials);
-  for (size_t index = 0; index < wifiCredentialCount; index += 1)
+  uint32_t magic;
+  uint32_t checksum; // of the fields below
+  char ssid[33];
+  uint8_t bssid[6];
+  int32_t channel;
+};
+#define WIFI_CACHE_MAGIC 0x57494632 // "WIF2", the layout with the checksum
+#define WIFI_FAST_CONNECT_TIMEOUT 3000 // milliseconds before we fall back to a scan
+// Survives ESP.restart() but not a power cycle - then the copy in NVS is used
+RTC_NOINIT_ATTR WifiCache wifiCacheRtc;
+
+uint32_t wifiCacheChecksum(const WifiCache *cache)
+{
+  return checksum(cache->ssid, sizeof(WifiCache) - offsetof(WifiCache, ssid));
+}
+
+bool validWifiCache(const WifiCache *cache)
+{
+  return cache->magic == WIFI_CACHE_MAGIC && cache->checksum == wifiCacheChecksum(cache);
+}
+
+bool loadWifiCache(WifiCache *cache)
+{
+  if (validWifiCache(&wifiCacheRtc))
   {
-    char buffer[100];
-    sprintf(buffer, "%s@%s", wifiCredentials[index].ssid, wifiCredentials[index].password);
-    println(buffer);
+    *cache = wifiCacheRtc;
+    return true;
   }
-  // We start by connecting to a WiFi network
-  WiFi.disconnect(); // just in case
-  WiFi.setHostname(hostname);
-  boolean wifiConnected = false;
-  // Nothing works without Wifi - loop until we are connected
-  int wifiFound = -1; // index of the first known network found
-  ssid = "Scanning";
-  setLineText(SSID_LINE + 1, "Scanning for networks");
-  updateDisplay();
-  println("Scanning for networks");
-  // How many networks are visible?
-  int visibleNetworkCount = WiFi.scanNetworks();
-  print("Network count: ");
-  println(String(visibleNetworkCount, 10).c_str());
-  for (int index = 0; index < visibleNetworkCount; index += 1)
+  preferences.begin(PREFERENCES_NAMESPACE);
+  bool found = preferences.isKey(PREFERENCES_KEY_WIFI_CACHE) && preferences.getBytes(PREFERENCES_KEY_WIFI_CACHE, cache, sizeof(WifiCache)) == sizeof(WifiCache);
+  preferences.end();
+  return found && validWifiCache(cache);
+}
+
+// Remember the current connection in RTC memory and - if it changed - in NVS
+void storeWifiCache()
+{
+  WifiCache cache;
+  memset(&cache, 0, sizeof(cache));
+  cache.magic = WIFI_CACHE_MAGIC;
+  connectedSsid(cache.ssid);
+  memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+  cache.channel = WiFi.channel();
+  cache.checksum = wifiCacheChecksum(&cache);
+  wifiCacheRtc = cache;
+  WifiCache stored;
+  preferences.begin(PREFERENCES_NAMESPACE);
+  bool same = preferences.isKey(PREFERENCES_KEY_WIFI_CACHE) && preferences.getBytes(PREFERENCES_KEY_WIFI_CACHE, &stored, sizeof(WifiCache)) == sizeof(WifiCache) && memcmp(&stored, &cache, sizeof(WifiCache)) == 0;
+  if (!same)
   {
-    println(WiFi.SSID(index).c_str());
+    // spare the flash - only write when something changed
+    preferences.putBytes(PREFERENCES_KEY_WIFI_CACHE, &cache, sizeof(WifiCache));
   }
-  // Check all found networks
-  for (int index1 = 0; index1 < visibleNetworkCount; index1 += 1)
+  preferences.end();
+}
+
+void forgetWifiCache()
+{
+  wifiCacheRtc.magic = 0;
+  preferences.begin(PREFERENCES_NAMESPACE);
+  preferences.remove(PREFERENCES_KEY_WIFI_CACHE);
+  preferences.end();
+}
+
+// Connect straight to the cached access point on its channel, DHCP runs as usual
+bool connectCachedWifi(const WifiCache *cache)
+{
+  size_t wifiCredentialCount = sizeof(wifiCredentials) / sizeof(WiFiCredentials);
+  int credential = -1;
+  for (size_t index = 0; index < wifiCredentialCount; index += 1)
   {
-    print("Checking #");
-    print(String(index1).c_str());
-    print(" ");
-    println(WiFi.SSID(index1).c_str());
-    // try all known networks
-    for (int index2 = 0; index2 < wifiCredentialCount; index2 += 1)
-    {
-      // Does the visible network have the SSID of this known network?
-      if (strcmp(wifiCredentials[index2].ssid, WiFi.SSID(index1).c_str()) != 0)
-      {
-        // not equal
-        print("Not matching ");
-        println(wifiCredentials[index2].ssid);
-      }
-      else
-      {
-        // it does - stop going through our known networks
-        wifiFound = index2;
-        break;
-      }
-    }
-    if (wifiFound >= 0)
+    if (strcmp(wifiCredentials[index].ssid, cache->ssid) == 0)
     {
-      // stop going through visible networks
+      credential = index;
       break;
     }
   }
-  if (wifiFound >= 0)
+  if (credential < 0)
   {
-    // We are going to try and connect to this network
-    ssid = wifiCredentials[wifiFound].ssid;
-    setLineText(SSID_LINE + 1, "Trying");
-    setLineText(SSID_LINE + 2, ssid);
-    updateDisplay();
-    print("Connecting to SSID: \"");
-    print(ssid);
-    print("\" with password \"");
-    print(wifiCredentials[wifiFound].password);
-    println("\"");
-    WiFi.begin(ssid, wifiCredentials[wifiFound].password);
-    uint8_t attemptsRemaining = 15; // We attempt only a limited number of times - 15 seconds
-    // we have a WiFi we can try and connect to
-    while (WiFi.status() != WL_CONNECTED && attemptsRemaining > 0)
-    {
-      char buffer[32];
-      sprintf(buffer, "Waiting for %d seconds", attemptsRemaining);
-      println(buffer);
-      setLineText(SSID_LINE + 3, buffer);
-      updateDisplay();
-      attemptsRemaining -= 1;
-      delay(1000);
-    }
-    wifiConnected = WiFi.status() == WL_CONNECTED;
-    // If the Wifi is not connected we start the search all over again
-  }
-
-  // Finally, the Wifi is connected
-  println("WiFi connected");
-  println("IP address: ");
-  println(WiFi.localIP().toString().c_str());
-  println(WiFi.getHostname());
-  // Update the display with SSID and IP address
+    // the credentials have changed since
+    return false;
+  }
+  ssid = wifiCredentials[credential].ssid;
+  setLineText(SSID_LINE + 1, "Reconnecting");
+  setLineText(SSID_LINE + 2, ssid);
+  logInfo(LOG_WIFI, "Fast connect to %s on channel %ld", ssid, (long)cache->channel);
+  WiFi.begin(ssid, wifiCredentials[credential].password, cache->channel, cache->bssid);
+  unsigned long start = millis();
+  while (WiFi.status() != WL_CONNECTED && millis() - start < WIFI_FAST_CONNECT_TIMEOUT)
+  {
+    delay(10);
+  }
   if (WiFi.status() == WL_CONNECTED)
   {
-    setLineText(SSID_LINE, WiFi.SSID().c_str());
-    setLineText(IP_LINE, WiFi.localIP().toString().c_str());
-    updateDisplay();
+    return true;
   }
-  else
+  logWarning(LOG_WIFI, "Fast connect failed");
+  WiFi.disconnect();
+  ssid = "Scanning";
+  return false;
+}
+
+// Known SSIDs in a small open addressing hash table, so matching the scan
+// results is one lookup per visible network instead of a strcmp against
+// every known network
+#define KNOWN_SSID_SLOTS 16 // power of two, at least twice the number of wifiCredentials
+static_assert(sizeof(wifiCredentials) / sizeof(WiFiCredentials) <= KNOWN_SSID_SLOTS / 2, "Increase KNOWN_SSID_SLOTS");
+int8_t knownSsids[KNOWN_SSID_SLOTS]; // index into wifiCredentials or -1
+
+uint32_t ssidHash(const char *text)
+{
+  // FNV-1a
+  uint32_t hash = 2166136261UL;
+  while (*text)
   {
-    clearDisplay();
-    updateDisplay();
-    setLineText(SSID_LINE, "WiFi not connected");
-    uint8_t countdown = 120;
-    while (countdown > 0)
+    hash = (hash ^ (uint8_t)*text) * 16777619UL;
+    text += 1;
+  }
+  return hash;
+}
+
+void buildKnownSsids()
+{
+  memset(knownSsids, -1, sizeof(knownSsids));
+  size_t wifiCredentialCount = sizeof(wifiCredentials) / sizeof(WiFiCredentials);
+  for (size_t index = 0; index < wifiCredentialCount; index += 1)
+  {
+    uint32_t slot = ssidHash(wifiCredentials[index].ssid) & (KNOWN_SSID_SLOTS - 1);
+    while (knownSsids[slot] >= 0)
     {
-      char buffer[32];
-      sprintf(buffer, "Restarting in %ds", countdown);
-      setLineText(IP_LINE, buffer);
-      updateDisplay();
-      delay(1000);
-      countdown -= 1;
+      slot = (slot + 1) & (KNOWN_SSID_SLOTS - 1);
     }
-    ESP.restart();
+    knownSsids[slot] = index;
   }
 }
 
-// Setup the MQTT connection to the broker
-void setupMQTT()
+// index into wifiCredentials or -1 if we do not know the network
+int findKnownSsid(const char *text)
 {
-  char buffer[32];
-  print("Connecting MQTT to");
-  println(ssid);
-  int attemptCounter = 0;
-  // Try all known MQTT brokers in turn
-  size_t mqttBrokerCount = sizeof(mqttBrokers) / sizeof(MqttBroker);
-  while (!mqttClient.connected()) // repeat until connected. We so need to be connected.
+  uint32_t slot = ssidHash(text) & (KNOWN_SSID_SLOTS - 1);
+  while (knownSsids[slot] >= 0)
+  {
+    if (strcmp(wifiCredentials[knownSsids[slot]].ssid, text) == 0)
+    {
+      return knownSsids[slot];
+    }
+    slot = (slot + 1) & (KNOWN_SSID_SLOTS - 1);
+  }
+  return -1;
+}
+
+// A visible access point of a known network
+struct WifiCandidate
+{
+  int8_t credential;
+  int8_t rssi;
+  uint8_t bssid[6];
+  uint8_t channel;
+};
+#define WIFI_MAX_CANDIDATES 8
+#define WIFI_CANDIDATE_TIMEOUT 10 // seconds per access point
+
+// Start connecting to one access point - does not wait
+void beginWifiCandidate(const WifiCandidate *candidate)
+{
+  ssid = wifiCredentials[candidate->credential].ssid;
+  WiFi.begin(ssid, wifiCredentials[candidate->credential].password, candidate->channel, candidate->bssid);
+}
+
+// Pick the access points of known networks out of the scan results, strongest first
+uint8_t collectWifiCandidates(WifiCandidate candidates[], int visibleNetworkCount)
+{
+  uint8_t candidateCount = 0;
+  for (int index = 0; index < visibleNetworkCount; index += 1)
   {
-    attemptCounter += 1;
-    if (attemptCounter > 20)
+    const wifi_ap_record_t *record = (const wifi_ap_record_t *)WiFi.getScanInfoByIndex(index);
+    if (record == NULL)
     {
-      // There is no hope.
-      ESP.restart();
+      continue;
     }
-    if (attemptCounter > 1)
+    int credential = findKnownSsid((const char *)record->ssid);
+    logInfo(LOG_WIFI, "%s %d %s", (const char *)record->ssid, record->rssi, credential >= 0 ? "known" : "");
+    if (credential < 0)
     {
-      sprintf(buffer, "MQTT attempt #%d", attemptCounter);
+      continue;
     }
-    setLineText(INFO_LINE, buffer);
-    for (int index = 0; index < mqttBrokerCount; index += 1)
+    if (candidateCount == WIFI_MAX_CANDIDATES && record->rssi <= candidates[candidateCount - 1].rssi)
     {
-      // if the client is already connected - do nothing
-      if (!mqttClient.connected())
-      {
-        setLineText(BROKER_TEXT_LINE, "MQTT connecting");
-        setLineText(BROKER_IP_LINE, "");
-        setLineText(BROKER_STATUS_LINE, "");
-        updateDisplay();
-        if (strcmp(mqttBrokers[index].ssid, ssid) == 0)
-        {
-          // broker is on correct network
-          mqttBroker = mqttBrokers[index].host;
-          mqttPort = mqttBrokers[index].port;
-          mqttUsername = mqttBrokers[index].username;
-          mqttPassword = mqttBrokers[index].password;
-          mqttClient.setServer(mqttBroker, mqttPort);
-          mqttClient.setCallback(mqttCallback);
-          mqttClient.setKeepAlive(120);
-          // make up a unique client id
-          String clientId = String(hostname) + "-" + String(WiFi.macAddress());
-          print("Client ");
-          println(clientId.c_str());
-          print("Connecting to ");
-          println(mqttBroker);
-          char buffer[64];
-          sprintf(buffer, "<%s> <%s>", mqttUsername, mqttPassword);
-          println(buffer);
-          setLineText(BROKER_IP_LINE, (String(mqttBroker) + ":" + String(mqttPort)).c_str());
-          updateDisplay();
-          delay(1000);
-          // Now try to connect to the MQTT broker
-          connectBroker();
-          if (mqttClient.connected())
-          {
-            // Make sure we publish stuff so they are available in Node Red right away
-            publishString(MQTT_TOPIC_INFO, (char *)WiFi.localIP().toString().c_str());
-          }
-          delay(2000);
-        }
-      }
+      continue; // weaker than all we have
     }
-    if (!mqttClient.connected())
+    uint8_t position = candidateCount < WIFI_MAX_CANDIDATES ? candidateCount : candidateCount - 1;
+    while (position > 0 && candidates[position - 1].rssi < record->rssi)
     {
-      // All failed - Try again in that many seconds
-      uint8_t countdown = 10;
-      setLineText(BROKER_IP_LINE, "");
-      setLineText(BROKER_STATUS_LINE, "");
-      while (countdown > 0)
-      {
-        sprintf(buffer, "Retrying in %ds", countdown);
-        setLineText(INFO_LINE, buffer);
-        updateDisplay();
-        delay(1000);
-        countdown -= 1;
-      }
+      candidates[position] = candidates[position - 1];
+      position -= 1;
+    }
+    candidates[position].credential = credential;
+    candidates[position].rssi = record->rssi;
+    memcpy(candidates[position].bssid, record->bssid, sizeof(candidates[position].bssid));
+    candidates[position].channel = record->primary;
+    if (candidateCount < WIFI_MAX_CANDIDATES)
+    {
+      candidateCount += 1;
     }
   }
+  return candidateCount;
 }
 
-void updateIntercom(int state)
+// The access points setupWifi() tries one after the other, strongest first
+WifiCandidate bootCandidates[WIFI_MAX_CANDIDATES];
+uint8_t bootCandidateCount = 0;
+uint8_t bootCandidateIndex = 0;
+uint8_t bootCandidateCountdown = 0;
+
+// The end of setupWifi(), connected or not
+void wifiSetupDone(bool fastConnected)
 {
-  print("Intercom state ");
-  Serial.println(state == RINGING ? "Ringing" : "Idle");
-  if (state == RINGING)
+  if (WiFi.status() == WL_CONNECTED)
   {
-    char *status = (char *)INTERCOM_RINGING;
-    strncpy(intercomState, status, strlen(status));
-    intercomState[strlen(status)] = '\0';
-    if (displayMode == DISPLAY_OFF)
-    {
-      displayOn();
-    }
-    setLineText(INFO_LINE, intercomState);
-    setDisplayMode(DISPLAY_RINGING);
-    updateDisplay();
-    publishInteger(MQTT_TOPIC_ALERT, 1);
-    print("Ringing ");
-    println(intercomState);
-    screenTimeout = 0; // Keep screen on while ringing
+    markBootPhase(BOOT_WIFI);
+    IPAddress ip = WiFi.localIP();
+    logInfo(LOG_WIFI, "WiFi up after %lums (%s) %u.%u.%u.%u %s", millis(), fastConnected ? "fast" : "scan", ip[0], ip[1], ip[2], ip[3],
+            WiFi.getHostname());
+    wifiLinkUp = true; // the event may still be on its way
+    storeWifiCache();
+    // Update the display with SSID and IP address
+    char text[33];
+    connectedSsid(text);
+    setLineText(SSID_LINE, text);
+    formatIp(ip, text);
+    setLineText(IP_LINE, text);
   }
   else
   {
-    char *status = (char *)INTERCOM_IDLE;
-    strncpy(intercomState, status, strlen(status));
-    intercomState[strlen(status)] = '\0';
-    setLineText(INFO_LINE, intercomState);
-    setDisplayMode(DISPLAY_STATUS);
-    updateDisplay();
-    publishInteger(MQTT_TOPIC_ALERT, 0);
-    print("Idle ");
-    println(intercomState);
-    screenTimeout = millis() + SCREEN_TIMEOUT; // start screen timeout when ringing stops
+    // Whatever we cached did not get us anywhere
+    forgetWifiCache();
+    setLineText(SSID_LINE, "WiFi not connected");
+    setLineText(IP_LINE, "Retrying");
+  }
+  // From here on superviseWifi() looks after the connection
+  int64_t now = esp_timer_get_time() / 1000;
+  wifiNextAttempt = now + WIFI_BACKOFF_MIN;
+  if (wifiLinkUp)
+  {
+    wifiInOutage = false;
+    setupMQTT();
+  }
+  else
+  {
+    startWifiOutage(now);
   }
 }
 
-int touchCountDown = 0;
+void tryBootCandidate();
 
-void handleTouchTimer()
+// Once a second while an access point is being tried, with a countdown on the display
+void bootCandidateTick()
 {
-  if (touchCountDown == 0)
+  if (WiFi.status() == WL_CONNECTED)
   {
-    touchCountDown = 3;
-    println("In 3");
+    wifiSetupDone(false);
+    return;
   }
-  else
+  if (bootCandidateCountdown > 0)
   {
-    char buffer[16];
-    touchCountDown -= 1;
-    sprintf(buffer, "Minus one = %d", touchCountDown);
-    println(buffer);
-    if (touchCountDown == 0)
-    {
-      switch (touchAction)
-      {
-      case TOUCH_ACTION_RESTART:
-        ESP.restart();
-        break;
-      case TOUCH_ACTION_NONE:
-      case TOUCH_ACTION_RESET:
+    char buffer[32];
+    sprintf(buffer, "Waiting for %d seconds", bootCandidateCountdown);
+    logInfo(LOG_WIFI, "%s", buffer);
+    setLineText(SSID_LINE + 3, buffer);
+    bootCandidateCountdown -= 1;
+    scheduleAction(bootCandidateTick, 1000);
+    return;
+  }
+  WiFi.disconnect();
+  bootCandidateIndex += 1;
+  tryBootCandidate();
+}
+
+// Start on the next access point, or hand over to superviseWifi() when none is left
+void tryBootCandidate()
+{
+  if (bootCandidateIndex >= bootCandidateCount)
+  {
+    wifiSetupDone(false);
+    return;
+  }
+  const WifiCandidate *candidate = &bootCandidates[bootCandidateIndex];
+  ssid = wifiCredentials[candidate->credential].ssid;
+  setLineText(SSID_LINE + 1, "Trying");
+  setLineText(SSID_LINE + 2, ssid);
+  char buffer[96];
+  sprintf(buffer, "Connecting to \"%s\" %02x:%02x:%02x:%02x:%02x:%02x RSSI %d", ssid,
+          candidate->bssid[0], candidate->bssid[1], candidate->bssid[2],
+          candidate->bssid[3], candidate->bssid[4], candidate->bssid[5], candidate->rssi);
+  logInfo(LOG_WIFI, "%s", buffer);
+  beginWifiCandidate(candidate);
+  bootCandidateCountdown = WIFI_CANDIDATE_TIMEOUT; // We attempt only a limited number of times
+  bootCandidateTick();
+}
+
+// Called on setup. Returns once the first access point is being tried, the
+// rest runs from loop() - superviseWifi() takes over when setup is done.
+void setupWifi()
+{
+  setLineText(SSID_LINE, "Connecting to Wifi");
+  size_t wifiCredentialCount = sizeof(wifiCredentials) / sizeof(WiFiCredentials);
+  for (size_t index = 0; index < wifiCredentialCount; index += 1)
+  {
+    logDebug(LOG_WIFI, "Known network %s", wifiCredentials[index].ssid);
+  }
+  // We start by connecting to a WiFi network
+  WiFi.disconnect(); // just in case
+  WiFi.setHostname(hostname);
+  // Try the access point we were connected to last time - no scan needed
+  WifiCache cache;
+  if (loadWifiCache(&cache) && connectCachedWifi(&cache))
+  {
+    wifiSetupDone(true);
+    return;
+  }
+  ssid = "Scanning";
+  setLineText(SSID_LINE + 1, "Scanning for networks");
+  logInfo(LOG_WIFI, "Scanning for networks");
+  buildKnownSsids();
+  // How many networks are visible?
+  int visibleNetworkCount = WiFi.scanNetworks();
+  logInfo(LOG_WIFI, "Network count: %d", visibleNetworkCount);
+  bootCandidateCount = collectWifiCandidates(bootCandidates, visibleNetworkCount);
+  WiFi.scanDelete();
+  bootCandidateIndex = 0;
+  tryBootCandidate();
+}
+
+// Every connect is one action of its own, and the task watchdog is fed
+// between actions. The slowest a connect can be: the TCP connect (the
+// WiFiClient default), the TLS handshake, one stalled TLS write and the
+// CONNACK. Brokers are configured by address, there is no DNS lookup.
+#define MQTT_TCP_CONNECT_TIMEOUT 3 // seconds, WIFI_CLIENT_DEF_CONN_TIMEOUT_MS
+#define MQTT_CONNACK_TIMEOUT 5     // seconds
+static_assert(MQTT_TCP_CONNECT_TIMEOUT + TLS_HANDSHAKE_TIMEOUT / 1000 + TLS_WRITE_TIMEOUT / 1000 + MQTT_CONNACK_TIMEOUT < LOOP_WATCHDOG_TIMEOUT,
+              "A broker connect would trip the task watchdog");
+static_assert(BROKER_PROBE_TIMEOUT / 1000 < LOOP_WATCHDOG_TIMEOUT, "Probing would trip the task watchdog");
+
+// Try to connect to one of the mqttBrokers[]
+bool tryBroker(int index)
+{
+  setLineText(BROKER_TEXT_LINE, "MQTT connecting");
+  setLineText(BROKER_IP_LINE, "");
+  setLineText(BROKER_STATUS_LINE, "");
+  mqttBroker = mqttBrokers[index].host;
+  mqttBrokerSsid = mqttBrokers[index].ssid;
+  mqttPort = mqttBrokers[index].port;
+  mqttUsername = mqttBrokers[index].username;
+  mqttPassword = mqttBrokers[index].password;
+  // Brokers on the TLS port get a TLS connection that resumes the last session
+  mqttTls = mqttPort == MQTT_TLS_PORT;
+  if (mqttTls)
+  {
+#if defined(MQTT_CA_CERTIFICATE)
+    tlsClient.setCACert(MQTT_CA_CERTIFICATE);
+#elif defined(MQTT_TLS_INSECURE)
+    tlsClient.setInsecure();
+#else
+    // no way to tell the broker from anyone else, keep the password
+    logError(LOG_MQTT, "%s:%u needs MQTT_CA_CERTIFICATE", mqttBroker, (unsigned int)mqttPort);
+    setLineText(BROKER_STATUS_LINE, "No CA certificate");
+    return false;
+#endif
+    mqttClient.setClient(tlsClient);
+  }
+  else
+  {
+    mqttClient.setClient(wifiClient);
+  }
+  mqttClient.setServer(mqttBroker, mqttPort);
+  mqttClient.setCallback(mqttCallback);
+  mqttClient.setKeepAlive(120);
+  mqttClient.setSocketTimeout(MQTT_CONNACK_TIMEOUT);
+  // make up a unique client id
+  char clientId[52];
+  mqttClientId(clientId);
+  logInfo(LOG_MQTT, "Client %s connecting to %s as %s", clientId, mqttBroker, mqttUsername);
+  char text[48];
+  snprintf(text, sizeof(text), "%s:%u", mqttBroker, (unsigned int)mqttPort);
+  setLineText(BROKER_IP_LINE, text);
+  // Now try to connect to the MQTT broker
+  connectBroker();
+  if (mqttClient.connected())
+  {
+    // Make sure we publish stuff so they are available in Node Red right away
+    formatIp(WiFi.localIP(), text);
+    publishString(MQTT_TOPIC_INFO, text);
+  }
+  return mqttClient.connected();
+}
+
+// The broker ranking from the last probe, best first. It may be from another network.
+uint8_t loadBrokerRanking(uint8_t ranking[])
+{
+  uint8_t count = 0;
+  preferences.begin(PREFERENCES_NAMESPACE);
+  if (preferences.isKey(PREFERENCES_KEY_BROKER_RANKING))
+  {
+    count = preferences.getBytes(PREFERENCES_KEY_BROKER_RANKING, ranking, BROKER_PROBE_MAX);
+  }
+  preferences.end();
+  return count;
+}
+
+// Probe all brokers on the current network at once and rank the ones that
+// answered by TCP connect time, best first. The ranking is stored for the next boot.
+uint8_t rankBrokers(uint8_t ranking[])
+{
+  const char *hosts[BROKER_PROBE_MAX];
+  uint16_t ports[BROKER_PROBE_MAX];
+  uint32_t rtt[BROKER_PROBE_MAX];
+  uint8_t candidates[BROKER_PROBE_MAX];
+  uint8_t candidateCount = 0;
+  size_t mqttBrokerCount = sizeof(mqttBrokers) / sizeof(MqttBroker);
+  for (size_t index = 0; index < mqttBrokerCount && candidateCount < BROKER_PROBE_MAX; index += 1)
+  {
+    if (strcmp(mqttBrokers[index].ssid, ssid) == 0)
+    {
+      candidates[candidateCount] = index;
+      hosts[candidateCount] = mqttBrokers[index].host;
+      ports[candidateCount] = mqttBrokers[index].port;
+      candidateCount += 1;
+    }
+  }
+  probeBrokers(hosts, ports, candidateCount, BROKER_PROBE_TIMEOUT, rtt);
+  // Insertion sort - there are only a handful
+  uint8_t order[BROKER_PROBE_MAX];
+  uint8_t rankedCount = 0;
+  for (uint8_t candidate = 0; candidate < candidateCount; candidate += 1)
+  {
+    if (rtt[candidate] == BROKER_PROBE_UNREACHABLE)
+    {
+      logInfo(LOG_MQTT, "Broker %s unreachable", hosts[candidate]);
+      continue;
+    }
+    logInfo(LOG_MQTT, "Broker %s RTT %luus", hosts[candidate], (unsigned long)rtt[candidate]);
+    uint8_t position = rankedCount;
+    while (position > 0 && rtt[order[position - 1]] > rtt[candidate])
+    {
+      order[position] = order[position - 1];
+      position -= 1;
+    }
+    order[position] = candidate;
+    rankedCount += 1;
+  }
+  for (uint8_t index = 0; index < rankedCount; index += 1)
+  {
+    ranking[index] = candidates[order[index]];
+  }
+  if (rankedCount > 0)
+  {
+    preferences.begin(PREFERENCES_NAMESPACE);
+    preferences.putBytes(PREFERENCES_KEY_BROKER_RANKING, ranking, rankedCount);
+    preferences.end();
+  }
+  return rankedCount;
+}
+
+// The MQTT connection to the broker. It never gives up and never restarts:
+// failed rounds are retried with a wait that doubles up to MQTT_RETRY_MAX.
+#define MQTT_RETRY_MIN 10  // seconds before the first retry
+#define MQTT_RETRY_MAX 300 // seconds, the longest wait between two rounds
+
+int mqttAttemptCounter = 0;
+uint16_t mqttRetryDelay = MQTT_RETRY_MIN;
+uint16_t mqttRetryCountdown = 0;
+bool mqttWanted = false; // setupMQTT() ran for this network, superviseMqtt() keeps it up
+// The brokers of the current round, fastest first
+uint8_t mqttRanking[BROKER_PROBE_MAX];
+uint8_t mqttRankingCount = 0;
+uint8_t mqttRankingIndex = 0;
+
+// Every boot phase reached so far, "<phase>=<ms>" from boot
+void formatBootPhases(char *buffer)
+{
+  buffer[0] = '\0';
+  for (uint8_t phase = 0; phase < BOOT_PHASES; phase += 1)
+  {
+    if (bootPhaseTimes[phase] != 0)
+    {
+      sprintf(buffer + strlen(buffer), "%s%s=%lums", buffer[0] != '\0' ? " " : "", bootPhaseNames[phase],
+              (unsigned long)(bootPhaseTimes[phase] / 1000));
+    }
+  }
+}
+
+// Boot to connected is the time until ring alerts can be delivered
+void mqttSetupDone()
+{
+  logInfo(LOG_MQTT, "MQTT up after %lums", millis());
+  mqttAttemptCounter = 0;
+  mqttRetryDelay = MQTT_RETRY_MIN;
+  if (bootPhaseTimes[BOOT_MQTT] != 0)
+  {
+    return; // a reconnect, the boot is reported already
+  }
+  markBootPhase(BOOT_MQTT);
+  // WiFi, DHCP, the broker connect and the subscribe are done, setup() long before
+  heapGuardArm(); // from here on allocations are reported, see heap_guard.h
+  sendToUi(MESSAGE_BOOTED, 0, NULL); // if the queue is full the logo times out instead
+  char phases[160];
+  formatBootPhases(phases);
+  logInfo(LOG_MAIN, "Boot: %s", phases);
+  logInfo(LOG_MAIN, "Alert capable after %lums", (unsigned long)(bootAlertCapableMicros() / 1000));
+  publishInteger(MQTT_TOPIC_BOOT_TIME, bootAlertCapableMicros() / 1000);
+  publishString(MQTT_TOPIC_BOOT_PHASES, phases);
+}
+
+void attemptMQTT();
+void tryNextBroker();
+void countdownMQTT();
+
+bool mqttRoundPending()
+{
+  return actionPending(countdownMQTT) || actionPending(attemptMQTT) || actionPending(tryNextBroker);
+}
+
+void cancelMqttRound()
+{
+  cancelAction(countdownMQTT);
+  cancelAction(attemptMQTT);
+  cancelAction(tryNextBroker);
+}
+
+// Shows the seconds until the next round, one step per second
+void countdownMQTT()
+{
+  if (mqttClient.connected() || WiFi.status() != WL_CONNECTED)
+  {
+    // connected in the meantime, or the WiFi is gone - superviseWifi() calls setupMQTT() when it is back
+    return;
+  }
+  if (mqttRetryCountdown == 0)
+  {
+    attemptMQTT();
+    return;
+  }
+  char buffer[32];
+  sprintf(buffer, "Retrying in %ds", mqttRetryCountdown);
+  setLineText(INFO_LINE, buffer);
+  mqttRetryCountdown -= 1;
+  scheduleAction(countdownMQTT, 1000);
+}
+
+// One round: probe the brokers, then tryNextBroker() tries the ones that
+// answered, fastest first, one per action
+void attemptMQTT()
+{
+  if (mqttClient.connected() || WiFi.status() != WL_CONNECTED)
+  {
+    return;
+  }
+  char buffer[32] = "";
+  mqttAttemptCounter += 1;
+  if (mqttAttemptCounter > 1)
+  {
+    sprintf(buffer, "MQTT attempt #%d", mqttAttemptCounter);
+  }
+  setLineText(INFO_LINE, buffer);
+  setLineText(BROKER_TEXT_LINE, "MQTT probing");
+  setLineText(BROKER_IP_LINE, "");
+  setLineText(BROKER_STATUS_LINE, "");
+  mqttRankingCount = rankBrokers(mqttRanking);
+  mqttRankingIndex = 0;
+  scheduleAction(tryNextBroker, 0);
+}
+
+void tryNextBroker()
+{
+  if (mqttClient.connected() || WiFi.status() != WL_CONNECTED)
+  {
+    return;
+  }
+  if (mqttRankingIndex < mqttRankingCount)
+  {
+    tryBroker(mqttRanking[mqttRankingIndex]);
+    mqttRankingIndex += 1;
+    if (mqttClient.connected())
+    {
+      mqttSetupDone();
+    }
+    else
+    {
+      scheduleAction(tryNextBroker, 0);
+    }
+    return;
+  }
+  // All failed - try again in a while, loop() keeps running in the meantime
+  setLineText(BROKER_IP_LINE, "");
+  setLineText(BROKER_STATUS_LINE, "");
+  logWarning(LOG_MQTT, "Round #%d failed, next in %us", mqttAttemptCounter, (unsigned int)mqttRetryDelay);
+  mqttRetryCountdown = mqttRetryDelay;
+  mqttRetryDelay = min(mqttRetryDelay * 2, MQTT_RETRY_MAX);
+  countdownMQTT();
+}
+
+// Connects to the best broker on this network. Returns at once if that does
+// not work - the next rounds are scheduled and run from loop().
+void setupMQTT()
+{
+  logInfo(LOG_MQTT, "Connecting MQTT to %s", ssid);
+  cancelMqttRound();
+  mqttWanted = true;
+  mqttAttemptCounter = 0;
+  mqttRetryDelay = MQTT_RETRY_MIN;
+  size_t mqttBrokerCount = sizeof(mqttBrokers) / sizeof(MqttBroker);
+  uint8_t ranking[BROKER_PROBE_MAX];
+  uint8_t rankingCount = loadBrokerRanking(ranking);
+  // Try last boot's best broker straight away - no probing needed if it is still there
+  if (rankingCount > 0 && ranking[0] < mqttBrokerCount && strcmp(mqttBrokers[ranking[0]].ssid, ssid) == 0)
+  {
+    logInfo(LOG_MQTT, "Trying last best broker");
+    if (tryBroker(ranking[0]))
+    {
+      mqttSetupDone();
+      return;
+    }
+  }
+  scheduleAction(attemptMQTT, 0);
+}
+
+// Brings MQTT back when the broker connection is gone, after the WiFi came
+// back as well: the same broker first, then the rounds of attemptMQTT() with
+// their backoff
+void superviseMqtt()
+{
+  if (!mqttWanted || mqttClient.connected() || WiFi.status() != WL_CONNECTED || mqttRoundPending())
+  {
+    return;
+  }
+  logWarning(LOG_MQTT, "MQTT connection lost");
+  connectBroker();
+  if (mqttClient.connected())
+  {
+    mqttSetupDone();
+    return;
+  }
+  scheduleAction(attemptMQTT, 0);
+}
+
+// The link is back: bring the display, the WiFi cache and MQTT up to date
+void handleWifiRecovered(int64_t now)
+{
+  unsigned long recovery = now - wifiOutageStart;
+  wifiInOutage = false;
+  wifiAttempts = 0;
+  wifiBackoff = WIFI_BACKOFF_MIN;
+  wifiOutageCount += 1;
+  wifiLastRecoveryMillis = recovery;
+  wifiMaxRecoveryMillis = max(wifiMaxRecoveryMillis, recovery);
+  markBootPhase(BOOT_WIFI); // if the first connect failed
+  logInfo(LOG_WIFI, "WiFi back after %lums (outage #%lu)", recovery, (unsigned long)wifiOutageCount);
+  char text[33];
+  connectedSsid(text);
+  int credential = findKnownSsid(text);
+  if (credential >= 0)
+  {
+    ssid = wifiCredentials[credential].ssid;
+  }
+  setLineText(SSID_LINE, ssid);
+  formatIp(WiFi.localIP(), text);
+  setLineText(IP_LINE, text);
+  storeWifiCache();
+  if (strcmp(mqttBrokerSsid, ssid) != 0)
+  {
+    // never had a broker or we are on another network now
+    setupMQTT();
+  }
+  // otherwise superviseMqtt() reconnects to the same broker, once
+  publishInteger(MQTT_TOPIC_WIFI_RECOVERY, recovery, true, 1); // waits for the broker
+}
+
+// Keeps the WiFi up without ever restarting: reconnects with exponential
+// backoff, alternating a plain reconnect with a scan for the strongest known
+// access point, and roams to a better access point when the signal gets weak.
+void superviseWifi(int64_t now)
+{
+  if (actionPending(bootCandidateTick))
+  {
+    return; // setupWifi() is still trying access points
+  }
+  if (wifiScanning)
+  {
+    int16_t visibleNetworkCount = WiFi.scanComplete();
+    if (visibleNetworkCount == WIFI_SCAN_RUNNING)
+    {
+      return;
+    }
+    wifiScanning = false;
+    WifiCandidate candidates[WIFI_MAX_CANDIDATES];
+    uint8_t candidateCount = visibleNetworkCount > 0 ? collectWifiCandidates(candidates, visibleNetworkCount) : 0;
+    WiFi.scanDelete();
+    if (candidateCount == 0)
+    {
+      return;
+    }
+    if (!wifiLinkUp)
+    {
+      // strongest first, but do not get stuck on one that keeps failing
+      beginWifiCandidate(&candidates[(wifiAttempts / 2) % candidateCount]);
+    }
+    else if (candidates[0].rssi >= WiFi.RSSI() + WIFI_ROAM_MARGIN && memcmp(candidates[0].bssid, WiFi.BSSID(), 6) != 0)
+    {
+      logInfo(LOG_WIFI, "Roaming from %ddBm to %ddBm", (int)WiFi.RSSI(), candidates[0].rssi);
+      beginWifiCandidate(&candidates[0]);
+    }
+    return;
+  }
+  if (wifiLinkUp)
+  {
+    if (wifiInOutage)
+    {
+      handleWifiRecovered(now);
+    }
+    else if (now - wifiRoamCheckMillis >= WIFI_ROAM_INTERVAL)
+    {
+      wifiRoamCheckMillis = now;
+      if (WiFi.RSSI() < WIFI_ROAM_RSSI)
+      {
+        wifiScanning = WiFi.scanNetworks(true) == WIFI_SCAN_RUNNING;
+      }
+    }
+    return;
+  }
+  if (!wifiInOutage)
+  {
+    // the event got lost somewhere
+    startWifiOutage(now);
+    wifiNextAttempt = now + WIFI_BACKOFF_MIN;
+  }
+  if (now < wifiNextAttempt)
+  {
+    return;
+  }
+  wifiAttempts += 1;
+  char buffer[32];
+  sprintf(buffer, "WiFi retry #%d", wifiAttempts);
+  logWarning(LOG_WIFI, "%s", buffer);
+  setLineText(SSID_LINE, "WiFi lost");
+  setLineText(IP_LINE, buffer);
+  if (wifiAttempts % 2 == 1)
+  {
+    // same access point again - quickest if it just dropped us
+    WiFi.reconnect();
+  }
+  else
+  {
+    wifiScanning = WiFi.scanNetworks(true) == WIFI_SCAN_RUNNING;
+  }
+  wifiNextAttempt = now + wifiBackoff;
+  wifiBackoff = min(wifiBackoff * 2, (unsigned long)WIFI_BACKOFF_MAX);
+}
+
+// WiFi power save follows activity. The deeper modes save power but delay
+// everything the radio receives - a mode is only used while the measured
+// latencies stay within ALERT_LATENCY_BUDGET. We have no current sensor, so
+// the current per mode is an estimate for the ESP32 module (backlight not
+// included) and the average is weighted by the time spent in each mode.
+#define POWER_ACTIVE 0    // display on, ringing or recent activity - radio always on
+#define POWER_IDLE 1      // radio wakes for every DTIM beacon
+#define POWER_DEEP_IDLE 2 // radio wakes every listen interval (3 beacons)
+#define POWER_MODES 3
+#define ALERT_LATENCY_BUDGET 500     // ms from ring to PUBACK and for a keep alive round trip
+#define POWER_ACTIVITY_HOLD 30000    // ms we stay active after the last activity
+#define POWER_DEEP_IDLE_AFTER 600000 // ms without activity before deep idle
+#define POWER_BUDGET_MISSES 2        // a mode that misses the budget this often is not used again
+#define POWER_REPORT_INTERVAL 600000 // ms
+
+struct PowerMode
+{
+  const char *name;
+  wifi_ps_type_t wifiSleep;
+  uint16_t milliamps; // estimate
+  bool lightSleep;     // allowed in this mode
+  uint16_t sleepMilliamps; // estimate while light sleep is on
+  unsigned long timeMillis;
+  unsigned long sleepMillis; // of timeMillis with light sleep on
+  uint32_t alerts;
+  uint32_t alertLatencyTotal; // ms
+  uint32_t alertLatencyMax;   // ms
+  uint32_t pings;
+  uint32_t pingMax; // ms
+  uint8_t budgetMisses;
+};
+PowerMode powerModes[POWER_MODES] = {
+    {"active", WIFI_PS_NONE, 100, false, 100},
+    {"idle", WIFI_PS_MIN_MODEM, 40, CPU_LIGHT_SLEEP, 6},
+    {"deepidle", WIFI_PS_MAX_MODEM, 30, CPU_LIGHT_SLEEP, 3},
+};
+uint8_t powerMode = POWER_ACTIVE;
+unsigned long powerModeSince = 0;
+unsigned long lastActivityMillis = 0;
+unsigned long powerReportMillis = 0;
+uint8_t powerModeAtRing = POWER_ACTIVE;
+int64_t ringMicros = 0;     // when the ring we wait to see acknowledged happened
+uint16_t ringPacketId = 0;  // the packet id of its publish, 0 when we are not waiting
+uint32_t powerPingsSeen = 0;
+bool displayActive = true; // as the UI task last told us
+bool lightSleepOn = false; // the same
+Histogram alertLatencyHistogram; // ring edge to PUBACK in microseconds, for /metrics
+
+void setPowerMode(uint8_t mode, unsigned long now)
+{
+  powerModes[powerMode].timeMillis += now - powerModeSince;
+  if (lightSleepOn)
+  {
+    powerModes[powerMode].sleepMillis += now - powerModeSince;
+  }
+  powerModeSince = now;
+  if (mode != powerMode)
+  {
+    bool lightSleep = powerModes[mode].lightSleep;
+    bool lightSleepChanged = lightSleep != powerModes[powerMode].lightSleep;
+    powerMode = mode;
+    WiFi.setSleep(powerModes[mode].wifiSleep);
+    logInfo(LOG_POWER, "Power mode %s", powerModes[mode].name);
+    // The UI task switches light sleep, it knows the pins that wake us
+    if (lightSleepChanged && !sendToUi(MESSAGE_SLEEP, lightSleep ? 1 : 0, NULL))
+    {
+      sleepNotSent = lightSleep ? 1 : 0;
+    }
+  }
+}
+
+bool powerModeUsable(uint8_t mode)
+{
+  return powerModes[mode].budgetMisses < POWER_BUDGET_MISSES;
+}
+
+void checkLatencyBudget(uint8_t mode, uint32_t latency)
+{
+  if (latency <= ALERT_LATENCY_BUDGET || mode == POWER_ACTIVE)
+  {
+    return;
+  }
+  powerModes[mode].budgetMisses += 1;
+  logWarning(LOG_POWER, "Power mode %s over budget: %lums", powerModes[mode].name, (unsigned long)latency);
+}
+
+void reportPower()
+{
+  setPowerMode(powerMode, millis()); // account for the time in the current mode
+  unsigned long totalMillis = 0;
+  uint64_t charge = 0;
+  for (uint8_t mode = 0; mode < POWER_MODES; mode += 1)
+  {
+    PowerMode *stats = &powerModes[mode];
+    totalMillis += stats->timeMillis;
+    charge += (uint64_t)(stats->timeMillis - stats->sleepMillis) * stats->milliamps + (uint64_t)stats->sleepMillis * stats->sleepMilliamps;
+    char topic[40];
+    char message[160];
+    sprintf(topic, "%s/%s", MQTT_TOPIC_POWER, stats->name);
+    sprintf(message, "time=%lus sleep=%lus current=%umA sleep_current=%umA alerts=%lu alert_avg=%lums alert_max=%lums ping_max=%lums usable=%d",
+            stats->timeMillis / 1000, stats->sleepMillis / 1000, stats->milliamps, stats->sleepMilliamps, (unsigned long)stats->alerts,
+            stats->alerts > 0 ? (unsigned long)(stats->alertLatencyTotal / stats->alerts) : 0UL,
+            (unsigned long)stats->alertLatencyMax, (unsigned long)stats->pingMax, powerModeUsable(mode));
+    logInfo(LOG_POWER, "%s %s", topic, message);
+    publishString(topic, message);
+  }
+  if (totalMillis > 0)
+  {
+    char message[32];
+    sprintf(message, "avg=%lumA", (unsigned long)(charge / totalMillis));
+    logInfo(LOG_POWER, "%s %s", MQTT_TOPIC_POWER, message);
+    publishString(MQTT_TOPIC_POWER, message);
+  }
+  char topic[40];
+  char message[96];
+  sprintf(topic, "%s/cpu", MQTT_TOPIC_POWER);
+  sprintf(message, "low=%lus high=%lus boosts=%lu boost_max=%luus saved=%lu.%03luJ", (unsigned long)(cpuTimeLow() / 1000),
+          (unsigned long)(cpuTimeHigh() / 1000), (unsigned long)cpuBoostCount(), (unsigned long)cpuBoostLatency()->maximum,
+          (unsigned long)(cpuEnergySaved() / 1000), (unsigned long)(cpuEnergySaved() % 1000));
+  logInfo(LOG_POWER, "%s %s", topic, message);
+  publishString(topic, message);
+}
+
+// Pick the deepest power mode the current activity and the latency budget allow
+void updatePowerPolicy(unsigned long now)
+{
+  // The PUBACK for the ring's own publish is the ring arriving at the broker
+  int64_t ackMicros;
+  if (ringPacketId != 0 && mqttClient.findAck(ringPacketId, &ackMicros))
+  {
+    uint32_t latency = (ackMicros - ringMicros) / 1000;
+    histogramAdd(&alertLatencyHistogram, ackMicros - ringMicros);
+    PowerMode *stats = &powerModes[powerModeAtRing];
+    stats->alerts += 1;
+    stats->alertLatencyTotal += latency;
+    stats->alertLatencyMax = max(stats->alertLatencyMax, latency);
+    checkLatencyBudget(powerModeAtRing, latency);
+    ringPacketId = 0;
+  }
+  else if (ringPacketId != 0 && !mqttClient.pending(ringPacketId))
+  {
+    // replaced by the next state of the topic or pushed out of the window, it will never be acknowledged
+    ringPacketId = 0;
+  }
+  // Keep alive round trips measure the receive latency of the current mode
+  if (mqttClient.pingCount() != powerPingsSeen)
+  {
+    powerPingsSeen = mqttClient.pingCount();
+    uint32_t latency = mqttClient.lastPingMicros() / 1000;
+    powerModes[powerMode].pings += 1;
+    powerModes[powerMode].pingMax = max(powerModes[powerMode].pingMax, latency);
+    checkLatencyBudget(powerMode, latency);
+  }
+  uint8_t mode = POWER_ACTIVE;
+  bool active = displayActive || strcmp(intercomState, INTERCOM_RINGING) == 0 || now - lastActivityMillis < POWER_ACTIVITY_HOLD;
+  if (!active)
+  {
+    if (now - lastActivityMillis >= POWER_DEEP_IDLE_AFTER && powerModeUsable(POWER_DEEP_IDLE))
+    {
+      mode = POWER_DEEP_IDLE;
+    }
+    else if (powerModeUsable(POWER_IDLE))
+    {
+      mode = POWER_IDLE;
+    }
+  }
+  setPowerMode(mode, now);
+  if (now - powerReportMillis >= POWER_REPORT_INTERVAL)
+  {
+    powerReportMillis = now;
+    reportPower();
+  }
+}
+
+// Something happened that wants a responsive radio
+void powerActivity()
+{
+  lastActivityMillis = millis();
+  updatePowerPolicy(lastActivityMillis);
+}
+
+// The network half of a ring: count it, publish it and tell the browsers.
+// time is when the pin changed, waking up and the queue count as latency.
+void handleRing(bool rang, int64_t time)
+{
+  logInfo(LOG_INTERCOM, "Intercom state %s", rang ? "Ringing" : "Idle");
+  statusVersion += 1;
+  strcpy(intercomState, rang ? INTERCOM_RINGING : INTERCOM_IDLE);
+  if (rang)
+  {
+    ringCount += 1;
+    // remember the mode the ring found us in, then wake the radio up
+    powerModeAtRing = powerMode;
+    ringMicros = time;
+    powerActivity();
+  }
+  server.sendEvent("ring", rang ? "1" : "0");
+  publishInteger(MQTT_TOPIC_ALERT, rang ? 1 : 0, true, 1); // a ring must not get lost
+  if (rang)
+  {
+    ringPacketId = mqttClient.lastPacketId();
+  }
+}
+
+// The UI half of a ring: show it, the network task does the rest
+void updateIntercom(int state, int64_t time)
+{
+  PROFILE_SCOPE("updateIntercom");
+  int8_t rang = state == RINGING ? 1 : 0;
+  ringNotSent = sendMessage(networkQueue, networkTask, MESSAGE_RING, rang, NULL, time) ? -1 : rang;
+  ringNotSentTime = time;
+  ringing = state == RINGING;
+  if (ringing)
+  {
+    cpuBoost(CPU_BOOST_RING);
+    if (displayMode == DISPLAY_OFF)
+    {
+      displayOn();
+    }
+    setLineText(INFO_LINE, INTERCOM_RINGING);
+    setDisplayMode(DISPLAY_RINGING);
+    updateDisplay();
+    cancelAction(screenTimeoutExpired); // Keep screen on while ringing
+  }
+  else
+  {
+    setLineText(INFO_LINE, INTERCOM_IDLE);
+    setDisplayMode(DISPLAY_STATUS);
+    updateDisplay();
+    scheduleAction(screenTimeoutExpired, SCREEN_TIMEOUT); // start screen timeout when ringing stops
+  }
+}
+
+// Publish a telemetry record if something changed or telemetryInterval has passed
+void updateTelemetry(int64_t now)
+{
+  TelemetryRecord current;
+  current.values[TELEMETRY_UPTIME] = now / 1000000;
+  current.values[TELEMETRY_RSSI] = WiFi.RSSI();
+  current.values[TELEMETRY_FREE_HEAP] = ESP.getFreeHeap();
+  current.values[TELEMETRY_LOOP_P50] = histogramPercentile(&loopHistogram, 50);
+  current.values[TELEMETRY_LOOP_P99] = histogramPercentile(&loopHistogram, 99);
+  current.values[TELEMETRY_LOOP_MAX] = loopHistogram.maximum;
+  current.values[TELEMETRY_MQTT_RECONNECTS] = mqttConnectCount > 0 ? mqttConnectCount - 1 : 0;
+  current.values[TELEMETRY_WIFI_RECONNECTS] = wifiConnectCount > 0 ? wifiConnectCount - 1 : 0;
+  current.values[TELEMETRY_RING_COUNT] = ringCount;
+  bool due = now - telemetrySentMicros >= telemetryInterval * 1000000LL;
+  if (!due && !telemetryChanged(&current, &lastTelemetry))
+  {
+    return;
+  }
+  // Only picks the encoding, a full record is sent for the same reasons
+  bool full = telemetryRecordCount % TELEMETRY_FULL_EVERY == 0;
+  if (!mqttClient.connected())
+  {
+    // not worth a reconnect - try again next time
+    return;
+  }
+  uint8_t record[TELEMETRY_MAX_SIZE];
+  size_t length = encodeTelemetry(&current, &lastTelemetry, full, record);
+  if (mqttClient.publish(MQTT_TOPIC_TELEMETRY, record, length, false))
+  {
+    // The next delta is against this record. At QoS 0 it may never arrive,
+    // then the decoder is off until the next full record.
+    lastTelemetry = current;
+    telemetryRecordCount += 1;
+    telemetrySentMicros = now;
+    histogramReset(&loopHistogram);
+  }
+  else
+  {
+    publishFailureCount += 1;
+  }
+}
+
+#define RESTART_DELAY 2000 // milliseconds - time for the reply to get out, and to cancel
+
+void restartNow()
+{
+  ESP.restart();
+}
+
+void resetNow()
+{
+  resetStoredCalibration();
+  ESP.restart();
+}
+
+// Restart a little later so the reply still gets out
+void requestRestart(bool reset)
+{
+  cancelAction(reset ? restartNow : resetNow);
+  scheduleAction(reset ? resetNow : restartNow, RESTART_DELAY);
+}
+
+// True if there was a restart or reset to cancel
+bool cancelRestart()
+{
+  bool restartCancelled = cancelAction(restartNow);
+  bool resetCancelled = cancelAction(resetNow);
+  return restartCancelled || resetCancelled;
+}
+
+#define COMMAND_HISTORY 8                 // command ids remembered
+#define COMMAND_HISTORY_MAGIC 0x434D4448 // "CMDH"
+#define COMMAND_BUSY "error busy"        // the UI queue was full, not remembered: send the same id again
+
+// The command topic is QoS 1, at least once: a command whose PUBACK got lost
+// is delivered again after the reconnect. The last ids are kept with their
+// result so a redelivery is acknowledged again but not run again. In RTC
+// memory, so a restart command that comes again does not restart twice.
+struct CommandHistory
+{
+  uint32_t magic;
+  uint32_t checksum;
+  uint8_t next;
+  char ids[COMMAND_HISTORY][16];
+  char results[COMMAND_HISTORY][24];
+};
+RTC_NOINIT_ATTR CommandHistory commandHistory;
+
+uint32_t commandHistoryChecksum()
+{
+  return checksum(&commandHistory.next, sizeof(CommandHistory) - offsetof(CommandHistory, next));
+}
+
+// The result the command with this id had, NULL if it is new
+const char *findCommandResult(const char *id)
+{
+  if (commandHistory.magic != COMMAND_HISTORY_MAGIC || commandHistory.checksum != commandHistoryChecksum())
+  {
+    memset(&commandHistory, 0, sizeof(commandHistory));
+    commandHistory.magic = COMMAND_HISTORY_MAGIC;
+    commandHistory.checksum = commandHistoryChecksum();
+    return NULL;
+  }
+  for (uint8_t index = 0; index < COMMAND_HISTORY; index += 1)
+  {
+    if (commandHistory.ids[index][0] != '\0' && strncmp(commandHistory.ids[index], id, sizeof(commandHistory.ids[index]) - 1) == 0)
+    {
+      return commandHistory.results[index];
+    }
+  }
+  return NULL;
+}
+
+void rememberCommand(const char *id, const char *result)
+{
+  if (findCommandResult(id) != NULL)
+  {
+    return; // a redelivery, it keeps its slot
+  }
+  uint8_t slot = commandHistory.next % COMMAND_HISTORY;
+  strncpy(commandHistory.ids[slot], id, sizeof(commandHistory.ids[slot]) - 1);
+  commandHistory.ids[slot][sizeof(commandHistory.ids[slot]) - 1] = '\0';
+  strncpy(commandHistory.results[slot], result, sizeof(commandHistory.results[slot]) - 1);
+  commandHistory.results[slot][sizeof(commandHistory.results[slot]) - 1] = '\0';
+  commandHistory.next = (slot + 1) % COMMAND_HISTORY;
+  commandHistory.checksum = commandHistoryChecksum();
+}
+
+void publishCommandAck(const char *id, const char *result)
+{
+  if (strcmp(id, "-") != 0 && strcmp(result, COMMAND_BUSY) != 0)
+  {
+    rememberCommand(id, result);
+  }
+  char message[64];
+  snprintf(message, sizeof(message), "%s %s", id, result);
+  publishString(MQTT_TOPIC_ACK, message, false);
+}
+
+// A command on MQTT_TOPIC_COMMAND: "<id> <command> [argument]"
+//   ring, idle, restart, reset, cancel (a pending restart or reset), backlight <0|1>,
+//   line <1-8> <text>, telemetry <seconds>
+// Every command is acknowledged on MQTT_TOPIC_ACK with the same id. A command
+// that comes again with an id seen before is acknowledged but not run again.
+// One for the UI task that does not fit into its queue is acknowledged
+// COMMAND_BUSY and may be sent again with the same id.
+void handleMqttCommand(const byte *message, unsigned int length)
+{
+  powerActivity();
+  char command[64];
+  if (length >= sizeof(command))
+  {
+    length = sizeof(command) - 1;
+  }
+  memcpy(command, message, length);
+  command[length] = '\0';
+  char *rest = NULL;
+  char *id = strtok_r(command, " ", &rest);
+  char *verb = strtok_r(NULL, " ", &rest);
+  char *argument = strtok_r(NULL, "", &rest);
+  if (id == NULL || verb == NULL)
+  {
+    publishCommandAck(id == NULL ? "-" : id, "error malformed");
+    return;
+  }
+  const char *result = findCommandResult(id);
+  if (result != NULL)
+  {
+    logInfo(LOG_MQTT, "Command %s delivered again, not run", id);
+    publishCommandAck(id, result);
+    return;
+  }
+  if (strcmp(verb, "ring") == 0)
+  {
+    if (!sendToUi(MESSAGE_RING, 1, NULL))
+    {
+      publishCommandAck(id, COMMAND_BUSY);
+      return;
+    }
+  }
+  else if (strcmp(verb, "idle") == 0)
+  {
+    if (!sendToUi(MESSAGE_RING, 0, NULL))
+    {
+      publishCommandAck(id, COMMAND_BUSY);
+      return;
+    }
+  }
+  else if (strcmp(verb, "restart") == 0)
+  {
+    requestRestart(false);
+  }
+  else if (strcmp(verb, "reset") == 0)
+  {
+    requestRestart(true);
+  }
+  else if (strcmp(verb, "cancel") == 0)
+  {
+    if (!cancelRestart())
+    {
+      publishCommandAck(id, "error nothing pending");
+      return;
+    }
+  }
+  else if (strcmp(verb, "backlight") == 0 && argument != NULL)
+  {
+    if (!sendToUi(MESSAGE_BACKLIGHT, atoi(argument) != 0 ? 1 : 0, NULL))
+    {
+      publishCommandAck(id, COMMAND_BUSY);
+      return;
+    }
+  }
+  else if (strcmp(verb, "line") == 0 && argument != NULL)
+  {
+    char *text = NULL;
+    long line = strtol(argument, &text, 10);
+    if (line < 1 || line > DISPLAY_LINES)
+    {
+      publishCommandAck(id, "error line");
+      return;
+    }
+    while (*text == ' ')
+    {
+      text += 1;
+    }
+    char lineText[32];
+    strncpy(lineText, text, sizeof(lineText) - 1);
+    lineText[sizeof(lineText) - 1] = '\0';
+    setLineText(line, lineText);
+  }
+  else if (strcmp(verb, "telemetry") == 0 && argument != NULL && atol(argument) > 0)
+  {
+    telemetryInterval = atol(argument);
+  }
+  else if (strcmp(verb, "log") == 0 && argument != NULL)
+  {
+    // log <module|all> <level>, 0 is off and 4 debug - as far as compiled in
+    char *level = NULL;
+    char *name = strtok_r(argument, " ", &level);
+    int8_t module = strcmp(name, "all") == 0 ? LOG_MODULES : logModule(name);
+    if (module < 0 || level == NULL || *level < '0' || *level > '4')
+    {
+      publishCommandAck(id, "error log");
+      return;
+    }
+    for (uint8_t index = 0; index < LOG_MODULES; index += 1)
+    {
+      if (index == module || module == LOG_MODULES)
+      {
+        logSetLevel(index, *level - '0');
+      }
+    }
+  }
+  else
+  {
+    publishCommandAck(id, "error unknown");
+    return;
+  }
+  publishCommandAck(id, "ok");
+}
+
+int touchCountDown = 0;
+
+void handleTouchTimer()
+{
+  if (touchCountDown == 0)
+  {
+    touchCountDown = 3;
+    logInfo(LOG_TOUCH, "In 3");
+  }
+  else
+  {
+    touchCountDown -= 1;
+    logInfo(LOG_TOUCH, "Minus one = %d", touchCountDown);
+    if (touchCountDown == 0)
+    {
+      switch (touchAction)
+      {
+      case TOUCH_ACTION_RESTART:
+        ESP.restart();
+        break;
+      case TOUCH_ACTION_NONE:
+      case TOUCH_ACTION_RESET:
         resetStoredCalibration();
         ESP.restart();
         break;
-      case TOUCH_ACTION_RING:
-        updateIntercom(RINGING);
+      case TOUCH_ACTION_RING:
+        updateIntercom(RINGING, esp_timer_get_time());
+        break;
+      }
+    }
+  }
+  char message[32] = "Do nothing";
+  switch (touchAction)
+  {
+  case TOUCH_ACTION_RESTART:
+
+    sprintf(message, "Restart in %ds", touchCountDown);
+    break;
+  case TOUCH_ACTION_RESET:
+    sprintf(message, "Reset in %ds", touchCountDown);
+    break;
+  case TOUCH_ACTION_RING:
+    sprintf(message, "Ring in %ds", touchCountDown);
+    break;
+  }
+  setLineText(INFO_LINE, message);
+  updateDisplay();
+  scheduleAction(handleTouchTimer, 1000);
+}
+
+void setCalibrationPoint(int point)
+{
+  calibrating = point;
+  char buffer[32];
+  const char *corner = "";
+  switch (point)
+  {
+  case TOP_LEFT:
+    corner = "top left";
+    break;
+  case TOP_RIGHT:
+    corner = "top right";
+    break;
+  case BOTTOM_LEFT:
+    corner = "bottom left";
+    break;
+  case BOTTOM_RIGHT:
+    corner = "bottom right";
+    break;
+  }
+  sprintf(buffer, "Touch cross %s", corner);
+  setLineText(INFO_LINE, buffer);
+}
+void handleCalibrationEvent()
+{
+  switch (calibrating)
+  {
+  case TOP_LEFT:
+    calibrationTopLeft = touchPoint;
+    setCalibrationPoint(TOP_RIGHT);
+    break;
+  case TOP_RIGHT:
+    calibrationTopRight = touchPoint;
+    setCalibrationPoint(BOTTOM_LEFT);
+    break;
+  case BOTTOM_LEFT:
+    calibrationBottomLeft = touchPoint;
+    setCalibrationPoint(BOTTOM_RIGHT);
+    break;
+  case BOTTOM_RIGHT:
+    calibrationBottomRight = touchPoint;
+    calibrating = 0;
+    calibrated = true;
+    storeCalibration();
+    printCalibrationInfo();
+    clearDisplay();
+    updateDisplay();
+    break;
+  }
+  updateDisplay();
+}
+
+int mapTouchToScreenX(int x)
+{
+  int xTouchMin = (calibrationTopLeft.x + calibrationBottomLeft.x) / 2;
+  int xTouchMax = (calibrationTopRight.x + calibrationBottomRight.x) / 2;
+  int xScreenMin = CROSSHAIR_MARGIN + CROSSHAIR_SIZE / 2;
+  int xScreenMax = tft.width() - CROSSHAIR_MARGIN - CROSSHAIR_SIZE / 2;
+  int mapped = map(x, xTouchMin, xTouchMax, xScreenMin, xScreenMax);
+  return mapped;
+}
+
+int mapTouchToScreenY(int y)
+{
+  int yTouchMin = (calibrationTopLeft.y + calibrationTopRight.y) / 2;
+  int yTouchMax = (calibrationBottomLeft.y + calibrationBottomRight.y) / 2;
+  int yScreenMin = CROSSHAIR_MARGIN + CROSSHAIR_SIZE / 2;
+  int yScreenMax = tft.height() - CROSSHAIR_MARGIN - CROSSHAIR_SIZE / 2;
+  int mapped = map(y, yTouchMin, yTouchMax, yScreenMin, yScreenMax);
+  return mapped;
+}
+
+void handleTouchStartEvent()
+{
+  cpuBoost(CPU_BOOST_TOUCH);
+  sendToNetwork(MESSAGE_ACTIVITY, 0, NULL);
+  if (touchAction == TOUCH_ACTION_NONE && ringing)
+  {
+    logInfo(LOG_INTERCOM, "Ringing turned off");
+    updateIntercom(IDLE, esp_timer_get_time());
+    setDisplayMode(DISPLAY_STATUS);
+  }
+  if (displayMode == DISPLAY_OFF)
+  {
+    // display is off
+    displayOn();
+    setDisplayMode(DISPLAY_LOGO);
+    updateDisplay();
+    logInfo(LOG_TOUCH, "WAKE x:%d y:%d z:%d", touchPoint.x, touchPoint.y, touchPoint.z);
+  }
+  else if (touchStartTime == 0 && displayMode != DISPLAY_LOGO)
+  {
+    logInfo(LOG_TOUCH, "TOUCH x:%d y:%d z:%d", touchPoint.x, touchPoint.y, touchPoint.z);
+    if (calibrated)
+    {
+      int16_t screenX = mapTouchToScreenX(touchPoint.x);
+      int16_t screenY = mapTouchToScreenY(touchPoint.y);
+      int16_t lineHeight = tft.height() / DISPLAY_LINES;
+      int16_t lineTouched = screenY / lineHeight + 1;
+      logInfo(LOG_TOUCH, "SCREEN x:%d y:%d LINE %d", screenX, screenY, lineTouched);
+      switch (lineTouched)
+      {
+      case SSID_LINE:
+      case IP_LINE:
+      case BROKER_TEXT_LINE:
+      case BROKER_IP_LINE:
+      case BROKER_STATUS_LINE:
+        touchAction = TOUCH_ACTION_RESTART;
+        break;
+      case UPTIME_LINE:
+      case CLOCK_LINE:
+        touchAction = TOUCH_ACTION_RESET;
+        break;
+      case INFO_LINE:
+        touchAction = TOUCH_ACTION_RING;
+        break;
+      default:
+        touchAction = TOUCH_ACTION_NONE;
         break;
       }
     }
+    touchStartTime = millis();
+    scheduleAction(handleTouchTimer, 1000); // every second
+    if (calibrating)
+    {
+      handleCalibrationEvent();
+    }
+  }
+}
+
+void handleTouchEndEvent()
+{
+  logInfo(LOG_TOUCH, "TOUCH END");
+  if (!calibrating)
+  {
+    setLineText(INFO_LINE, "");
+  }
+  if (displayMode == DISPLAY_LOGO)
+  {
+    setDisplayMode(DISPLAY_STATUS);
+  }
+  updateDisplay();
+  touchStartTime = 0;
+  cancelAction(handleTouchTimer);
+  touchCountDown = 0;
+  touchAction = TOUCH_ACTION_NONE;
+  scheduleAction(screenTimeoutExpired, SCREEN_TIMEOUT);
+}
+
+void handleUptime(HttpRequest &request)
+{
+  char buffer[20];
+  sprintf(buffer, "Uptime: %s", uptimeText);
+  logInfo(LOG_HTTP, "%s", buffer);
+  request.send(200, "text/plain", buffer);
+}
+
+// The restart is left to loop(), so the response still goes out
+void handleRestart(HttpRequest &request)
+{
+  char buffer[20];
+  sprintf(buffer, "Restarting");
+  logInfo(LOG_HTTP, "%s", buffer);
+  request.send(200, "text/plain", buffer);
+  requestRestart(false);
+}
+
+void handleReset(HttpRequest &request)
+{
+  char buffer[20];
+  sprintf(buffer, "Resetting");
+  logInfo(LOG_HTTP, "%s", buffer);
+  request.send(200, "text/plain", buffer);
+  requestRestart(true);
+}
+
+void handleColour(HttpRequest &request)
+{
+  logInfo(LOG_HTTP, "POST colour %s", request.body());
+  request.send(200, "text/plain", "Thank you.");
+}
+
+void handleIntercom(HttpRequest &request)
+{
+  powerActivity();
+  char value[8];
+  if (request.arg("intercom", value, sizeof(value)))
+  {
+    logInfo(LOG_HTTP, "DINGDONG %s", value);
+    sendToUi(MESSAGE_RING, strcmp(value, "1") == 0 ? 1 : 0, NULL);
+  }
+  request.send(200, "text/plain", "Thank you.");
+}
+
+// The status page for clients that do not take gzip, the others get the UI
+// from web/index.html. %1 to %8 are replaced with the display lines, after
+// that /events keeps them up to date.
+const char STATUS_PAGE[] PROGMEM =
+    "<!DOCTYPE html> <html>\n"
+    "<head>\n"
+    "<meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0, user-scalable=no\">\n"
+    "<title>BB Intercom</title>\n"
+    "<style></style>\n"
+    "</head>\n"
+    "<body>\n"
+    "<h1 id=\"l1\">&nbsp;%1</h1>\n"
+    "<h1 id=\"l2\">&nbsp;%2</h1>\n"
+    "<h1 id=\"l3\">&nbsp;%3</h1>\n"
+    "<h1 id=\"l4\">&nbsp;%4</h1>\n"
+    "<h1 id=\"l5\">&nbsp;%5</h1>\n"
+    "<h1 id=\"l6\">&nbsp;%6</h1>\n"
+    "<h1 id=\"l7\">&nbsp;%7</h1>\n"
+    "<h1 id=\"l8\">&nbsp;%8</h1>\n"
+    "<script>\n"
+    "var events = new EventSource(\"/events\");\n"
+    "events.addEventListener(\"line\", function (event) {\n"
+    "  var space = event.data.indexOf(\" \");\n"
+    "  document.getElementById(\"l\" + event.data.substring(0, space)).textContent = \"\\u00a0\" + event.data.substring(space + 1);\n"
+    "});\n"
+    "events.addEventListener(\"ring\", function (event) {\n"
+    "  document.body.style.background = event.data == \"1\" ? \"#fc0\" : \"\";\n"
+    "});\n"
+    "</script>\n"
+    "</body>\n"
+    "</html>\n";
+
+// Lines can come in over MQTT - do not let them inject markup
+void writeEscaped(HttpRequest &request, const char *text)
+{
+  for (; *text; text += 1)
+  {
+    switch (*text)
+    {
+    case '<':
+      request.write("&lt;", 4);
+      break;
+    case '>':
+      request.write("&gt;", 4);
+      break;
+    case '&':
+      request.write("&amp;", 5);
+      break;
+    case '"':
+      request.write("&quot;", 6);
+      break;
+    default:
+      request.write(text, 1);
+      break;
+    }
+  }
+}
+
+// Expand a PROGMEM template straight into the response buffer, %1 to %8 become the lines
+void sendTemplate(HttpRequest &request, PGM_P page)
+{
+  request.beginResponse(200, "text/html");
+  PGM_P chunk = page;
+  PGM_P cursor = page;
+  char character;
+  while ((character = pgm_read_byte(cursor)) != '\0')
+  {
+    char next = pgm_read_byte(cursor + 1);
+    if (character == '%' && next >= '1' && next < '1' + DISPLAY_LINES)
+    {
+      request.write(chunk, cursor - chunk);
+      writeEscaped(request, lines[next - '1']);
+      cursor += 2;
+      chunk = cursor;
+    }
+    else
+    {
+      cursor += 1;
+    }
+  }
+  request.write(chunk, cursor - chunk);
+}
+
+// The UI is gzipped at build time (tools/embed_web.py) and sent straight from flash
+void sendWebUi(HttpRequest &request)
+{
+  char match[64];
+  if (request.header("If-None-Match", match, sizeof(match)) && strstr(match, WEB_UI_INDEX_ETAG) != NULL)
+  {
+    request.beginResponse(304, "text/html");
+  }
+  else
+  {
+    request.beginResponse(200, "text/html");
+    request.addHeader("Content-Encoding", "gzip");
+    request.writeFlash(WEB_UI_INDEX, WEB_UI_INDEX_SIZE);
+  }
+  request.addHeader("ETag", WEB_UI_INDEX_ETAG);
+  request.addHeader("Cache-Control", "max-age=86400");
+  request.addHeader("Vary", "Accept-Encoding");
+}
+
+// Fragmentation is how much of the free heap is not in the largest block
+uint8_t heapFragmentation(uint32_t freeHeap, uint32_t largestBlock)
+{
+  return freeHeap > 0 ? 100 - largestBlock * 100 / freeHeap : 0;
+}
+
+void handleWeb(HttpRequest &request)
+{
+  PROFILE_SCOPE("handleWeb");
+  int64_t start = esp_timer_get_time();
+  char encodings[64];
+  if (request.header("Accept-Encoding", encodings, sizeof(encodings)) && strstr(encodings, "gzip") != NULL)
+  {
+    sendWebUi(request);
+  }
+  else
+  {
+    sendTemplate(request, STATUS_PAGE);
+  }
+  char buffer[80];
+  uint32_t freeHeap = ESP.getFreeHeap();
+  uint32_t largestBlock = ESP.getMaxAllocHeap();
+  sprintf(buffer, "Page in %luus, heap %lu free, %lu largest, %u%% fragmented", (unsigned long)(esp_timer_get_time() - start),
+          (unsigned long)freeHeap, (unsigned long)largestBlock, heapFragmentation(freeHeap, largestBlock));
+  logInfo(LOG_HTTP, "%s", buffer);
+  // Accept to last byte sent over all requests so far
+  const Histogram *latency = server.latency();
+  sprintf(buffer, "HTTP %lu requests, %lu bytes, p50 %luus, p99 %luus", (unsigned long)server.requestCount(), (unsigned long)server.bytesSent(),
+          (unsigned long)histogramPercentile(latency, 50), (unsigned long)histogramPercentile(latency, 99));
+  logInfo(LOG_HTTP, "%s", buffer);
+}
+
+// JSON string with quotes, escaped as needed
+void writeJsonString(HttpRequest &request, const char *text)
+{
+  request.write("\"", 1);
+  for (; *text; text += 1)
+  {
+    if (*text == '"' || *text == '\\')
+    {
+      request.write("\\", 1);
+      request.write(text, 1);
+    }
+    else if ((uint8_t)*text < 0x20)
+    {
+      char escaped[8];
+      sprintf(escaped, "\\u%04x", *text);
+      request.write(escaped, 6);
+    }
+    else
+    {
+      request.write(text, 1);
+    }
+  }
+  request.write("\"", 1);
+}
+
+// The ETag of /api/status. The connection state is part of it because it changes without a line changing.
+void statusEtag(char *etag)
+{
+  sprintf(etag, "\"%lu-%d%d\"", (unsigned long)statusVersion, wifiLinkUp ? 1 : 0, mqttClient.connected() ? 1 : 0);
+}
+
+void handleApiStatus(HttpRequest &request)
+{
+  char etag[24];
+  char match[64];
+  statusEtag(etag);
+  if (request.header("If-None-Match", match, sizeof(match)) && strstr(match, etag) != NULL)
+  {
+    request.beginResponse(304, "application/json");
+    request.addHeader("ETag", etag);
+    return;
+  }
+  request.beginResponse(200, "application/json");
+  request.addHeader("ETag", etag);
+  request.addHeader("Cache-Control", "no-cache");
+  char buffer[64];
+  sprintf(buffer, "{\"version\":%lu,\"lines\":[", (unsigned long)statusVersion);
+  request.print(buffer);
+  for (uint8_t index = 0; index < DISPLAY_LINES; index += 1)
+  {
+    if (index > 0)
+    {
+      request.print(",");
+    }
+    writeJsonString(request, lines[index]);
+  }
+  request.print("],\"intercom\":");
+  writeJsonString(request, intercomState);
+  sprintf(buffer, ",\"ringing\":%s,\"uptime\":", strcmp(intercomState, INTERCOM_RINGING) == 0 ? "true" : "false");
+  request.print(buffer);
+  writeJsonString(request, uptimeText);
+  IPAddress ip = WiFi.localIP();
+  sprintf(buffer, ",\"wifi\":{\"connected\":%s,\"ip\":\"%u.%u.%u.%u\"}", wifiLinkUp ? "true" : "false", ip[0], ip[1], ip[2], ip[3]);
+  request.print(buffer);
+  sprintf(buffer, ",\"mqtt\":{\"connected\":%s,\"broker\":", mqttClient.connected() ? "true" : "false");
+  request.print(buffer);
+  writeJsonString(request, mqttBroker);
+  sprintf(buffer, ",\"port\":%d,\"tls\":%s}}", mqttPort, mqttTls ? "true" : "false");
+  request.print(buffer);
+}
+
+// "# TYPE" line and the sample, Prometheus text format
+void writeMetric(HttpRequest &request, const char *name, const char *type, long value)
+{
+  char buffer[128];
+  sprintf(buffer, "# TYPE %s %s\n%s %ld\n", name, type, name, value);
+  request.print(buffer);
+}
+
+// Cumulative buckets at every octave boundary. The list is the same for
+// every histogram and every scrape, empty buckets included - rate() and
+// histogram_quantile() need the same series each time.
+void writeHistogramMetric(HttpRequest &request, const char *name, const Histogram *histogram)
+{
+  char buffer[128];
+  sprintf(buffer, "# TYPE %s histogram\n", name);
+  request.print(buffer);
+  uint32_t cumulative = 0;
+  for (uint8_t bucket = 0; bucket < HISTOGRAM_BUCKETS - 1; bucket += 1)
+  {
+    cumulative += histogram->counts[bucket];
+    if (bucket % 4 == 3)
+    {
+      sprintf(buffer, "%s_bucket{le=\"%lu\"} %lu\n", name, (unsigned long)histogramBucketHigh(bucket), (unsigned long)cumulative);
+      request.print(buffer);
+    }
+  }
+  sprintf(buffer, "%s_bucket{le=\"+Inf\"} %lu\n", name, (unsigned long)histogram->total);
+  request.print(buffer);
+  sprintf(buffer, "%s_sum %llu\n", name, (unsigned long long)histogram->sum);
+  request.print(buffer);
+  sprintf(buffer, "%s_count %lu\n", name, (unsigned long)histogram->total);
+  request.print(buffer);
+}
+
+// Per task: its CPU time and the queue of messages waiting for it. The CPU
+// time is the time its loop iterations took, which includes what the WiFi
+// driver took from the same core meanwhile, but not the time it waited.
+// The other task's numbers are read without a lock and may be a moment old.
+void writeTaskMetrics(HttpRequest &request)
+{
+  const char *names[] = {"network", "ui"};
+  const Histogram *loops[] = {&loopHistogramSinceBoot, &uiLoopHistogram};
+  TaskQueue *queues[] = {&networkQueue, &uiQueue};
+  TaskHandle_t tasks[] = {networkTask, uiTask};
+  char buffer[128];
+  request.print("# TYPE intercom_task_cpu_seconds_total counter\n");
+  for (uint8_t index = 0; index < 2; index += 1)
+  {
+    uint64_t micros = loops[index]->sum;
+    sprintf(buffer, "intercom_task_cpu_seconds_total{task=\"%s\"} %llu.%06llu\n", names[index], micros / 1000000, micros % 1000000);
+    request.print(buffer);
+  }
+  request.print("# TYPE intercom_task_queue_depth gauge\n");
+  for (uint8_t index = 0; index < 2; index += 1)
+  {
+    sprintf(buffer, "intercom_task_queue_depth{task=\"%s\"} %lu\n", names[index], (unsigned long)queues[index]->depth());
+    request.print(buffer);
+  }
+  request.print("# TYPE intercom_task_queue_max_depth gauge\n");
+  for (uint8_t index = 0; index < 2; index += 1)
+  {
+    sprintf(buffer, "intercom_task_queue_max_depth{task=\"%s\"} %lu\n", names[index], (unsigned long)queues[index]->maxDepth());
+    request.print(buffer);
+  }
+  request.print("# TYPE intercom_task_queue_full_total counter\n");
+  for (uint8_t index = 0; index < 2; index += 1)
+  {
+    sprintf(buffer, "intercom_task_queue_full_total{task=\"%s\"} %lu\n", names[index], (unsigned long)queues[index]->dropped());
+    request.print(buffer);
+  }
+  request.print("# TYPE intercom_task_stack_free_bytes gauge\n");
+  for (uint8_t index = 0; index < 2; index += 1)
+  {
+    sprintf(buffer, "intercom_task_stack_free_bytes{task=\"%s\"} %lu\n", names[index], (unsigned long)uxTaskGetStackHighWaterMark(tasks[index]));
+    request.print(buffer);
+  }
+}
+
+// Time at each CPU frequency and what the boosts cost, see cpu_governor.h.
+// The boost latency histogram is a /metrics part of its own.
+void writeCpuMetrics(HttpRequest &request)
+{
+  char buffer[160];
+  uint64_t low = cpuTimeLow();
+  uint64_t high = cpuTimeHigh();
+  sprintf(buffer, "# TYPE intercom_cpu_frequency_seconds_total counter\nintercom_cpu_frequency_seconds_total{mhz=\"%d\"} %llu.%03llu\n",
+          CPU_FREQ_LOW, low / 1000, low % 1000);
+  request.print(buffer);
+  sprintf(buffer, "intercom_cpu_frequency_seconds_total{mhz=\"%d\"} %llu.%03llu\n", CPU_FREQ_HIGH, high / 1000, high % 1000);
+  request.print(buffer);
+  writeMetric(request, "intercom_cpu_boosts_total", "counter", cpuBoostCount());
+  writeMetric(request, "intercom_cpu_energy_saved_millijoules_total", "counter", cpuEnergySaved());
+  writeMetric(request, "intercom_cpu_power_management", "gauge", cpuGovernorUsesPowerManagement() ? 1 : 0);
+}
+
+// When each boot phase was reached, and when rings could first be delivered
+void writeBootMetrics(HttpRequest &request)
+{
+  char buffer[128];
+  request.print("# TYPE intercom_boot_phase_seconds gauge\n");
+  for (uint8_t phase = 0; phase < BOOT_PHASES; phase += 1)
+  {
+    if (bootPhaseTimes[phase] != 0)
+    {
+      sprintf(buffer, "intercom_boot_phase_seconds{phase=\"%s\"} %llu.%06llu\n", bootPhaseNames[phase],
+              bootPhaseTimes[phase] / 1000000, bootPhaseTimes[phase] % 1000000);
+      request.print(buffer);
+    }
+  }
+  int64_t alertCapable = bootAlertCapableMicros();
+  if (alertCapable != 0)
+  {
+    sprintf(buffer, "# TYPE intercom_boot_alert_capable_seconds gauge\nintercom_boot_alert_capable_seconds %llu.%06llu\n",
+            alertCapable / 1000000, alertCapable % 1000000);
+    request.print(buffer);
+  }
+}
+
+// One of the per loop phase metrics of both tasks, see loop_watchdog.h
+#define LOOP_METRICS 3
+void writeLoopMetric(HttpRequest &request, uint8_t metric)
+{
+  LoopWatchdog *watchdogs[] = {&networkWatchdog, &uiWatchdog};
+  const char *names[] = {"intercom_loop_phase_seconds_total", "intercom_loop_phase_max_microseconds", "intercom_loop_slow_total"};
+  const char *types[] = {"counter", "gauge", "counter"};
+  char buffer[160];
+  sprintf(buffer, "# TYPE %s %s\n", names[metric], types[metric]);
+  request.print(buffer);
+  for (uint8_t index = 0; index < 2; index += 1)
+  {
+    LoopWatchdog *watchdog = watchdogs[index];
+    for (uint8_t phase = 0; phase < watchdog->phases(); phase += 1)
+    {
+      const Histogram *histogram = watchdog->phaseHistogram(phase);
+      int length = sprintf(buffer, "%s{task=\"%s\",phase=\"%s\"} ", names[metric], watchdog->task(), watchdog->phaseName(phase));
+      if (metric == 0)
+      {
+        sprintf(buffer + length, "%llu.%06llu\n", histogram->sum / 1000000, histogram->sum % 1000000);
+      }
+      else
+      {
+        sprintf(buffer + length, "%lu\n", (unsigned long)(metric == 1 ? histogram->maximum : watchdog->phaseOverruns(phase)));
+      }
+      request.print(buffer);
+    }
+  }
+}
+
+// Display, MQTT, WiFi and HTTP counts, 15 metrics
+void writeCountMetrics(HttpRequest &request)
+{
+  writeMetric(request, "intercom_display_updates_total", "counter", displayUpdateCount);
+  writeMetric(request, "intercom_display_line_redraws_total", "counter", lineRedrawCount);
+  writeMetric(request, "intercom_display_full_redraws_total", "counter", fullRedrawCount);
+  writeMetric(request, "intercom_mqtt_connected", "gauge", mqttClient.connected() ? 1 : 0);
+  writeMetric(request, "intercom_mqtt_reconnects_total", "counter", mqttConnectCount > 0 ? mqttConnectCount - 1 : 0);
+  writeMetric(request, "intercom_mqtt_publish_failures_total", "counter", publishFailureCount);
+  writeMetric(request, "intercom_mqtt_retransmits_total", "counter", mqttClient.retransmitCount());
+  writeMetric(request, "intercom_mqtt_dropped_total", "counter", mqttClient.droppedCount());
+  writeMetric(request, "intercom_mqtt_superseded_total", "counter", mqttClient.supersededCount());
+  writeMetric(request, "intercom_wifi_connected", "gauge", wifiLinkUp ? 1 : 0);
+  if (wifiLinkUp)
+  {
+    writeMetric(request, "intercom_wifi_rssi_dbm", "gauge", WiFi.RSSI());
+  }
+  writeMetric(request, "intercom_wifi_reconnects_total", "counter", wifiConnectCount > 0 ? wifiConnectCount - 1 : 0);
+  writeMetric(request, "intercom_rings_total", "counter", ringCount);
+  writeMetric(request, "intercom_http_requests_total", "counter", server.requestCount());
+}
+
+// /metrics is several times the response buffer, so it is sent in parts.
+// Every part has to fit the buffer on its own: at most METRICS_PART_LINES
+// lines of at most METRICS_LINE_SIZE characters, metric names up to 48.
+// The largest parts are a histogram and the loop metrics of both tasks.
+#define METRICS_PART_LINES 30
+#define METRICS_LINE_SIZE 100
+static_assert(METRICS_PART_LINES * METRICS_LINE_SIZE <= HTTP_RESPONSE_SIZE, "A /metrics part may not fit the response buffer");
+static_assert(1 + HISTOGRAM_BUCKETS / 4 + 3 <= METRICS_PART_LINES, "Histogram buckets do not fit a /metrics part");
+static_assert(1 + NETWORK_PHASES + UI_PHASES <= METRICS_PART_LINES, "Loop phases do not fit a /metrics part");
+static_assert(2 + (1 + BOOT_PHASES + 2) + 7 * 2 <= METRICS_PART_LINES, "Boot and heap metrics do not fit a /metrics part");
+static_assert(15 * 2 <= METRICS_PART_LINES, "The counts do not fit a /metrics part");
+
+bool writeMetricsPart(HttpRequest &request, uint8_t part)
+{
+  switch (part)
+  {
+  case 0:
+    writeMetric(request, "intercom_uptime_seconds", "counter", esp_timer_get_time() / 1000000); // millis() wraps after 49 days
+    writeBootMetrics(request);
+    writeMetric(request, "intercom_heap_free_bytes", "gauge", ESP.getFreeHeap());
+    writeMetric(request, "intercom_heap_min_free_bytes", "gauge", ESP.getMinFreeHeap());
+    writeMetric(request, "intercom_heap_largest_free_block_bytes", "gauge", ESP.getMaxAllocHeap());
+    writeMetric(request, "intercom_heap_min_largest_free_block_bytes", "gauge", heapMinLargestBlock);
+    writeMetric(request, "intercom_heap_fragmentation_percent", "gauge", heapFragmentation(ESP.getFreeHeap(), ESP.getMaxAllocHeap()));
+    writeMetric(request, "intercom_heap_max_fragmentation_percent", "gauge", heapMaxFragmentation);
+    writeMetric(request, "intercom_heap_allocations_after_boot_total", "counter", heapGuardAllocations());
+    return true;
+  case 1:
+    writeHistogramMetric(request, "intercom_loop_duration_microseconds", &loopHistogramSinceBoot);
+    return true;
+  case 2:
+    writeHistogramMetric(request, "intercom_ui_loop_duration_microseconds", &uiLoopHistogram);
+    return true;
+  case 3:
+  case 4:
+  case 5:
+    writeLoopMetric(request, part - 3);
+    return true;
+  case 6:
+    writeHistogramMetric(request, "intercom_alert_latency_microseconds", &alertLatencyHistogram);
+    return true;
+  case 7:
+    writeMetric(request, "intercom_light_sleep", "gauge", lightSleepOn ? 1 : 0);
+    writeMetric(request, "intercom_log_dropped_total", "counter", logDropped());
+    writeMetric(request, "intercom_log_queue_max_depth", "gauge", logMaxDepth());
+    writeCpuMetrics(request);
+    return true;
+  case 8:
+    writeHistogramMetric(request, "intercom_cpu_boost_latency_microseconds", cpuBoostLatency());
+    return true;
+  case 9:
+    writeHistogramMetric(request, "intercom_render_duration_microseconds", &renderHistogram);
+    return true;
+  case 10:
+    writeCountMetrics(request);
+    return true;
+  case 11:
+    writeTaskMetrics(request);
+    return true;
+  default:
+    return false;
+  }
+}
+
+void handleMetrics(HttpRequest &request)
+{
+  request.beginParts(200, "text/plain; version=0.0.4", writeMetricsPart);
+}
+
+// Sends the current lines and ring state first, so a reconnecting browser is complete again
+void handleEvents(HttpRequest &request)
+{
+  char data[40];
+  request.beginEventStream();
+  for (uint8_t index = 0; index < DISPLAY_LINES; index += 1)
+  {
+    lineEventData(index + 1, data);
+    request.writeEvent("line", data);
+  }
+  request.writeEvent("ring", strcmp(intercomState, INTERCOM_RINGING) == 0 ? "1" : "0");
+}
+
+// Every minute, on the minute since boot
+void updateUptime()
+{
+  uint64_t uptimeMillis = esp_timer_get_time() / 1000; // 64 bit, does not wrap like millis()
+  updateUptimeText(uptimeMillis);
+  char uptimeDisplayText[32] = "";
+  sprintf(uptimeDisplayText, "Uptime: %s", uptimeText);
+  setLineText(UPTIME_LINE, uptimeDisplayText);
+  publishString(MQTT_TOPIC_UPTIME, uptimeText);
+  scheduleAction(updateUptime, uptimeUpdateInterval - uptimeMillis % uptimeUpdateInterval);
+}
+
+// ESP.getMinFreeHeap() keeps the free low-water mark, the rest is ours
+void trackHeap()
+{
+  uint32_t largestBlock = ESP.getMaxAllocHeap();
+  uint8_t fragmentation = heapFragmentation(ESP.getFreeHeap(), largestBlock);
+  heapMinLargestBlock = min(heapMinLargestBlock, largestBlock);
+  if (fragmentation > heapMaxFragmentation)
+  {
+    heapMaxFragmentation = fragmentation;
+    heapMaxFragmentationMillis = esp_timer_get_time() / 1000;
+  }
+}
+
+void checkTelemetry()
+{
+  trackHeap();
+  updateTelemetry(esp_timer_get_time());
+  scheduleAction(checkTelemetry, telemetryCheckInterval);
+}
+
+// One line per loop phase, for the serial log and /loop
+void formatLoopPhase(LoopWatchdog &watchdog, uint8_t phase, char *buffer)
+{
+  const Histogram *histogram = watchdog.phaseHistogram(phase);
+  sprintf(buffer, "%s %s: count=%lu p50=%luus p99=%luus max=%luus slow=%lu", watchdog.task(), watchdog.phaseName(phase),
+          (unsigned long)histogram->total, (unsigned long)histogramPercentile(histogram, 50), (unsigned long)histogramPercentile(histogram, 99),
+          (unsigned long)histogram->maximum, (unsigned long)watchdog.phaseOverruns(phase));
+}
+
+// One line per profile entry, false if there is none at index
+bool formatProfileEntry(uint8_t index, char *buffer)
+{
+  ProfileEntry entry;
+  if (!profileEntry(index, &entry))
+  {
+    return false;
+  }
+  sprintf(buffer, "profile %s: count=%lu min=%luus mean=%luus max=%luus total=%llums", entry.name, (unsigned long)entry.count,
+          entry.count > 0 ? (unsigned long)entry.minimum : 0UL, entry.count > 0 ? (unsigned long)(entry.total / entry.count) : 0UL,
+          (unsigned long)entry.maximum, entry.total / 1000);
+  return true;
+}
+
+void logSlowLoop(LoopWatchdog &watchdog)
+{
+  logWarning(LOG_MAIN, "Slow %s loop: %lums, %lums of it in %s", watchdog.task(), (unsigned long)(watchdog.lastOverrunMicros() / 1000),
+             (unsigned long)(watchdog.lastOverrunPhaseMicros() / 1000), watchdog.phaseName(watchdog.lastOverrunPhase()));
+}
+
+// The UI task's numbers are read without a lock and may be a moment old
+void printLoopPhases()
+{
+  LoopWatchdog *watchdogs[] = {&networkWatchdog, &uiWatchdog};
+  char buffer[128];
+  for (uint8_t index = 0; index < 2; index += 1)
+  {
+    for (uint8_t phase = 0; phase < watchdogs[index]->phases(); phase += 1)
+    {
+      formatLoopPhase(*watchdogs[index], phase, buffer);
+      logInfo(LOG_MAIN, "%s", buffer);
+    }
+  }
+  for (uint8_t index = 0; index < profileCount(); index += 1)
+  {
+    if (formatProfileEntry(index, buffer))
+    {
+      logInfo(LOG_MAIN, "%s", buffer);
+    }
+  }
+  scheduleAction(printLoopPhases, loopReportInterval);
+}
+
+// The flat profile of the PROFILE_SCOPE()s, see profiler.h. reset=1 starts it again afterwards.
+void handleProfile(HttpRequest &request)
+{
+  char buffer[128];
+  request.beginResponse(200, "text/plain");
+  if (profileCount() == 0)
+  {
+    request.print("Profiling is compiled out or nothing has run yet\n");
+  }
+  for (uint8_t index = 0; index < profileCount(); index += 1)
+  {
+    if (formatProfileEntry(index, buffer))
+    {
+      request.print(buffer);
+      request.print("\n");
+    }
+  }
+  char reset[4];
+  if (request.arg("reset", reset, sizeof(reset)) && strcmp(reset, "1") == 0)
+  {
+    profileReset();
+  }
+}
+
+// The heap now and at worst since boot, for the serial log, MQTT and /heap
+void formatHeap(char *buffer)
+{
+  uint32_t freeHeap = ESP.getFreeHeap();
+  uint32_t largestBlock = ESP.getMaxAllocHeap();
+  sprintf(buffer, "free=%lu min=%lu largest=%lu largest_min=%lu frag=%u%% frag_max=%u%% frag_max_at=%lus", (unsigned long)freeHeap,
+          (unsigned long)ESP.getMinFreeHeap(), (unsigned long)largestBlock, (unsigned long)heapMinLargestBlock,
+          heapFragmentation(freeHeap, largestBlock), heapMaxFragmentation, (unsigned long)(heapMaxFragmentationMillis / 1000));
+}
+
+// One line per caller that allocated after boot, false if there is none at index. See heap_guard.h.
+bool formatHeapGuardEntry(uint8_t index, char *buffer)
+{
+  HeapGuardEntry entry;
+  if (!heapGuardEntry(index, &entry))
+  {
+    return false;
+  }
+  sprintf(buffer, "heap guard 0x%08lx: count=%lu bytes=%lu largest=%lu", (unsigned long)(uintptr_t)entry.caller, (unsigned long)entry.count,
+          (unsigned long)entry.bytes, (unsigned long)entry.largest);
+  return true;
+}
+
+void reportHeap()
+{
+  char buffer[128];
+  formatHeap(buffer);
+  logInfo(LOG_MAIN, "%s %s", MQTT_TOPIC_HEAP, buffer);
+  publishString(MQTT_TOPIC_HEAP, buffer);
+  if (heapGuardArmed())
+  {
+    logWarning(LOG_MAIN, "%lu allocations after boot", (unsigned long)heapGuardAllocations());
+    for (uint8_t index = 0; index < heapGuardCount(); index += 1)
+    {
+      if (formatHeapGuardEntry(index, buffer))
+      {
+        logWarning(LOG_MAIN, "%s", buffer);
+      }
+    }
   }
-  char message[32] = "Do nothing";
-  switch (touchAction)
-  {
-  case TOUCH_ACTION_RESTART:
+  scheduleAction(reportHeap, heapReportInterval);
+}
 
-    sprintf(message, "Restart in %ds", touchCountDown);
-    break;
-  case TOUCH_ACTION_RESET:
-    sprintf(message, "Reset in %ds", touchCountDown);
-    break;
-  case TOUCH_ACTION_RING:
-    sprintf(message, "Ring in %ds", touchCountDown);
-    break;
+// The heap and, with HEAP_GUARD, who allocated after boot. reset=1 forgets the callers afterwards.
+void handleHeap(HttpRequest &request)
+{
+  char buffer[128];
+  request.beginResponse(200, "text/plain");
+  formatHeap(buffer);
+  request.print(buffer);
+  request.print("\n");
+  if (!heapGuardArmed())
+  {
+    request.print("Heap guard is compiled out, see heap_guard.h\n");
+    return;
+  }
+  sprintf(buffer, "%lu allocations after boot\n", (unsigned long)heapGuardAllocations());
+  request.print(buffer);
+  for (uint8_t index = 0; index < heapGuardCount(); index += 1)
+  {
+    if (formatHeapGuardEntry(index, buffer))
+    {
+      request.print(buffer);
+      request.print("\n");
+    }
+  }
+  char reset[4];
+  if (request.arg("reset", reset, sizeof(reset)) && strcmp(reset, "1") == 0)
+  {
+    heapGuardReset();
   }
-  setLineText(INFO_LINE, message);
-  updateDisplay();
-  nextTouchTimer = millis() + 1000;
 }
 
-void setCalibrationPoint(int point)
+// The loop phases as text, and the last slow iteration of each task
+void handleLoop(HttpRequest &request)
 {
-  calibrating = point;
-  char buffer[32];
-  String corner = "";
-  switch (point)
+  LoopWatchdog *watchdogs[] = {&networkWatchdog, &uiWatchdog};
+  char buffer[128];
+  request.beginResponse(200, "text/plain");
+  for (uint8_t index = 0; index < 2; index += 1)
   {
-  case TOP_LEFT:
-    corner = "top left";
-    break;
-  case TOP_RIGHT:
-    corner = "top right";
-    break;
-  case BOTTOM_LEFT:
-    corner = "bottom left";
-    break;
-  case BOTTOM_RIGHT:
-    corner = "bottom right";
-    break;
+    LoopWatchdog *watchdog = watchdogs[index];
+    for (uint8_t phase = 0; phase < watchdog->phases(); phase += 1)
+    {
+      formatLoopPhase(*watchdog, phase, buffer);
+      request.print(buffer);
+      request.print("\n");
+    }
+    if (watchdog->overruns() > 0)
+    {
+      sprintf(buffer, "%s last slow: %luus, %luus in %s\n", watchdog->task(), (unsigned long)watchdog->lastOverrunMicros(),
+              (unsigned long)watchdog->lastOverrunPhaseMicros(), watchdog->phaseName(watchdog->lastOverrunPhase()));
+      request.print(buffer);
+    }
   }
-  sprintf(buffer, "Touch cross %s", corner);
-  setLineText(INFO_LINE, buffer);
 }
-void handleCalibrationEvent()
+
+// Both tasks sleep until their next scheduled action is due or something
+// wakes them up: a message from the other task, the intercom pin and the
+// touch IRQ for the UI, WiFi events for the network. Sockets cannot wake the
+// network task, so neither sleeps longer than LOOP_POLL_INTERVAL, or
+// SLEEP_POLL_INTERVAL in light sleep.
+#define LOOP_POLL_INTERVAL 50  // milliseconds
+#define TOUCH_POLL_INTERVAL 20 // milliseconds while a finger is down - the IRQ only tells us when it goes down
+
+void IRAM_ATTR wakeUiFromIsr()
 {
-  switch (calibrating)
+  if (uiTask != NULL)
   {
-  case TOP_LEFT:
-    calibrationTopLeft = touchPoint;
-    setCalibrationPoint(TOP_RIGHT);
-    break;
-  case TOP_RIGHT:
-    calibrationTopRight = touchPoint;
-    setCalibrationPoint(BOTTOM_LEFT);
-    break;
-  case BOTTOM_LEFT:
-    calibrationBottomLeft = touchPoint;
-    setCalibrationPoint(BOTTOM_RIGHT);
-    break;
-  case BOTTOM_RIGHT:
-    calibrationBottomRight = touchPoint;
-    calibrating = 0;
-    calibrated = true;
-    storeCalibration();
-    printCalibrationInfo();
-    clearDisplay();
-    updateDisplay();
-    break;
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(uiTask, &woken);
+    if (woken == pdTRUE)
+    {
+      portYIELD_FROM_ISR();
+    }
   }
-  updateDisplay();
 }
 
-int mapTouchToScreenX(int x)
+volatile uint32_t intercomEdgeMicros = 0; // low 32 bits of esp_timer when the pin last changed
+
+void IRAM_ATTR intercomIsr()
 {
-  int xTouchMin = (calibrationTopLeft.x + calibrationBottomLeft.x) / 2;
-  int xTouchMax = (calibrationTopRight.x + calibrationBottomRight.x) / 2;
-  int xScreenMin = CROSSHAIR_MARGIN + CROSSHAIR_SIZE / 2;
-  int xScreenMax = tft.width() - CROSSHAIR_MARGIN - CROSSHAIR_SIZE / 2;
-  int mapped = map(x, xTouchMin, xTouchMax, xScreenMin, xScreenMax);
-  return mapped;
+  intercomEdgeMicros = esp_timer_get_time();
+  wakeUiFromIsr();
 }
 
-int mapTouchToScreenY(int y)
+// Automatic light sleep, switched by the UI task. The network task allows it
+// in the idle power modes: display off, nothing ringing, no recent activity.
+// FreeRTOS then sleeps whenever both tasks wait and wakes for the next task
+// timeout - the scheduler deadlines and the poll intervals - and the WiFi
+// driver for the DTIM beacons, so the connection and the MQTT keep alive go
+// on. The intercom pin and the touch IRQ wake it with a low level. Only
+// built with CPU_LIGHT_SLEEP, stock Arduino cannot do it.
+#define SLEEP_POLL_INTERVAL 250 // milliseconds - MQTT and HTTP wait up to this long while asleep
+
+bool lightSleep = false;          // UI task
+
+// The interrupts while awake: the intercom pin either way, a touch going down
+void attachWakeInterrupts()
 {
-  int yTouchMin = (calibrationTopLeft.y + calibrationTopRight.y) / 2;
-  int yTouchMax = (calibrationBottomLeft.y + calibrationBottomRight.y) / 2;
-  int yScreenMin = CROSSHAIR_MARGIN + CROSSHAIR_SIZE / 2;
-  int yScreenMax = tft.height() - CROSSHAIR_MARGIN - CROSSHAIR_SIZE / 2;
-  int mapped = map(y, yTouchMin, yTouchMax, yScreenMin, yScreenMax);
-  return mapped;
+  attachInterrupt(digitalPinToInterrupt(INTERCOM_PIN), intercomIsr, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(XPT2046_IRQ), wakeUiFromIsr, FALLING);
 }
 
-void handleTouchStartEvent()
+#if CPU_LIGHT_SLEEP
+bool lightSleepAvailable = true;  // until the CPU governor cannot do it
+volatile bool sleepWakeFired = false;
+
+// Level triggered while light sleep is on. The level stays, so the pin's
+// interrupt is switched off until loop() has had a look.
+void IRAM_ATTR sleepWakeIsr(void *pin)
 {
-  if (touchAction == TOUCH_ACTION_NONE && strncmp(intercomState, INTERCOM_RINGING, strlen(INTERCOM_RINGING)) == 0)
+  gpio_ll_intr_disable(&GPIO, (gpio_num_t)(uintptr_t)pin);
+  if ((uintptr_t)pin == INTERCOM_PIN)
   {
-    println("Ringing turned off");
-    updateIntercom(IDLE);
-    setDisplayMode(DISPLAY_STATUS);
+    intercomEdgeMicros = esp_timer_get_time();
   }
-  char buffer[64] = "";
-  if (displayMode == DISPLAY_OFF)
+  sleepWakeFired = true;
+  wakeUiFromIsr();
+}
+
+void armWakePins(bool sleeping)
+{
+  sleepWakeFired = false;
+  if (sleeping)
   {
-    // display is off
-    displayOn();
-    setDisplayMode(DISPLAY_LOGO);
-    updateDisplay();
-    sprintf(buffer, "WAKE x:%d y:%d z:%d", touchPoint.x, touchPoint.y, touchPoint.z);
-    println(buffer);
+    attachInterruptArg(INTERCOM_PIN, sleepWakeIsr, (void *)INTERCOM_PIN, ONLOW_WE); // ringing is low
+    attachInterruptArg(XPT2046_IRQ, sleepWakeIsr, (void *)XPT2046_IRQ, ONLOW_WE);   // low while touched
   }
-  else if (touchStartTime == 0 && displayMode != DISPLAY_LOGO)
+  else
   {
-    sprintf(buffer, "TOUCH x:%d y:%d z:%d", touchPoint.x, touchPoint.y, touchPoint.z);
-    println(buffer);
-    if (calibrated)
-    {
-      int16_t screenX = mapTouchToScreenX(touchPoint.x);
-      int16_t screenY = mapTouchToScreenY(touchPoint.y);
-      int16_t lineHeight = tft.height() / DISPLAY_LINES;
-      int16_t lineTouched = screenY / lineHeight + 1;
-      sprintf(buffer, "SCREEN x:%d y:%d LINE %d", screenX, screenY, lineTouched);
-      println(buffer);
-      switch (lineTouched)
-      {
-      case SSID_LINE:
-      case IP_LINE:
-      case BROKER_TEXT_LINE:
-      case BROKER_IP_LINE:
-      case BROKER_STATUS_LINE:
-        touchAction = TOUCH_ACTION_RESTART;
-        break;
-      case UPTIME_LINE:
-      case CLOCK_LINE:
-        touchAction = TOUCH_ACTION_RESET;
-        break;
-      case INFO_LINE:
-        touchAction = TOUCH_ACTION_RING;
-        break;
-      default:
-        touchAction = TOUCH_ACTION_NONE;
-        break;
-      }
-    }
-    touchStartTime = millis();
-    nextTouchTimer = millis() + 1000; // every second
-    if (calibrating)
-    {
-      handleCalibrationEvent();
-    }
+    gpio_wakeup_disable((gpio_num_t)INTERCOM_PIN);
+    gpio_wakeup_disable((gpio_num_t)XPT2046_IRQ);
+    attachWakeInterrupts();
   }
 }
 
-void handleTouchEndEvent()
+void setLightSleep(bool enable)
 {
-  println("TOUCH END");
-  if (!calibrating)
+  if (enable == lightSleep || (enable && !lightSleepAvailable))
   {
-    setLineText(INFO_LINE, "");
+    return;
   }
-  if (displayMode == DISPLAY_LOGO)
+  if (enable)
   {
-    setDisplayMode(DISPLAY_STATUS);
+    armWakePins(true); // before the first sleep
+  }
+  if (!cpuGovernorLightSleep(enable))
+  {
+    logWarning(LOG_POWER, "Light sleep not available");
+    lightSleepAvailable = false;
+    enable = false;
+  }
+  if (!enable)
+  {
+    armWakePins(false);
+  }
+  lightSleep = enable;
+  logInfo(LOG_POWER, "Light sleep %s", enable ? "on" : "off");
+  if (!sendToNetwork(MESSAGE_SLEEP, enable ? 1 : 0, NULL))
+  {
+    sleepStateNotSent = enable ? 1 : 0;
   }
-  updateDisplay();
-  touchStartTime = 0;
-  nextTouchTimer = 0;
-  touchCountDown = 0;
-  touchAction = TOUCH_ACTION_NONE;
-  screenTimeout = millis() + SCREEN_TIMEOUT;
 }
+#endif
 
-void handleUptime()
+void waitForWork(uint32_t pollInterval)
 {
-  char buffer[20];
-  sprintf(buffer, "Uptime: %s", uptimeText);
-  println(buffer);
-  server.send(200, "text/plain", buffer);
+  int64_t limit = pollInterval * 1000LL;
+  int64_t wait = scheduledActionWait();
+  if (wait == SCHEDULER_IDLE || wait > limit)
+  {
+    wait = limit;
+  }
+  // Round up - waking early would only mean another look at the deadline
+  int64_t tickMicros = portTICK_PERIOD_MS * 1000LL;
+  TickType_t ticks = (wait + tickMicros - 1) / tickMicros;
+  if (ticks > 0)
+  {
+    ulTaskNotifyTake(pdTRUE, ticks);
+  }
 }
 
-void handleRestart()
+void setupWakeups()
 {
-  char buffer[20];
-  sprintf(buffer, "Restarting");
-  println(buffer);
-  server.send(200, "text/plain", buffer);
-  delay(2000);
-  ESP.restart();
+  pinMode(XPT2046_IRQ, INPUT); // low while touched
+#if CPU_LIGHT_SLEEP
+  esp_sleep_enable_gpio_wakeup(); // for the pins armWakePins() enables
+#endif
+  attachWakeInterrupts();
 }
 
-void handleReset()
+// What did not fit into the UI queue, lines with their current text
+void resendToUi()
 {
-  char buffer[20];
-  sprintf(buffer, "Resetting");
-  println(buffer);
-  server.send(200, "text/plain", buffer);
-  delay(2000);
-  resetStoredCalibration();
-  ESP.restart();
+  if (sleepNotSent >= 0 && sendToUi(MESSAGE_SLEEP, sleepNotSent, NULL))
+  {
+    sleepNotSent = -1;
+  }
+  for (uint8_t index = 0; index < DISPLAY_LINES; index += 1)
+  {
+    if ((linesNotSent & (1 << index)) && sendToUi(MESSAGE_LINE, index + 1, lines[index]))
+    {
+      linesNotSent &= ~(1 << index);
+    }
+  }
 }
 
-void handleColour()
+// What did not fit into the network queue while the network task was busy
+void resendToNetwork()
 {
-  println("POST");
-  if (server.hasArg("plain"))
+  if (ringNotSent >= 0 && sendMessage(networkQueue, networkTask, MESSAGE_RING, ringNotSent, NULL, ringNotSentTime))
+  {
+    ringNotSent = -1;
+  }
+  if (sleepStateNotSent >= 0 && sendToNetwork(MESSAGE_SLEEP, sleepStateNotSent, NULL))
+  {
+    sleepStateNotSent = -1;
+  }
+  for (uint8_t index = 0; index < DISPLAY_LINES; index += 1)
   {
-    String body = server.arg("plain");
-    print("Arg ");
-    println(body.c_str());
+    if ((screenLinesNotSent & (1 << index)) && sendToNetwork(MESSAGE_LINE, index + 1, screenLines[index]))
+    {
+      screenLinesNotSent &= ~(1 << index);
+    }
   }
-  server.send(200, "text/plain", "Thank you.");
 }
 
-void handleIntercom()
+// Messages from the UI task
+void handleUiMessages()
 {
-  if (server.hasArg("intercom"))
+  TaskMessage message;
+  while (networkQueue.pop(message))
   {
-    println("DINGDONG");
-    String body = server.arg("intercom");
-    print("Arg ");
-    println(body.c_str());
-    if (strcmp(body.c_str(), "1") == 0)
-    {
-      updateIntercom(RINGING);
-    }
-    else
+    switch (message.type)
     {
-      updateIntercom(IDLE);
+    case MESSAGE_LINE:
+      updateLine(message.value, message.text);
+      break;
+    case MESSAGE_RING:
+      handleRing(message.value != 0, message.time);
+      break;
+    case MESSAGE_ACTIVITY:
+      powerActivity();
+      break;
+    case MESSAGE_DISPLAY:
+      displayActive = message.value != 0;
+      break;
+    case MESSAGE_SLEEP:
+      setPowerMode(powerMode, millis()); // account for the time so far
+      lightSleepOn = message.value != 0;
+      break;
     }
   }
-  server.send(200, "text/plain", "Thank you.");
 }
 
-void handleWeb()
+// Fast boot: the status screen replaces the logo once the broker is connected, or after BOOT_LOGO_TIMEOUT
+void endBootLogo()
 {
-  String page = "<!DOCTYPE html> <html>\n";
-  page += "<head>\n";
-  page += "<meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0, user-scalable=no\">\n";
-  page += "<meta http-equiv=\"refresh\" content=\"60\">";
-  page += "<title>BB Intercom</title>\n";
-  page += "<style></style>\n";
-  page += "</head>\n";
-  page += "<body>\n";
-  for (uint8_t index = 0; index < DISPLAY_LINES; index += 1)
+  cancelAction(endBootLogo);
+  if (displayMode == DISPLAY_LOGO)
+  {
+    setDisplayMode(DISPLAY_STATUS);
+    updateDisplay();
+  }
+}
+
+// Messages from the network task. The display is drawn once for all of them,
+// not at all while the logo is up.
+void handleNetworkMessages()
+{
+  TaskMessage message;
+  bool linesChanged = false;
+  while (uiQueue.pop(message))
+  {
+    switch (message.type)
+    {
+    case MESSAGE_LINE:
+      copyLine(screenLines[message.value - 1], message.text);
+      linesChanged = true;
+      break;
+    case MESSAGE_RING:
+      updateIntercom(message.value != 0 ? RINGING : IDLE, message.time);
+      break;
+    case MESSAGE_BACKLIGHT:
+      if (message.value != 0)
+      {
+        displayOn();
+        setDisplayMode(DISPLAY_STATUS);
+        updateDisplay();
+      }
+      else
+      {
+        displayOff();
+      }
+      break;
+#if CPU_LIGHT_SLEEP
+    case MESSAGE_SLEEP:
+      setLightSleep(message.value != 0);
+      break;
+#endif
+    case MESSAGE_BOOTED:
+      endBootLogo();
+      break;
+    }
+  }
+  if (linesChanged && displayMode != DISPLAY_LOGO)
   {
-    page += "<h1>&nbsp;";
-    page += lines[index];
-    page += "</h1>\n";
+    updateDisplay();
   }
-  page += "</body>\n";
-  page += "</html>\n";
-  server.send(200, "text/html", page);
 }
 
 void setupRouting()
@@ -1124,17 +3354,92 @@ void setupRouting()
   server.on("/uptime", handleUptime);
   server.on("/restart", handleRestart);
   server.on("/reset", handleReset);
-  server.on("/colour", HTTP_POST, handleColour);
-  server.on("/intercom", HTTP_POST, handleIntercom);
+  server.on("/colour", HTTP_METHOD_POST, handleColour);
+  server.on("/intercom", HTTP_METHOD_POST, handleIntercom);
   server.on("/", handleWeb);
+  server.on("/events", HTTP_METHOD_GET, handleEvents);
+  server.on("/api/status", HTTP_METHOD_GET, handleApiStatus);
+  server.on("/metrics", HTTP_METHOD_GET, handleMetrics);
+  server.on("/loop", HTTP_METHOD_GET, handleLoop);
+  server.on("/heap", HTTP_METHOD_GET, handleHeap);
+  server.on("/profile", HTTP_METHOD_GET, handleProfile);
+}
+
+// The network task's setup(), it runs on the network task so its actions are scheduled there
+void setupNetwork()
+{
+  WiFi.onEvent(WiFiEvent);
+  setupWifi(); // and setupMQTT() once connected
+  setupRouting();
+  server.begin();
+  char text[33];
+  connectedSsid(text);
+  logInfo(LOG_WIFI, "SSID %s", text);
+#ifdef LOG_UDP_HOST
+  IPAddress logHost;
+  logHost.fromString(LOG_UDP_HOST);
+  logSetUdpSink((uint32_t)logHost, LOG_UDP_PORT, hostname);
+#endif
+  WiFi.setSleep(WIFI_PS_NONE); // updatePowerPolicy() takes over from here
+  powerActivity();
+  scheduleAction(updateUptime, uptimeUpdateInterval);
+  trackHeap();
+  scheduleAction(checkTelemetry, telemetryCheckInterval);
+  scheduleAction(printLoopPhases, loopReportInterval);
+  scheduleAction(reportHeap, heapReportInterval);
+}
+
+// The network task's loop()
+void networkLoop()
+{
+  unsigned long loopStart = micros();
+  unsigned long now = millis();
+  networkWatchdog.startIteration();
+  handleUiMessages();
+  resendToUi();
+  networkWatchdog.mark(NETWORK_PHASE_MESSAGES);
+  superviseWifi(esp_timer_get_time() / 1000);
+  networkWatchdog.mark(NETWORK_PHASE_WIFI);
+  updatePowerPolicy(now);
+  networkWatchdog.mark(NETWORK_PHASE_POWER);
+  mqttClient.loop();
+  superviseMqtt();
+  networkWatchdog.mark(NETWORK_PHASE_MQTT);
+  server.poll();
+  networkWatchdog.mark(NETWORK_PHASE_HTTP);
+  runScheduledActions();
+  networkWatchdog.mark(NETWORK_PHASE_ACTIONS);
+  if (networkWatchdog.endIteration())
+  {
+    logSlowLoop(networkWatchdog);
+  }
+  unsigned long loopTime = micros() - loopStart;
+  histogramAdd(&loopHistogram, loopTime);
+  histogramAdd(&loopHistogramSinceBoot, loopTime);
+  waitForWork(lightSleepOn ? SLEEP_POLL_INTERVAL : LOOP_POLL_INTERVAL);
+}
+
+void runNetworkTask(void *parameter)
+{
+  setupNetwork();
+  networkWatchdog.begin();
+  while (true)
+  {
+    networkLoop();
+  }
 }
 
 void setup()
 {
+  uiTask = xTaskGetCurrentTaskHandle(); // setup() and loop() are the UI task
   Serial.begin(115200);
+  logBegin();
+#ifndef FAST_BOOT
   delay(100);
+#endif
 
   setupPreferences();
+  markBootPhase(BOOT_PREFERENCES);
   mySPI.begin(XPT2046_CLK, XPT2046_MISO, XPT2046_MOSI, XPT2046_CS);
   touchscreen.begin(mySPI);
   touchscreen.setRotation(orientation);
@@ -1143,62 +3448,68 @@ void setup()
   tft.init();
   tft.setRotation(orientation); // This is the display in landscape (1 or 3) or portrait (0 or 2)
   tft.setFreeFont(FREE_FONT);
+  markBootPhase(BOOT_DISPLAY);
 
-  Serial.println("Starting up");
-  Serial.print("Display: ");
-  Serial.print(String(tft.width()));
-  Serial.print("x");
-  Serial.println(String(tft.height()));
+  logInfo(LOG_MAIN, "Starting up");
+  logInfo(LOG_MAIN, "Display: %dx%d", tft.width(), tft.height());
   setDisplayMode(DISPLAY_LOGO);
   updateDisplay();
+  markBootPhase(BOOT_LOGO);
+#ifndef FAST_BOOT
   delay(3000);
   setDisplayMode(DISPLAY_STATUS);
+#endif
   pinMode(BACKLIGHT_PIN, OUTPUT);
   pinMode(INTERCOM_PIN, INPUT_PULLUP); // Ringing is 0, idle is 1, so we pull up as default
 
-  WiFi.onEvent(WiFiEvent);
-  setupWifi();
-  setupMQTT();
-  // Now we set the double reset flag to true
-  setupRouting();
-  server.begin();
-  const char *ssid = WiFi.SSID().c_str();
-  Serial.printf("SSID %s\n", ssid);
   if (!calibrated)
   {
+    setDisplayMode(DISPLAY_STATUS); // the crosshair cannot wait for the network
     setCalibrationPoint(TOP_LEFT);
     updateDisplay();
   }
   displayOn();
-  updateDisplay();
-  Serial.println("Ready.");
+  if (displayMode != DISPLAY_LOGO)
+  {
+    updateDisplay();
+  }
+  cpuGovernorBegin(); // boot runs at full speed
+  setupWakeups();
+  uiWatchdog.begin();
+  markBootPhase(BOOT_READY);
+  // WiFi and MQTT connect in the background while the logo is up
+  xTaskCreatePinnedToCore(runNetworkTask, "network", NETWORK_TASK_STACK, NULL, NETWORK_TASK_PRIORITY, &networkTask, NETWORK_CORE);
+  if (displayMode == DISPLAY_LOGO)
+  {
+    scheduleAction(endBootLogo, BOOT_LOGO_TIMEOUT);
+  }
+  logInfo(LOG_MAIN, "Ready.");
 }
 
+// The UI task
 void loop()
 {
-  unsigned long now = millis();
+  unsigned long loopStart = micros();
+  uiWatchdog.startIteration();
+  handleNetworkMessages();
+  resendToNetwork();
+  uiWatchdog.mark(UI_PHASE_MESSAGES);
+#if CPU_LIGHT_SLEEP
+  if (sleepWakeFired && digitalRead(INTERCOM_PIN) == HIGH && digitalRead(XPT2046_IRQ) == HIGH)
+  {
+    armWakePins(true); // woken for nothing, wait for the next one
+  }
+#endif
   currentIntercomState = digitalRead(INTERCOM_PIN);
   if (lastIntercomState != currentIntercomState)
   {
-    updateIntercom(currentIntercomState);
+    // The ring starts at the edge the interrupt saw, unless that is old news
+    int64_t now = esp_timer_get_time();
+    uint32_t age = (uint32_t)now - intercomEdgeMicros;
+    updateIntercom(currentIntercomState, age < 1000000 ? now - age : now);
   }
   lastIntercomState = currentIntercomState;
-  if (nextTouchTimer > 0 && now > nextTouchTimer)
-  {
-    handleTouchTimer();
-  }
-  if (now > uptimeUpdateMillis + uptimeUpdateInterval)
-  {
-    uptimeUpdateMillis += uptimeUpdateInterval;
-    updateUptimeText(uptimeUpdateMillis);
-    char uptimeDisplayText[32] = "";
-    sprintf(uptimeDisplayText, "Uptime: %s", uptimeText);
-    setLineText(UPTIME_LINE, uptimeDisplayText);
-    publishString(MQTT_TOPIC_UPTIME, uptimeText);
-    updateDisplay();
-  }
-  mqttClient.loop();
-  server.handleClient();
+  uiWatchdog.mark(UI_PHASE_INTERCOM);
   if (touchscreen.tirqTouched() && touchscreen.touched())
   {
     TS_Point reading = touchscreen.getPoint();
@@ -1218,9 +3529,13 @@ void loop()
     // then clear the value
     touchPoint = TS_Point(0, 0, 0);
   }
-  if (now > screenTimeout && currentIntercomState == IDLE && displayMode == DISPLAY_STATUS && !calibrating)
+  uiWatchdog.mark(UI_PHASE_TOUCH);
+  runScheduledActions();
+  uiWatchdog.mark(UI_PHASE_ACTIONS);
+  if (uiWatchdog.endIteration())
   {
-    displayOff();
+    logSlowLoop(uiWatchdog);
   }
-  delay(50);
-}
\ No newline at end of file
+  histogramAdd(&uiLoopHistogram, micros() - loopStart);
+  waitForWork(lightSleep ? SLEEP_POLL_INTERVAL : touchPoint.z != 0 ? TOUCH_POLL_INTERVAL : LOOP_POLL_INTERVAL);
+}
@@ -0,0 +1,616 @@
+#include "mqtt_client.h"
+
+MqttClient::MqttClient(Client &client)
+{
+  this->client = &client;
+  host = "";
+  port = 0;
+  callback = NULL;
+  keepAlive = MQTT_KEEPALIVE;
+  socketTimeout = MQTT_SOCKET_TIMEOUT;
+  currentState = MQTT_DISCONNECTED;
+  lastOutActivity = 0;
+  lastInActivity = 0;
+  pingOutstanding = false;
+  nextPacketId = 0;
+  inflightUsed = 0;
+  published = 0;
+  acknowledged = 0;
+  retransmits = 0;
+  dropped = 0;
+  superseded = 0;
+  lastAck = 0;
+  lastQueued = 0;
+  memset(ackIds, 0, sizeof(ackIds));
+  ackNext = 0;
+  pingSent = 0;
+  pings = 0;
+  lastPing = 0;
+  resetReceive();
+}
+
+MqttClient &MqttClient::setClient(Client &client)
+{
+  this->client = &client;
+  return *this;
+}
+
+MqttClient &MqttClient::setServer(const char *host, uint16_t port)
+{
+  this->host = host;
+  this->port = port;
+  return *this;
+}
+
+MqttClient &MqttClient::setCallback(MqttCallback callback)
+{
+  this->callback = callback;
+  return *this;
+}
+
+MqttClient &MqttClient::setKeepAlive(uint16_t seconds)
+{
+  keepAlive = seconds;
+  return *this;
+}
+
+MqttClient &MqttClient::setSocketTimeout(uint16_t seconds)
+{
+  socketTimeout = seconds;
+  return *this;
+}
+
+uint16_t MqttClient::allocatePacketId()
+{
+  nextPacketId += 1;
+  if (nextPacketId == 0)
+  {
+    // 0 is not a valid packet id
+    nextPacketId = 1;
+  }
+  return nextPacketId;
+}
+
+bool MqttClient::connect(const char *id, const char *username, const char *password)
+{
+  if (connected())
+  {
+    return true;
+  }
+  if (!client->connect(host, port))
+  {
+    currentState = MQTT_CONNECT_FAILED;
+    return false;
+  }
+  // Variable header: protocol name, level 4 (3.1.1), flags, keep alive
+  size_t length = MQTT_MAX_HEADER_SIZE;
+  length = writeString("MQTT", length);
+  buffer[length++] = 4;
+  uint8_t flags = 0x00; // clean session is off - the broker keeps our session
+  if (username != NULL && strlen(username) > 0)
+  {
+    flags |= 0x80;
+    if (password != NULL && strlen(password) > 0)
+    {
+      flags |= 0x40;
+    }
+  }
+  buffer[length++] = flags;
+  buffer[length++] = keepAlive >> 8;
+  buffer[length++] = keepAlive & 0xFF;
+  length = writeString(id, length);
+  if (flags & 0x80)
+  {
+    length = writeString(username, length);
+  }
+  if (flags & 0x40)
+  {
+    length = writeString(password, length);
+  }
+  if (length == 0 || !write(MQTT_CONNECT, length - MQTT_MAX_HEADER_SIZE))
+  {
+    client->stop();
+    currentState = MQTT_CONNECT_FAILED;
+    return false;
+  }
+  // Wait for the CONNACK
+  resetReceive();
+  unsigned long start = millis();
+  size_t packetLength = 0;
+  uint8_t offset = 0;
+  while (!readPacket(&packetLength, &offset))
+  {
+    if (!client->connected() || millis() - start >= socketTimeout * 1000UL)
+    {
+      client->stop();
+      currentState = MQTT_CONNECTION_TIMEOUT;
+      return false;
+    }
+    delay(1);
+  }
+  if (packetLength != 4 || (receiveBuffer[0] & 0xF0) != MQTT_CONNACK)
+  {
+    client->stop();
+    currentState = MQTT_CONNECT_FAILED;
+    return false;
+  }
+  if (receiveBuffer[3] != 0)
+  {
+    client->stop();
+    currentState = receiveBuffer[3];
+    return false;
+  }
+  lastInActivity = lastOutActivity = millis();
+  pingOutstanding = false;
+  currentState = MQTT_CONNECTED;
+  // Whether or not the broker still has our session (receiveBuffer[2]) we
+  // send everything that has not been acknowledged yet
+  resendInflight();
+  return true;
+}
+
+void MqttClient::disconnect()
+{
+  buffer[MQTT_MAX_HEADER_SIZE - 2] = MQTT_DISCONNECT;
+  buffer[MQTT_MAX_HEADER_SIZE - 1] = 0;
+  client->write(buffer + MQTT_MAX_HEADER_SIZE - 2, 2);
+  client->stop();
+  currentState = MQTT_DISCONNECTED;
+}
+
+bool MqttClient::connected()
+{
+  if (!client->connected())
+  {
+    if (currentState == MQTT_CONNECTED)
+    {
+      currentState = MQTT_CONNECTION_LOST;
+      client->stop();
+    }
+    return false;
+  }
+  return currentState == MQTT_CONNECTED;
+}
+
+int MqttClient::state()
+{
+  return currentState;
+}
+
+bool MqttClient::loop()
+{
+  if (!connected())
+  {
+    return false;
+  }
+  unsigned long now = millis();
+  unsigned long keepAliveMillis = keepAlive * 1000UL;
+  if (now - lastInActivity > keepAliveMillis || now - lastOutActivity > keepAliveMillis)
+  {
+    if (pingOutstanding)
+    {
+      currentState = MQTT_CONNECTION_TIMEOUT;
+      client->stop();
+      return false;
+    }
+    buffer[MQTT_MAX_HEADER_SIZE - 2] = MQTT_PINGREQ;
+    buffer[MQTT_MAX_HEADER_SIZE - 1] = 0;
+    client->write(buffer + MQTT_MAX_HEADER_SIZE - 2, 2);
+    lastOutActivity = now;
+    lastInActivity = now;
+    pingOutstanding = true;
+    pingSent = esp_timer_get_time();
+  }
+  size_t length;
+  uint8_t offset;
+  while (readPacket(&length, &offset))
+  {
+    lastInActivity = millis();
+    if (length > 0)
+    {
+      handlePacket(length, offset);
+    }
+    if (!connected())
+    {
+      return false;
+    }
+  }
+  if (receiveUsed > 0 && millis() - receiveStart >= socketTimeout * 1000UL)
+  {
+    // the rest of the packet is not coming
+    currentState = MQTT_CONNECTION_TIMEOUT;
+    client->stop();
+    resetReceive();
+    return false;
+  }
+  return true;
+}
+
+bool MqttClient::subscribe(const char *topic, uint8_t qos)
+{
+  if (!connected() || qos > 1)
+  {
+    return false;
+  }
+  size_t length = MQTT_MAX_HEADER_SIZE;
+  uint16_t packetId = allocatePacketId();
+  buffer[length++] = packetId >> 8;
+  buffer[length++] = packetId & 0xFF;
+  length = writeString(topic, length);
+  if (length == 0 || length >= MQTT_BUFFER_SIZE)
+  {
+    return false;
+  }
+  buffer[length++] = qos;
+  // The SUBACK arrives in loop() and needs no action
+  return write(MQTT_SUBSCRIBE | MQTT_FLAG_QOS1, length - MQTT_MAX_HEADER_SIZE);
+}
+
+bool MqttClient::publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained, uint8_t qos)
+{
+  if (qos == 0)
+  {
+    if (!connected())
+    {
+      return false;
+    }
+    size_t position = writeString(topic, MQTT_MAX_HEADER_SIZE);
+    if (position == 0 || position + length > MQTT_BUFFER_SIZE)
+    {
+      return false;
+    }
+    memcpy(buffer + position, payload, length);
+    position += length;
+    return write(MQTT_PUBLISH | (retained ? MQTT_FLAG_RETAIN : 0), position - MQTT_MAX_HEADER_SIZE);
+  }
+  lastQueued = 0;
+  if (strlen(topic) >= MQTT_INFLIGHT_TOPIC_SIZE || length > MQTT_INFLIGHT_PAYLOAD_SIZE)
+  {
+    dropped += 1;
+    return false;
+  }
+  if (retained)
+  {
+    for (uint8_t index = 0; index < inflightUsed; index += 1)
+    {
+      if (inflight[index].retained && strcmp(inflight[index].topic, topic) == 0)
+      {
+        // A PUBACK for it, should one still come, matches nothing
+        removeInflight(index);
+        superseded += 1;
+        break;
+      }
+    }
+  }
+  if (inflightUsed >= MQTT_INFLIGHT_WINDOW)
+  {
+    removeInflight(0);
+    dropped += 1;
+  }
+  MqttInflightMessage *message = &inflight[inflightUsed];
+  inflightUsed += 1;
+  message->packetId = allocatePacketId();
+  lastQueued = message->packetId;
+  for (uint8_t index = 0; index < MQTT_ACK_HISTORY; index += 1)
+  {
+    if (ackIds[index] == lastQueued)
+    {
+      ackIds[index] = 0; // a PUBACK from before the ids wrapped around is not for this one
+    }
+  }
+  message->retained = retained;
+  message->sent = false;
+  strncpy(message->topic, topic, MQTT_INFLIGHT_TOPIC_SIZE);
+  memcpy(message->payload, payload, length);
+  message->payloadLength = length;
+  published += 1;
+  if (connected())
+  {
+    sendInflight(message);
+  }
+  // Even if sending failed the message is queued for the next reconnect
+  return true;
+}
+
+uint8_t MqttClient::inflightCount()
+{
+  return inflightUsed;
+}
+
+uint32_t MqttClient::publishedCount()
+{
+  return published;
+}
+
+uint32_t MqttClient::acknowledgedCount()
+{
+  return acknowledged;
+}
+
+uint32_t MqttClient::retransmitCount()
+{
+  return retransmits;
+}
+
+uint32_t MqttClient::droppedCount()
+{
+  return dropped;
+}
+
+uint32_t MqttClient::supersededCount()
+{
+  return superseded;
+}
+
+int64_t MqttClient::lastAckMicros()
+{
+  return lastAck;
+}
+
+uint16_t MqttClient::lastPacketId()
+{
+  return lastQueued;
+}
+
+bool MqttClient::pending(uint16_t packetId)
+{
+  for (uint8_t index = 0; index < inflightUsed; index += 1)
+  {
+    if (inflight[index].packetId == packetId)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool MqttClient::findAck(uint16_t packetId, int64_t *micros)
+{
+  for (uint8_t index = 0; index < MQTT_ACK_HISTORY; index += 1)
+  {
+    if (packetId != 0 && ackIds[index] == packetId)
+    {
+      *micros = ackTimes[index];
+      return true;
+    }
+  }
+  return false;
+}
+
+uint32_t MqttClient::pingCount()
+{
+  return pings;
+}
+
+uint32_t MqttClient::lastPingMicros()
+{
+  return lastPing;
+}
+
+bool MqttClient::sendInflight(MqttInflightMessage *message)
+{
+  uint8_t header = MQTT_PUBLISH | MQTT_FLAG_QOS1;
+  if (message->retained)
+  {
+    header |= MQTT_FLAG_RETAIN;
+  }
+  if (message->sent)
+  {
+    header |= MQTT_FLAG_DUP;
+    retransmits += 1;
+  }
+  size_t position = writeString(message->topic, MQTT_MAX_HEADER_SIZE);
+  buffer[position++] = message->packetId >> 8;
+  buffer[position++] = message->packetId & 0xFF;
+  memcpy(buffer + position, message->payload, message->payloadLength);
+  position += message->payloadLength;
+  message->sent = true;
+  return write(header, position - MQTT_MAX_HEADER_SIZE);
+}
+
+void MqttClient::resendInflight()
+{
+  // oldest first - the window is kept in publish order
+  for (uint8_t index = 0; index < inflightUsed; index += 1)
+  {
+    if (!sendInflight(&inflight[index]))
+    {
+      break;
+    }
+  }
+}
+
+// Closes the gap so the window stays in publish order
+void MqttClient::removeInflight(uint8_t index)
+{
+  memmove(&inflight[index], &inflight[index + 1], (inflightUsed - index - 1) * sizeof(MqttInflightMessage));
+  inflightUsed -= 1;
+}
+
+void MqttClient::handlePuback(uint16_t packetId)
+{
+  for (uint8_t index = 0; index < inflightUsed; index += 1)
+  {
+    if (inflight[index].packetId == packetId)
+    {
+      removeInflight(index);
+      acknowledged += 1;
+      lastAck = esp_timer_get_time();
+      ackIds[ackNext] = packetId;
+      ackTimes[ackNext] = lastAck;
+      ackNext = (ackNext + 1) % MQTT_ACK_HISTORY;
+      return;
+    }
+  }
+}
+
+void MqttClient::handlePacket(size_t length, uint8_t offset)
+{
+  uint8_t type = receiveBuffer[0] & 0xF0;
+  switch (type)
+  {
+  case MQTT_PUBLISH:
+  {
+    uint8_t qos = (receiveBuffer[0] >> 1) & 0x03;
+    uint16_t topicLength = (receiveBuffer[offset] << 8) | receiveBuffer[offset + 1];
+    size_t topicStart = offset + 2;
+    size_t payloadStart = topicStart + topicLength;
+    uint16_t packetId = 0;
+    if (payloadStart + (qos > 0 ? 2 : 0) > length)
+    {
+      return; // malformed
+    }
+    if (qos > 0)
+    {
+      packetId = (receiveBuffer[payloadStart] << 8) | receiveBuffer[payloadStart + 1];
+      payloadStart += 2;
+    }
+    if (qos == 1)
+    {
+      // acknowledge first - the callback may publish and take its time
+      uint8_t puback[4] = {MQTT_PUBACK, 2, (uint8_t)(packetId >> 8), (uint8_t)(packetId & 0xFF)};
+      client->write(puback, 4);
+      lastOutActivity = millis();
+    }
+    if (callback)
+    {
+      // Move the topic down one byte over its length to make room for a terminating 0
+      memmove(receiveBuffer + topicStart - 1, receiveBuffer + topicStart, topicLength);
+      receiveBuffer[topicStart - 1 + topicLength] = '\0';
+      callback((char *)receiveBuffer + topicStart - 1, receiveBuffer + payloadStart, length - payloadStart);
+    }
+    break;
+  }
+  case MQTT_PUBACK:
+    if (length >= (size_t)offset + 2)
+    {
+      handlePuback((receiveBuffer[offset] << 8) | receiveBuffer[offset + 1]);
+    }
+    break;
+  case MQTT_PINGREQ:
+  {
+    uint8_t pingresp[2] = {MQTT_PINGRESP, 0};
+    client->write(pingresp, 2);
+    lastOutActivity = millis();
+    break;
+  }
+  case MQTT_PINGRESP:
+    if (pingOutstanding)
+    {
+      pings += 1;
+      lastPing = esp_timer_get_time() - pingSent;
+    }
+    pingOutstanding = false;
+    break;
+  default:
+    // SUBACK etc. need no action
+    break;
+  }
+}
+
+void MqttClient::resetReceive()
+{
+  receiveUsed = 0;
+  receiveOffset = 0;
+  receiveRemaining = 0;
+  receiveMultiplier = 1;
+  receiveTooLarge = false;
+}
+
+// Reads what has arrived of the current packet into receiveBuffer. True once
+// a whole packet is in: length is its total length (0 if it was too large
+// and thrown away) and offset the start of its variable header.
+bool MqttClient::readPacket(size_t *length, uint8_t *offset)
+{
+  while (client->available())
+  {
+    int next = client->read();
+    if (next < 0)
+    {
+      return false;
+    }
+    uint8_t byte = next;
+    if (receiveUsed == 0)
+    {
+      receiveStart = millis();
+      receiveBuffer[receiveUsed++] = byte;
+      continue;
+    }
+    if (receiveOffset == 0)
+    {
+      // The remaining length, 7 bits per byte in at most 4 bytes
+      if (receiveUsed == MQTT_MAX_HEADER_SIZE)
+      {
+        client->stop();
+        resetReceive();
+        return false;
+      }
+      receiveBuffer[receiveUsed++] = byte;
+      receiveRemaining += (byte & 0x7F) * receiveMultiplier;
+      receiveMultiplier <<= 7;
+      if (byte & 0x80)
+      {
+        continue;
+      }
+      receiveOffset = receiveUsed;
+      receiveTooLarge = receiveUsed + receiveRemaining > MQTT_BUFFER_SIZE;
+    }
+    else
+    {
+      if (!receiveTooLarge)
+      {
+        receiveBuffer[receiveUsed] = byte;
+      }
+      receiveUsed += 1;
+      receiveRemaining -= 1;
+    }
+    if (receiveRemaining == 0)
+    {
+      *length = receiveTooLarge ? 0 : receiveUsed;
+      *offset = receiveOffset;
+      resetReceive();
+      return true;
+    }
+  }
+  return false;
+}
+
+// The packet body is in buffer from MQTT_MAX_HEADER_SIZE on. The fixed header
+// is put right in front of it so the whole packet goes out in one write.
+bool MqttClient::write(uint8_t header, size_t length)
+{
+  uint8_t lengthBytes[4];
+  uint8_t lengthLength = 0;
+  size_t remaining = length;
+  do
+  {
+    uint8_t digit = remaining & 0x7F;
+    remaining >>= 7;
+    if (remaining > 0)
+    {
+      digit |= 0x80;
+    }
+    lengthBytes[lengthLength++] = digit;
+  } while (remaining > 0 && lengthLength < 4);
+  size_t start = MQTT_MAX_HEADER_SIZE - 1 - lengthLength;
+  buffer[start] = header;
+  memcpy(buffer + start + 1, lengthBytes, lengthLength);
+  size_t total = 1 + lengthLength + length;
+  size_t written = client->write(buffer + start, total);
+  lastOutActivity = millis();
+  return written == total;
+}
+
+// Appends a length prefixed string at position. Returns the new position or 0 if it does not fit.
+size_t MqttClient::writeString(const char *string, size_t position)
+{
+  size_t length = strlen(string);
+  if (position == 0 || position + 2 + length > MQTT_BUFFER_SIZE)
+  {
+    return 0;
+  }
+  buffer[position++] = length >> 8;
+  buffer[position++] = length & 0xFF;
+  memcpy(buffer + position, string, length);
+  return position + length;
+}
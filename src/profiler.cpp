@@ -0,0 +1,89 @@
+#include <atomic>
+#include "profiler.h"
+
+#ifdef PROFILING
+
+static ProfileEntry entries[PROFILE_SLOTS];
+static std::atomic<uint8_t> used(0); // slots taken, the UI and the network task both register
+
+static void clearEntry(ProfileEntry *entry)
+{
+  entry->count = 0;
+  entry->minimum = UINT32_MAX;
+  entry->maximum = 0;
+  entry->total = 0;
+}
+
+int8_t profileRegister(const char *name)
+{
+  uint8_t slot = used.fetch_add(1);
+  if (slot >= PROFILE_SLOTS)
+  {
+    used.store(PROFILE_SLOTS);
+    return -1;
+  }
+  clearEntry(&entries[slot]);
+  entries[slot].name = name;
+  return slot;
+}
+
+void profileAdd(int8_t slot, uint32_t micros)
+{
+  if (slot < 0)
+  {
+    return;
+  }
+  ProfileEntry *entry = &entries[slot];
+  entry->count += 1;
+  entry->total += micros;
+  if (micros < entry->minimum)
+  {
+    entry->minimum = micros;
+  }
+  if (micros > entry->maximum)
+  {
+    entry->maximum = micros;
+  }
+}
+
+uint8_t profileCount()
+{
+  return min(used.load(), (uint8_t)PROFILE_SLOTS);
+}
+
+bool profileEntry(uint8_t index, ProfileEntry *entry)
+{
+  // a slot just taken may not have its name yet
+  if (index >= profileCount() || entries[index].name == NULL)
+  {
+    return false;
+  }
+  *entry = entries[index];
+  return true;
+}
+
+void profileReset()
+{
+  for (uint8_t index = 0; index < profileCount(); index += 1)
+  {
+    clearEntry(&entries[index]);
+  }
+}
+
+#else
+
+uint8_t profileCount()
+{
+  return 0;
+}
+
+bool profileEntry(uint8_t index, ProfileEntry *entry)
+{
+  return false;
+}
+
+void profileReset()
+{
+}
+
+#endif
@@ -0,0 +1,116 @@
+#include "scheduler.h"
+
+struct ScheduledEntry
+{
+  ScheduledAction action; // NULL when the slot is free
+  int64_t due;            // esp_timer microseconds
+};
+
+// One table per core. The tasks that use the scheduler are pinned, so each
+// table only ever sees one task and needs no lock.
+static ScheduledEntry tables[portNUM_PROCESSORS][SCHEDULER_SLOTS];
+
+static int64_t timerClock()
+{
+  return esp_timer_get_time();
+}
+
+static uint8_t coreTable()
+{
+  return xPortGetCoreID();
+}
+
+static SchedulerClock now = timerClock;
+static SchedulerTable ownIndex = coreTable;
+
+void schedulerUse(SchedulerClock clock, SchedulerTable table)
+{
+  now = clock != NULL ? clock : timerClock;
+  ownIndex = table != NULL ? table : coreTable;
+}
+
+static ScheduledEntry *ownTable()
+{
+  return tables[ownIndex()];
+}
+
+static int findAction(ScheduledEntry *entries, ScheduledAction action)
+{
+  for (uint8_t index = 0; index < SCHEDULER_SLOTS; index += 1)
+  {
+    if (entries[index].action == action)
+    {
+      return index;
+    }
+  }
+  return -1;
+}
+
+bool scheduleAction(ScheduledAction action, unsigned long delayMillis)
+{
+  ScheduledEntry *entries = ownTable();
+  int slot = findAction(entries, action);
+  if (slot < 0)
+  {
+    slot = findAction(entries, NULL);
+  }
+  if (slot < 0)
+  {
+    return false;
+  }
+  entries[slot].action = action;
+  entries[slot].due = now() + (int64_t)delayMillis * 1000;
+  return true;
+}
+
+bool cancelAction(ScheduledAction action)
+{
+  ScheduledEntry *entries = ownTable();
+  int slot = findAction(entries, action);
+  if (slot < 0)
+  {
+    return false;
+  }
+  entries[slot].action = NULL;
+  return true;
+}
+
+bool actionPending(ScheduledAction action)
+{
+  return findAction(ownTable(), action) >= 0;
+}
+
+void runScheduledActions()
+{
+  ScheduledEntry *entries = ownTable();
+  int64_t time = now();
+  for (uint8_t index = 0; index < SCHEDULER_SLOTS; index += 1)
+  {
+    ScheduledAction action = entries[index].action;
+    if (action != NULL && entries[index].due <= time)
+    {
+      // free the slot first, the action may schedule itself again
+      entries[index].action = NULL;
+      action();
+    }
+  }
+}
+
+int64_t scheduledActionWait()
+{
+  ScheduledEntry *entries = ownTable();
+  int64_t next = SCHEDULER_IDLE;
+  for (uint8_t index = 0; index < SCHEDULER_SLOTS; index += 1)
+  {
+    if (entries[index].action != NULL && (next == SCHEDULER_IDLE || entries[index].due < next))
+    {
+      next = entries[index].due;
+    }
+  }
+  if (next == SCHEDULER_IDLE)
+  {
+    return SCHEDULER_IDLE;
+  }
+  int64_t wait = next - now();
+  return wait > 0 ? wait : 0;
+}
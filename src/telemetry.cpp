@@ -0,0 +1,70 @@
+#include "telemetry.h"
+
+// Differences smaller than this are noise, not a change
+static const int32_t changeThresholds[TELEMETRY_FIELD_COUNT] = {
+    0x7FFFFFFF, // uptime - always changes
+    3,          // RSSI
+    2048,       // free heap
+    500,        // loop p50
+    2000,       // loop p99
+    5000,       // loop max
+    1,          // MQTT reconnects
+    1,          // WiFi reconnects
+    1,          // ring count
+};
+
+static size_t writeVarint(uint8_t *buffer, size_t position, uint32_t value)
+{
+  do
+  {
+    uint8_t byte = value & 0x7F;
+    value >>= 7;
+    if (value > 0)
+    {
+      byte |= 0x80;
+    }
+    buffer[position++] = byte;
+  } while (value > 0);
+  return position;
+}
+
+static uint32_t zigzag(int32_t value)
+{
+  return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+bool telemetryChanged(const TelemetryRecord *current, const TelemetryRecord *previous)
+{
+  for (uint8_t field = 0; field < TELEMETRY_FIELD_COUNT; field += 1)
+  {
+    int32_t difference = current->values[field] - previous->values[field];
+    if (abs(difference) >= changeThresholds[field])
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t encodeTelemetry(const TelemetryRecord *current, const TelemetryRecord *previous, bool full, uint8_t *buffer)
+{
+  uint32_t mask = 0;
+  for (uint8_t field = 0; field < TELEMETRY_FIELD_COUNT; field += 1)
+  {
+    if (full || current->values[field] != previous->values[field])
+    {
+      mask |= 1UL << field;
+    }
+  }
+  size_t position = 0;
+  buffer[position++] = TELEMETRY_VERSION;
+  position = writeVarint(buffer, position, mask);
+  for (uint8_t field = 0; field < TELEMETRY_FIELD_COUNT; field += 1)
+  {
+    if (mask & (1UL << field))
+    {
+      position = writeVarint(buffer, position, zigzag(current->values[field]));
+    }
+  }
+  return position;
+}
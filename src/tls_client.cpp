@@ -0,0 +1,359 @@
+#include <mbedtls/version.h>
+#include <mbedtls/ssl_internal.h> // for handshake->resume
+#include <mbedtls/net_sockets.h>
+#include "tls_client.h"
+
+// ssl.state and ssl.handshake->resume are mbedTLS 2.x internals. The platform
+// is pinned in platformio.ini; a framework with another mbedTLS stops here
+// instead of misbehaving.
+#if MBEDTLS_VERSION_MAJOR != 2
+#error "TlsClient reads mbedTLS 2.x internals, check the pinned platform in platformio.ini"
+#endif
+
+#define TLS_SESSION_MAGIC 0x544C5331 // "TLS1"
+
+// RTC memory is not cleared by a software restart. The magic and checksum
+// tell a stored session from the garbage found there after power on.
+struct TlsSessionCache
+{
+  uint32_t magic;
+  uint32_t length;
+  uint32_t checksum;
+  uint8_t data[TLS_SESSION_CACHE_SIZE];
+};
+RTC_NOINIT_ATTR static TlsSessionCache sessionCache;
+
+static uint32_t sessionChecksum()
+{
+  // FNV-1a
+  uint32_t hash = 2166136261UL;
+  for (uint32_t index = 0; index < sessionCache.length; index += 1)
+  {
+    hash = (hash ^ sessionCache.data[index]) * 16777619UL;
+  }
+  return hash;
+}
+
+static bool sessionCacheValid()
+{
+  return sessionCache.magic == TLS_SESSION_MAGIC && sessionCache.length > 0 && sessionCache.length <= TLS_SESSION_CACHE_SIZE && sessionCache.checksum == sessionChecksum();
+}
+
+static int sendCallback(void *context, const unsigned char *buffer, size_t length)
+{
+  WiFiClient *tcp = (WiFiClient *)context;
+  if (!tcp->connected())
+  {
+    return MBEDTLS_ERR_NET_CONN_RESET;
+  }
+  size_t written = tcp->write(buffer, length);
+  return written == 0 ? MBEDTLS_ERR_SSL_WANT_WRITE : (int)written;
+}
+
+static int receiveCallback(void *context, unsigned char *buffer, size_t length)
+{
+  WiFiClient *tcp = (WiFiClient *)context;
+  if (!tcp->available())
+  {
+    return tcp->connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_CONN_RESET;
+  }
+  int received = tcp->read(buffer, length);
+  return received <= 0 ? MBEDTLS_ERR_SSL_WANT_READ : received;
+}
+
+TlsClient::TlsClient()
+{
+  caCert = NULL;
+  insecure = false;
+  tlsUp = false;
+  peeked = -1;
+  lastHandshakeMicros = 0;
+  lastHandshakeResumed = false;
+  initContexts();
+}
+
+TlsClient::~TlsClient()
+{
+  stop();
+  freeContexts();
+}
+
+void TlsClient::setCACert(const char *pem)
+{
+  caCert = pem;
+}
+
+void TlsClient::setInsecure()
+{
+  insecure = true;
+}
+
+void TlsClient::initContexts()
+{
+  mbedtls_ssl_init(&ssl);
+  mbedtls_ssl_config_init(&config);
+  mbedtls_ctr_drbg_init(&drbg);
+  mbedtls_entropy_init(&entropy);
+  mbedtls_x509_crt_init(&ca);
+}
+
+void TlsClient::freeContexts()
+{
+  mbedtls_ssl_free(&ssl);
+  mbedtls_ssl_config_free(&config);
+  mbedtls_ctr_drbg_free(&drbg);
+  mbedtls_entropy_free(&entropy);
+  mbedtls_x509_crt_free(&ca);
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port)
+{
+  char host[16];
+  sprintf(host, "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+  return connect(host, port);
+}
+
+int TlsClient::connect(const char *host, uint16_t port)
+{
+  stop();
+  if (caCert == NULL && !insecure)
+  {
+    return 0; // the credentials would go to whoever answers
+  }
+  if (!tcp.connect(host, port))
+  {
+    return 0;
+  }
+  int64_t start = esp_timer_get_time();
+  bool ok = mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy, NULL, 0) == 0;
+  ok = ok && mbedtls_ssl_config_defaults(&config, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) == 0;
+  if (caCert != NULL)
+  {
+    ok = ok && mbedtls_x509_crt_parse(&ca, (const unsigned char *)caCert, strlen(caCert) + 1) == 0;
+    mbedtls_ssl_conf_ca_chain(&config, &ca, NULL);
+    mbedtls_ssl_conf_authmode(&config, MBEDTLS_SSL_VERIFY_REQUIRED);
+  }
+  else
+  {
+    mbedtls_ssl_conf_authmode(&config, MBEDTLS_SSL_VERIFY_NONE); // setInsecure()
+  }
+  mbedtls_ssl_conf_rng(&config, mbedtls_ctr_drbg_random, &drbg);
+  mbedtls_ssl_conf_session_tickets(&config, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+  ok = ok && mbedtls_ssl_setup(&ssl, &config) == 0;
+  ok = ok && mbedtls_ssl_set_hostname(&ssl, host) == 0;
+  if (!ok)
+  {
+    stop();
+    return 0;
+  }
+  mbedtls_ssl_set_bio(&ssl, &tcp, sendCallback, receiveCallback, NULL);
+  offerCachedSession();
+  // Step through the handshake ourselves - mbedTLS only knows whether the
+  // session was resumed while the handshake is still going on
+  bool resumed = false;
+  while (ssl.state != MBEDTLS_SSL_HANDSHAKE_OVER)
+  {
+    int result = mbedtls_ssl_handshake_step(&ssl);
+    if (ssl.handshake != NULL && ssl.handshake->resume)
+    {
+      resumed = true;
+    }
+    if (result == MBEDTLS_ERR_SSL_WANT_READ || result == MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+      if (esp_timer_get_time() - start > TLS_HANDSHAKE_TIMEOUT * 1000LL)
+      {
+        stop();
+        return 0;
+      }
+      delay(1);
+    }
+    else if (result != 0)
+    {
+      // A session the broker refuses fails the handshake - do a full one next time
+      forgetSession();
+      stop();
+      return 0;
+    }
+  }
+  lastHandshakeMicros = esp_timer_get_time() - start;
+  lastHandshakeResumed = resumed;
+  tlsUp = true;
+  storeSession();
+  return 1;
+}
+
+bool TlsClient::offerCachedSession()
+{
+  if (!sessionCacheValid())
+  {
+    return false;
+  }
+  mbedtls_ssl_session session;
+  mbedtls_ssl_session_init(&session);
+  bool offered = mbedtls_ssl_session_load(&session, sessionCache.data, sessionCache.length) == 0 && mbedtls_ssl_set_session(&ssl, &session) == 0;
+  mbedtls_ssl_session_free(&session);
+  return offered;
+}
+
+void TlsClient::storeSession()
+{
+  mbedtls_ssl_session session;
+  mbedtls_ssl_session_init(&session);
+  size_t length = 0;
+  if (mbedtls_ssl_get_session(&ssl, &session) == 0 && mbedtls_ssl_session_save(&session, sessionCache.data, TLS_SESSION_CACHE_SIZE, &length) == 0)
+  {
+    sessionCache.length = length;
+    sessionCache.checksum = sessionChecksum();
+    sessionCache.magic = TLS_SESSION_MAGIC;
+  }
+  else
+  {
+    forgetSession();
+  }
+  mbedtls_ssl_session_free(&session);
+}
+
+void TlsClient::forgetSession()
+{
+  sessionCache.magic = 0;
+}
+
+size_t TlsClient::write(uint8_t byte)
+{
+  return write(&byte, 1);
+}
+
+size_t TlsClient::write(const uint8_t *buffer, size_t size)
+{
+  if (!tlsUp)
+  {
+    return 0;
+  }
+  size_t written = 0;
+  int64_t start = esp_timer_get_time();
+  while (written < size)
+  {
+    int result = mbedtls_ssl_write(&ssl, buffer + written, size - written);
+    if (result > 0)
+    {
+      written += result;
+    }
+    else if (result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+      stop();
+      break;
+    }
+    else if (esp_timer_get_time() - start > TLS_WRITE_TIMEOUT * 1000LL)
+    {
+      // the peer stopped reading
+      stop();
+      break;
+    }
+    else
+    {
+      delay(1);
+    }
+  }
+  return written;
+}
+
+int TlsClient::available()
+{
+  if (!tlsUp)
+  {
+    return 0;
+  }
+  // A zero length read processes whatever record has arrived
+  int result = mbedtls_ssl_read(&ssl, NULL, 0);
+  if (result < 0 && result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE)
+  {
+    stop();
+    return peeked >= 0 ? 1 : 0;
+  }
+  return mbedtls_ssl_get_bytes_avail(&ssl) + (peeked >= 0 ? 1 : 0);
+}
+
+int TlsClient::read()
+{
+  uint8_t byte;
+  return read(&byte, 1) == 1 ? byte : -1;
+}
+
+int TlsClient::read(uint8_t *buffer, size_t size)
+{
+  if (size == 0)
+  {
+    return 0;
+  }
+  int count = 0;
+  if (peeked >= 0)
+  {
+    buffer[0] = peeked;
+    peeked = -1;
+    buffer += 1;
+    size -= 1;
+    count = 1;
+  }
+  if (!tlsUp || size == 0)
+  {
+    return count > 0 ? count : -1;
+  }
+  int result = mbedtls_ssl_read(&ssl, buffer, size);
+  if (result > 0)
+  {
+    return count + result;
+  }
+  if (result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE)
+  {
+    stop();
+  }
+  return count > 0 ? count : -1;
+}
+
+int TlsClient::peek()
+{
+  if (peeked < 0)
+  {
+    peeked = read();
+  }
+  return peeked;
+}
+
+void TlsClient::flush()
+{
+  tcp.flush();
+}
+
+void TlsClient::stop()
+{
+  if (tlsUp)
+  {
+    mbedtls_ssl_close_notify(&ssl);
+  }
+  tlsUp = false;
+  peeked = -1;
+  tcp.stop();
+  // fresh contexts for the next connect
+  freeContexts();
+  initContexts();
+}
+
+uint8_t TlsClient::connected()
+{
+  return tlsUp && (tcp.connected() || peeked >= 0);
+}
+
+TlsClient::operator bool()
+{
+  return connected();
+}
+
+uint32_t TlsClient::handshakeMicros()
+{
+  return lastHandshakeMicros;
+}
+
+bool TlsClient::handshakeResumed()
+{
+  return lastHandshakeResumed;
+}
@@ -0,0 +1,55 @@
+#ifndef _MOCK_ARDUINO_H
+#define _MOCK_ARDUINO_H
+
+// Just enough of Arduino and ESP-IDF to build the modules that do not touch
+// the hardware on the host (pio test -e native). Time is virtual: it only
+// moves when a test moves mockMicros or the code under test calls delay().
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+using std::max;
+using std::min;
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define portNUM_PROCESSORS 2
+
+inline int64_t mockMicros = 0;
+inline int mockCore = 0;
+
+inline int64_t esp_timer_get_time()
+{
+  return mockMicros;
+}
+
+inline unsigned long millis()
+{
+  return mockMicros / 1000;
+}
+
+inline unsigned long micros()
+{
+  return mockMicros;
+}
+
+inline void delay(unsigned long ms)
+{
+  mockMicros += ms * 1000;
+}
+
+inline void yield()
+{
+}
+
+inline int xPortGetCoreID()
+{
+  return mockCore;
+}
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef _MOCK_LWIP_SOCKETS_H
+#define _MOCK_LWIP_SOCKETS_H
+
+// lwIP has the BSD socket API, on the host the real one stands in for it
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#endif
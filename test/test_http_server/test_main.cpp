@@ -0,0 +1,247 @@
+#include <unity.h>
+#include <string>
+#include <lwip/sockets.h>
+#include "http_server.h"
+
+// The server on a real loopback socket, polled by the test the way the
+// network task polls it. Time is virtual, see test/mocks/Arduino.h.
+
+#define TEST_PORT 18080
+
+static HttpServer *server;
+static int partSize;
+static uint8_t partCount;
+
+static void handleSmall(HttpRequest &request)
+{
+  request.send(200, "text/plain", "small");
+}
+
+// Part n is partSize copies of the letter 'a' + n
+static bool writeParts(HttpRequest &request, uint8_t part)
+{
+  if (part >= partCount)
+  {
+    return false;
+  }
+  char line[65];
+  memset(line, 'a' + part, 64);
+  line[64] = '\0';
+  for (int written = 0; written < partSize; written += 64)
+  {
+    request.print(line);
+  }
+  return true;
+}
+
+static void handleParts(HttpRequest &request)
+{
+  request.beginParts(200, "text/plain", writeParts);
+}
+
+// Parts 1 and 3 are empty
+static bool writeSparseParts(HttpRequest &request, uint8_t part)
+{
+  if (part == 1 || part == 3)
+  {
+    return true;
+  }
+  return writeParts(request, part);
+}
+
+static void handleSparseParts(HttpRequest &request)
+{
+  request.beginParts(200, "text/plain", writeSparseParts);
+}
+
+static void handleEcho(HttpRequest &request)
+{
+  request.send(200, "text/plain", request.body());
+}
+
+// Sends the request, in two pieces if split is not 0, and polls the server
+// until it closes the connection. Returns what came back, or "reset" if the
+// connection was reset.
+static std::string exchange(const std::string &request, size_t split = 0)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(TEST_PORT);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  TEST_ASSERT_EQUAL(0, connect(fd, (struct sockaddr *)&address, sizeof(address)));
+  if (split > 0)
+  {
+    TEST_ASSERT_EQUAL((long)split, (long)send(fd, request.data(), split, 0));
+    for (int round = 0; round < 100; round += 1)
+    {
+      server->poll();
+    }
+  }
+  TEST_ASSERT_EQUAL((long)(request.size() - split), (long)send(fd, request.data() + split, request.size() - split, 0));
+  std::string response;
+  for (int round = 0; round < 100000; round += 1)
+  {
+    server->poll();
+    char buffer[1024];
+    int received = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (received > 0)
+    {
+      response.append(buffer, received);
+    }
+    else if (received == 0)
+    {
+      break;
+    }
+    else if (errno == ECONNRESET)
+    {
+      response = "reset";
+      break;
+    }
+  }
+  close(fd);
+  return response;
+}
+
+static std::string body(const std::string &response)
+{
+  size_t end = response.find("\r\n\r\n");
+  return end == std::string::npos ? "" : response.substr(end + 4);
+}
+
+void setUp()
+{
+  mockMicros += 1000000; // a start time of 0 would mean "already counted"
+  partSize = 2048;
+  partCount = 6;
+}
+
+void tearDown()
+{
+}
+
+void test_small_response_has_a_length()
+{
+  std::string response = exchange("GET /small HTTP/1.1\r\n\r\n");
+  TEST_ASSERT_TRUE(response.find("Content-Length: 5\r\n") != std::string::npos);
+  TEST_ASSERT_EQUAL_STRING("small", body(response).c_str());
+}
+
+void test_parts_larger_than_the_buffer_arrive_in_order()
+{
+  uint32_t requests = server->requestCount();
+  std::string response = exchange("GET /parts HTTP/1.1\r\n\r\n");
+  TEST_ASSERT_TRUE(response.find("HTTP/1.1 200 OK\r\n") == 0);
+  TEST_ASSERT_TRUE(response.find("Content-Length") == std::string::npos);
+  std::string text = body(response);
+  TEST_ASSERT_EQUAL(partSize * partCount, (long)text.size());
+  TEST_ASSERT_TRUE(partSize * partCount > HTTP_RESPONSE_SIZE);
+  for (uint8_t part = 0; part < partCount; part += 1)
+  {
+    TEST_ASSERT_EQUAL('a' + part, text[part * partSize]);
+    TEST_ASSERT_EQUAL('a' + part, text[(part + 1) * partSize - 1]);
+  }
+  TEST_ASSERT_EQUAL(requests + 1, server->requestCount());
+}
+
+void test_first_part_too_large_is_an_error()
+{
+  partSize = HTTP_RESPONSE_SIZE + 64;
+  std::string response = exchange("GET /parts HTTP/1.1\r\n\r\n");
+  TEST_ASSERT_TRUE(response.find("HTTP/1.1 500") == 0);
+}
+
+void test_later_part_too_large_resets_the_connection()
+{
+  partSize = HTTP_RESPONSE_SIZE + 64;
+  partCount = 1;
+  // part 0 fits when it is alone, so make part 0 small and part 1 large
+  struct Writer
+  {
+    static bool write(HttpRequest &request, uint8_t part)
+    {
+      if (part == 0)
+      {
+        request.print("first part\n");
+        return true;
+      }
+      return writeParts(request, 0);
+    }
+    static void handle(HttpRequest &request)
+    {
+      request.beginParts(200, "text/plain", write);
+    }
+  };
+  server->on("/broken", Writer::handle);
+  TEST_ASSERT_EQUAL_STRING("reset", exchange("GET /broken HTTP/1.1\r\n\r\n").c_str());
+}
+
+void test_empty_parts_are_skipped()
+{
+  std::string text = body(exchange("GET /sparse HTTP/1.1\r\n\r\n"));
+  TEST_ASSERT_EQUAL(partSize * (partCount - 2), (long)text.size());
+  TEST_ASSERT_EQUAL('a', text[0]);
+  TEST_ASSERT_EQUAL('c', text[partSize]);
+  TEST_ASSERT_EQUAL('e', text[2 * partSize]);
+  TEST_ASSERT_EQUAL('f', text[3 * partSize]);
+}
+
+static std::string post(const char *length, const char *body)
+{
+  std::string request = "POST /echo HTTP/1.1\r\nContent-Length: ";
+  return exchange(request + length + "\r\n\r\n" + body);
+}
+
+void test_body_is_read_up_to_its_length()
+{
+  std::string response = post("5", "hello");
+  TEST_ASSERT_TRUE(response.find("HTTP/1.1 200") == 0);
+  TEST_ASSERT_EQUAL_STRING("hello", body(response).c_str());
+}
+
+void test_body_split_across_reads()
+{
+  std::string request = "POST /echo HTTP/1.1\r\nContent-Length: 11\r\n\r\nhello world";
+  std::string response = exchange(request, request.size() - 6);
+  TEST_ASSERT_EQUAL_STRING("hello world", body(response).c_str());
+}
+
+void test_length_larger_than_the_buffer_is_too_large()
+{
+  TEST_ASSERT_TRUE(post("769", "x").find("HTTP/1.1 413") == 0);
+  TEST_ASSERT_TRUE(post("4294967296", "x").find("HTTP/1.1 413") == 0);
+  // would wrap body + length around to a pointer before the body
+  TEST_ASSERT_TRUE(post("18446744073709551615", "x").find("HTTP/1.1 413") == 0);
+  TEST_ASSERT_TRUE(post("99999999999999999999999999", "x").find("HTTP/1.1 413") == 0);
+}
+
+void test_length_that_is_not_decimal_is_bad()
+{
+  TEST_ASSERT_TRUE(post("-1", "x").find("HTTP/1.1 400") == 0);
+  TEST_ASSERT_TRUE(post("0x10", "x").find("HTTP/1.1 400") == 0);
+  TEST_ASSERT_TRUE(post("", "x").find("HTTP/1.1 400") == 0);
+  TEST_ASSERT_TRUE(post("+5", "hello").find("HTTP/1.1 400") == 0);
+}
+
+int main()
+{
+  // one server for all tests, it has no way to close its listening socket
+  server = new HttpServer(TEST_PORT);
+  server->on("/small", handleSmall);
+  server->on("/parts", handleParts);
+  server->on("/sparse", handleSparseParts);
+  server->on("/echo", HTTP_METHOD_POST, handleEcho);
+  server->begin();
+  UNITY_BEGIN();
+  RUN_TEST(test_small_response_has_a_length);
+  RUN_TEST(test_parts_larger_than_the_buffer_arrive_in_order);
+  RUN_TEST(test_first_part_too_large_is_an_error);
+  RUN_TEST(test_later_part_too_large_resets_the_connection);
+  RUN_TEST(test_empty_parts_are_skipped);
+  RUN_TEST(test_body_is_read_up_to_its_length);
+  RUN_TEST(test_body_split_across_reads);
+  RUN_TEST(test_length_larger_than_the_buffer_is_too_large);
+  RUN_TEST(test_length_that_is_not_decimal_is_bad);
+  return UNITY_END();
+}
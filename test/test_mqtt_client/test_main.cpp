@@ -0,0 +1,495 @@
+#include <unity.h>
+#include <string>
+#include <vector>
+#include "mqtt_client.h"
+
+// A broker stand-in behind the Client interface: it answers CONNECT,
+// SUBSCRIBE and PINGREQ, acknowledges QoS 1 publishes and keeps what it got.
+// Loss is injected by dropping the link, publishes or PUBACKs.
+
+struct Received
+{
+  std::string topic;
+  std::string payload;
+  uint16_t packetId;
+  bool dup;
+  bool retained;
+};
+
+class BrokerStandIn : public Client
+{
+public:
+  bool up = false;
+  bool reachable = true;
+  uint8_t connectFlags = 0;
+  uint32_t connects = 0;
+  uint32_t losePublishes = 0; // the next publishes never arrive
+  uint32_t losePubacks = 0;   // the next publishes arrive but their PUBACK is lost
+  std::vector<Received> received;
+  std::vector<uint8_t> toClient;
+  size_t toClientRead = 0;
+  std::vector<uint8_t> fromClient;
+
+  int connect(const char *, uint16_t) override
+  {
+    if (!reachable)
+    {
+      return 0;
+    }
+    up = true;
+    toClient.clear();
+    toClientRead = 0;
+    fromClient.clear();
+    return 1;
+  }
+
+  size_t write(const uint8_t *buffer, size_t size) override
+  {
+    if (!up)
+    {
+      return 0;
+    }
+    fromClient.insert(fromClient.end(), buffer, buffer + size);
+    while (handlePacket())
+    {
+    }
+    return size;
+  }
+
+  int available() override
+  {
+    return up ? toClient.size() - toClientRead : 0;
+  }
+
+  int read() override
+  {
+    if (available() == 0)
+    {
+      return -1;
+    }
+    return toClient[toClientRead++];
+  }
+
+  void stop() override
+  {
+    up = false;
+  }
+
+  uint8_t connected() override
+  {
+    return up;
+  }
+
+  void dropLink()
+  {
+    up = false;
+  }
+
+  void send(const std::vector<uint8_t> &bytes)
+  {
+    toClient.insert(toClient.end(), bytes.begin(), bytes.end());
+  }
+
+  // The last retained value the broker has for topic, "" if none
+  std::string retainedValue(const std::string &topic)
+  {
+    std::string value;
+    for (const Received &message : received)
+    {
+      if (message.retained && message.topic == topic)
+      {
+        value = message.payload;
+      }
+    }
+    return value;
+  }
+
+private:
+  // One complete packet from fromClient, false if it has not all arrived yet
+  bool handlePacket()
+  {
+    if (fromClient.size() < 2)
+    {
+      return false;
+    }
+    size_t position = 1;
+    uint32_t length = 0;
+    uint32_t multiplier = 1;
+    uint8_t digit;
+    do
+    {
+      if (position >= fromClient.size())
+      {
+        return false;
+      }
+      digit = fromClient[position++];
+      length += (digit & 0x7F) * multiplier;
+      multiplier <<= 7;
+    } while (digit & 0x80);
+    if (fromClient.size() < position + length)
+    {
+      return false;
+    }
+    uint8_t header = fromClient[0];
+    std::vector<uint8_t> body(fromClient.begin() + position, fromClient.begin() + position + length);
+    fromClient.erase(fromClient.begin(), fromClient.begin() + position + length);
+    switch (header & 0xF0)
+    {
+    case MQTT_CONNECT:
+      connects += 1;
+      connectFlags = body[7];
+      send({MQTT_CONNACK, 2, (uint8_t)(connects > 1 ? 1 : 0), 0});
+      break;
+    case MQTT_PUBLISH:
+    {
+      size_t topicLength = (body[0] << 8) | body[1];
+      Received message;
+      message.topic.assign((const char *)&body[2], topicLength);
+      size_t payloadStart = 2 + topicLength;
+      message.packetId = 0;
+      if (header & MQTT_FLAG_QOS1)
+      {
+        message.packetId = (body[payloadStart] << 8) | body[payloadStart + 1];
+        payloadStart += 2;
+      }
+      message.payload.assign((const char *)&body[payloadStart], body.size() - payloadStart);
+      message.dup = header & MQTT_FLAG_DUP;
+      message.retained = header & MQTT_FLAG_RETAIN;
+      if (losePublishes > 0)
+      {
+        losePublishes -= 1;
+        break;
+      }
+      received.push_back(message);
+      if (header & MQTT_FLAG_QOS1)
+      {
+        if (losePubacks > 0)
+        {
+          losePubacks -= 1;
+          break;
+        }
+        send({MQTT_PUBACK, 2, (uint8_t)(message.packetId >> 8), (uint8_t)(message.packetId & 0xFF)});
+      }
+      break;
+    }
+    case MQTT_SUBSCRIBE:
+      send({MQTT_SUBACK, 3, body[0], body[1], 0});
+      break;
+    case MQTT_PINGREQ:
+      send({MQTT_PINGRESP, 0});
+      break;
+    case MQTT_DISCONNECT:
+      up = false;
+      break;
+    }
+    return true;
+  }
+};
+
+static BrokerStandIn *broker;
+static MqttClient *client;
+
+static std::string lastTopic;
+static std::string lastPayload;
+static uint32_t callbacks;
+
+static void callback(char *topic, uint8_t *payload, unsigned int length)
+{
+  lastTopic = topic;
+  lastPayload.assign((const char *)payload, length);
+  callbacks += 1;
+}
+
+static bool publish(const char *topic, const char *payload, bool retained)
+{
+  return client->publish(topic, (const uint8_t *)payload, strlen(payload), retained, 1);
+}
+
+static bool connect()
+{
+  return client->connect("intercom-test", "user", "password");
+}
+
+void setUp()
+{
+  mockMicros = 1000000;
+  broker = new BrokerStandIn();
+  client = new MqttClient(*broker);
+  client->setServer("broker", 1883);
+  client->setCallback(callback);
+  lastTopic = "";
+  lastPayload = "";
+  callbacks = 0;
+}
+
+void tearDown()
+{
+  delete client;
+  delete broker;
+}
+
+void test_session_is_persistent()
+{
+  TEST_ASSERT_TRUE(connect());
+  TEST_ASSERT_EQUAL(0, broker->connectFlags & 0x02); // clean session off
+}
+
+void test_qos1_publish_is_acknowledged()
+{
+  TEST_ASSERT_TRUE(connect());
+  TEST_ASSERT_TRUE(publish("/intercom/active", "1", true));
+  TEST_ASSERT_EQUAL(1, client->inflightCount());
+  client->loop();
+  TEST_ASSERT_EQUAL(0, client->inflightCount());
+  TEST_ASSERT_EQUAL(1, client->acknowledgedCount());
+  TEST_ASSERT_EQUAL(1, broker->received.size());
+  TEST_ASSERT_FALSE(broker->received[0].dup);
+}
+
+void test_lost_puback_is_resent_with_dup_after_reconnect()
+{
+  TEST_ASSERT_TRUE(connect());
+  broker->losePubacks = 1;
+  publish("/intercom/active", "1", true);
+  client->loop();
+  TEST_ASSERT_EQUAL(1, client->inflightCount());
+  broker->dropLink();
+  TEST_ASSERT_FALSE(client->loop());
+  TEST_ASSERT_TRUE(connect());
+  client->loop();
+  TEST_ASSERT_EQUAL(0, client->inflightCount());
+  TEST_ASSERT_EQUAL(2, broker->received.size());
+  TEST_ASSERT_TRUE(broker->received[1].dup);
+  TEST_ASSERT_EQUAL(broker->received[0].packetId, broker->received[1].packetId);
+  TEST_ASSERT_EQUAL(1, client->retransmitCount());
+}
+
+void test_lost_publish_is_resent_after_reconnect()
+{
+  TEST_ASSERT_TRUE(connect());
+  broker->losePublishes = 1;
+  publish("/intercom/active", "1", true);
+  client->loop();
+  TEST_ASSERT_EQUAL(0, broker->received.size());
+  broker->dropLink();
+  TEST_ASSERT_TRUE(connect());
+  client->loop();
+  TEST_ASSERT_EQUAL(1, broker->received.size());
+  TEST_ASSERT_TRUE(broker->received[0].dup);
+  TEST_ASSERT_EQUAL_STRING("1", broker->retainedValue("/intercom/active").c_str());
+}
+
+void test_publish_while_disconnected_waits_for_reconnect()
+{
+  broker->reachable = false;
+  TEST_ASSERT_FALSE(connect());
+  TEST_ASSERT_TRUE(publish("/intercom/active", "1", true));
+  TEST_ASSERT_EQUAL(1, client->inflightCount());
+  broker->reachable = true;
+  TEST_ASSERT_TRUE(connect());
+  client->loop();
+  TEST_ASSERT_EQUAL(0, client->inflightCount());
+  TEST_ASSERT_FALSE(broker->received[0].dup); // it was never sent before
+}
+
+// Rings during an outage: the window must end up with the newest state
+void test_retained_state_is_coalesced_by_topic()
+{
+  broker->reachable = false;
+  publish("/intercom/info", "a", false);
+  publish("/intercom/info", "b", false);
+  publish("/intercom/info", "c", false);
+  for (uint8_t ring = 0; ring < 3; ring += 1)
+  {
+    publish("/intercom/active", "1", true);
+    publish("/intercom/active", "0", true);
+  }
+  publish("/intercom/active", "1", true);
+  TEST_ASSERT_EQUAL(4, client->inflightCount());
+  TEST_ASSERT_EQUAL(6, client->supersededCount());
+  TEST_ASSERT_EQUAL(0, client->droppedCount());
+  broker->reachable = true;
+  TEST_ASSERT_TRUE(connect());
+  client->loop();
+  TEST_ASSERT_EQUAL(4, broker->received.size());
+  TEST_ASSERT_EQUAL_STRING("/intercom/active", broker->received.back().topic.c_str());
+  TEST_ASSERT_EQUAL_STRING("1", broker->retainedValue("/intercom/active").c_str());
+}
+
+void test_full_window_drops_the_oldest()
+{
+  broker->reachable = false;
+  const char *payloads[] = {"1", "2", "3", "4", "5"};
+  for (uint8_t index = 0; index < 5; index += 1)
+  {
+    TEST_ASSERT_TRUE(publish("/intercom/info", payloads[index], false));
+  }
+  TEST_ASSERT_EQUAL(MQTT_INFLIGHT_WINDOW, client->inflightCount());
+  TEST_ASSERT_EQUAL(1, client->droppedCount());
+  broker->reachable = true;
+  TEST_ASSERT_TRUE(connect());
+  client->loop();
+  TEST_ASSERT_EQUAL(4, broker->received.size());
+  TEST_ASSERT_EQUAL_STRING("2", broker->received.front().payload.c_str());
+  TEST_ASSERT_EQUAL_STRING("5", broker->received.back().payload.c_str());
+}
+
+void test_packet_split_across_loops()
+{
+  TEST_ASSERT_TRUE(connect());
+  // PUBLISH QoS 0 "/t" = "hi"
+  broker->send({MQTT_PUBLISH, 6, 0, 2, '/'});
+  TEST_ASSERT_TRUE(client->loop());
+  TEST_ASSERT_EQUAL(0, callbacks);
+  broker->send({'t', 'h', 'i'});
+  TEST_ASSERT_TRUE(client->loop());
+  TEST_ASSERT_EQUAL(1, callbacks);
+  TEST_ASSERT_EQUAL_STRING("/t", lastTopic.c_str());
+  TEST_ASSERT_EQUAL_STRING("hi", lastPayload.c_str());
+}
+
+// Half a packet must neither block loop() nor keep the connection forever
+void test_stalled_packet_times_out_without_blocking()
+{
+  TEST_ASSERT_TRUE(connect());
+  broker->send({MQTT_PUBLISH, 6, 0});
+  int64_t before = mockMicros;
+  TEST_ASSERT_TRUE(client->loop());
+  TEST_ASSERT_EQUAL(before, mockMicros);
+  mockMicros += (MQTT_SOCKET_TIMEOUT - 1) * 1000000LL;
+  TEST_ASSERT_TRUE(client->loop());
+  mockMicros += 2000000;
+  TEST_ASSERT_FALSE(client->loop());
+  TEST_ASSERT_EQUAL(MQTT_CONNECTION_TIMEOUT, client->state());
+}
+
+void test_oversized_packet_is_skipped()
+{
+  TEST_ASSERT_TRUE(connect());
+  std::vector<uint8_t> packet = {MQTT_PUBLISH, 0x90, 0x02, 0, 2, '/', 'x'}; // 272 bytes
+  packet.resize(3 + 272, 'a');
+  broker->send(packet);
+  broker->send({MQTT_PUBLISH, 5, 0, 2, '/', 'y', '!'});
+  TEST_ASSERT_TRUE(client->loop());
+  TEST_ASSERT_EQUAL(1, callbacks);
+  TEST_ASSERT_EQUAL_STRING("/y", lastTopic.c_str());
+}
+
+// Rings with random loss of publishes, PUBACKs and the link: the broker
+// always ends up with the last state
+void test_random_loss_delivers_latest_state()
+{
+  srand(42);
+  uint32_t rings = 0;
+  TEST_ASSERT_TRUE(connect());
+  for (uint32_t step = 0; step < 2000; step += 1)
+  {
+    int dice = rand() % 100;
+    if (dice < 5)
+    {
+      broker->dropLink();
+    }
+    else if (dice < 10)
+    {
+      broker->losePublishes += 1;
+    }
+    else if (dice < 15)
+    {
+      broker->losePubacks += 1;
+    }
+    else if (dice < 35)
+    {
+      rings += 1;
+      char payload[12];
+      sprintf(payload, "%u", rings);
+      publish("/intercom/active", payload, true);
+    }
+    if (!client->loop())
+    {
+      connect();
+    }
+    mockMicros += 100000;
+  }
+  broker->losePublishes = 0;
+  broker->losePubacks = 0;
+  // anything still lost in flight goes out again with the next reconnect
+  broker->dropLink();
+  TEST_ASSERT_TRUE(connect());
+  client->loop();
+  TEST_ASSERT_EQUAL(0, client->inflightCount());
+  char last[12];
+  sprintf(last, "%u", rings);
+  TEST_ASSERT_EQUAL_STRING(last, broker->retainedValue("/intercom/active").c_str());
+  TEST_ASSERT_EQUAL(rings, client->publishedCount());
+}
+
+void test_ack_is_found_by_packet_id()
+{
+  TEST_ASSERT_TRUE(connect());
+  broker->losePubacks = 1;
+  publish("/intercom/active", "1", true);
+  uint16_t ring = client->lastPacketId();
+  TEST_ASSERT_TRUE(ring != 0);
+  client->loop();
+  mockMicros += 5000;
+  publish("/intercom/info", "other", false);
+  uint16_t other = client->lastPacketId();
+  client->loop();
+  // the PUBACK of another message does not count for the ring
+  int64_t micros = 0;
+  TEST_ASSERT_FALSE(client->findAck(ring, &micros));
+  TEST_ASSERT_TRUE(client->pending(ring));
+  TEST_ASSERT_TRUE(client->findAck(other, &micros));
+  TEST_ASSERT_EQUAL(mockMicros, micros);
+  // resent after the reconnect, and acknowledged then
+  broker->dropLink();
+  mockMicros += 5000;
+  TEST_ASSERT_TRUE(connect());
+  client->loop();
+  TEST_ASSERT_FALSE(client->pending(ring));
+  TEST_ASSERT_TRUE(client->findAck(ring, &micros));
+  TEST_ASSERT_EQUAL(mockMicros, micros);
+}
+
+void test_superseded_message_is_never_acknowledged()
+{
+  publish("/intercom/active", "1", true);
+  uint16_t ring = client->lastPacketId();
+  publish("/intercom/active", "0", true);
+  TEST_ASSERT_FALSE(client->pending(ring));
+  TEST_ASSERT_TRUE(connect());
+  client->loop();
+  int64_t micros;
+  TEST_ASSERT_FALSE(client->findAck(ring, &micros));
+  TEST_ASSERT_TRUE(client->findAck(client->lastPacketId(), &micros));
+}
+
+void test_refused_message_has_no_packet_id()
+{
+  char topic[MQTT_INFLIGHT_TOPIC_SIZE + 1];
+  memset(topic, 't', MQTT_INFLIGHT_TOPIC_SIZE);
+  topic[MQTT_INFLIGHT_TOPIC_SIZE] = '\0';
+  publish("/intercom/active", "1", true);
+  TEST_ASSERT_FALSE(publish(topic, "1", true));
+  TEST_ASSERT_EQUAL(0, client->lastPacketId());
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_session_is_persistent);
+  RUN_TEST(test_qos1_publish_is_acknowledged);
+  RUN_TEST(test_lost_puback_is_resent_with_dup_after_reconnect);
+  RUN_TEST(test_lost_publish_is_resent_after_reconnect);
+  RUN_TEST(test_publish_while_disconnected_waits_for_reconnect);
+  RUN_TEST(test_retained_state_is_coalesced_by_topic);
+  RUN_TEST(test_full_window_drops_the_oldest);
+  RUN_TEST(test_packet_split_across_loops);
+  RUN_TEST(test_stalled_packet_times_out_without_blocking);
+  RUN_TEST(test_oversized_packet_is_skipped);
+  RUN_TEST(test_random_loss_delivers_latest_state);
+  RUN_TEST(test_ack_is_found_by_packet_id);
+  RUN_TEST(test_superseded_message_is_never_acknowledged);
+  RUN_TEST(test_refused_message_has_no_packet_id);
+  return UNITY_END();
+}
@@ -0,0 +1,248 @@
+#include <unity.h>
+#include <array>
+#include <utility>
+#include "scheduler.h"
+
+// The scheduler on a virtual clock and a table picked by the test, so it can
+// be run at any uptime and as either task.
+
+static int64_t virtualNow;
+static uint8_t virtualTable;
+
+static int64_t virtualClock()
+{
+  return virtualNow;
+}
+
+static uint8_t virtualTableIndex()
+{
+  return virtualTable;
+}
+
+static int64_t runsAt[4];
+static uint8_t runs[4];
+
+static void first()
+{
+  runsAt[0] = virtualNow;
+  runs[0] += 1;
+}
+
+static void second()
+{
+  runsAt[1] = virtualNow;
+  runs[1] += 1;
+}
+
+// Every 1000 ms, on its own
+static void repeating()
+{
+  runsAt[2] = virtualNow;
+  runs[2] += 1;
+  scheduleAction(repeating, 1000);
+}
+
+// One more distinct action than there are slots
+template <size_t N>
+static void numbered()
+{
+  runs[3] += 1;
+}
+
+template <size_t... N>
+static std::array<ScheduledAction, sizeof...(N)> makeNumbered(std::index_sequence<N...>)
+{
+  return {numbered<N>...};
+}
+
+static const std::array<ScheduledAction, SCHEDULER_SLOTS + 1> numberedActions = makeNumbered(std::make_index_sequence<SCHEDULER_SLOTS + 1>());
+
+// Moves the clock in steps of step microseconds and runs what is due after each
+static void advance(int64_t micros, int64_t step = 1000)
+{
+  for (int64_t moved = 0; moved < micros; moved += step)
+  {
+    virtualNow += step;
+    runScheduledActions();
+  }
+}
+
+void setUp()
+{
+  virtualNow = 1000000;
+  virtualTable = 0;
+  schedulerUse(virtualClock, virtualTableIndex);
+  memset(runsAt, 0, sizeof(runsAt));
+  memset(runs, 0, sizeof(runs));
+}
+
+void tearDown()
+{
+  ScheduledAction actions[] = {first, second, repeating};
+  for (uint8_t table = 0; table < portNUM_PROCESSORS; table += 1)
+  {
+    virtualTable = table;
+    for (ScheduledAction action : actions)
+    {
+      cancelAction(action);
+    }
+    for (ScheduledAction action : numberedActions)
+    {
+      cancelAction(action);
+    }
+  }
+  schedulerUse(NULL, NULL);
+}
+
+void test_action_runs_when_due()
+{
+  int64_t start = virtualNow;
+  TEST_ASSERT_TRUE(scheduleAction(first, 250));
+  advance(249000);
+  TEST_ASSERT_EQUAL(0, runs[0]);
+  advance(1000);
+  TEST_ASSERT_EQUAL(1, runs[0]);
+  TEST_ASSERT_EQUAL(start + 250000, runsAt[0]);
+  advance(10000);
+  TEST_ASSERT_EQUAL(1, runs[0]); // once
+  TEST_ASSERT_FALSE(actionPending(first));
+}
+
+void test_scheduling_again_moves_the_action()
+{
+  int64_t start = virtualNow;
+  scheduleAction(first, 100);
+  scheduleAction(first, 300);
+  advance(200000);
+  TEST_ASSERT_EQUAL(0, runs[0]);
+  advance(100000);
+  TEST_ASSERT_EQUAL(1, runs[0]);
+  TEST_ASSERT_EQUAL(start + 300000, runsAt[0]);
+}
+
+void test_cancelled_action_does_not_run()
+{
+  scheduleAction(first, 100);
+  TEST_ASSERT_TRUE(actionPending(first));
+  TEST_ASSERT_TRUE(cancelAction(first));
+  TEST_ASSERT_FALSE(cancelAction(first));
+  advance(200000);
+  TEST_ASSERT_EQUAL(0, runs[0]);
+}
+
+void test_full_table_refuses()
+{
+  for (uint8_t index = 0; index < SCHEDULER_SLOTS; index += 1)
+  {
+    TEST_ASSERT_TRUE(scheduleAction(numberedActions[index], 100 + index));
+  }
+  TEST_ASSERT_FALSE(scheduleAction(numberedActions[SCHEDULER_SLOTS], 100));
+  // a pending action is moved, it needs no new slot
+  TEST_ASSERT_TRUE(scheduleAction(numberedActions[0], 500));
+  // running one frees its slot
+  advance(100000);
+  TEST_ASSERT_EQUAL(0, runs[3]);
+  advance(1000);
+  TEST_ASSERT_EQUAL(1, runs[3]);
+  TEST_ASSERT_TRUE(scheduleAction(numberedActions[SCHEDULER_SLOTS], 100));
+}
+
+void test_wait_is_until_the_next_action()
+{
+  TEST_ASSERT_EQUAL(SCHEDULER_IDLE, scheduledActionWait());
+  scheduleAction(first, 500);
+  scheduleAction(second, 200);
+  TEST_ASSERT_EQUAL(200000, scheduledActionWait());
+  virtualNow += 150000;
+  TEST_ASSERT_EQUAL(50000, scheduledActionWait());
+  virtualNow += 100000; // overdue
+  TEST_ASSERT_EQUAL(0, scheduledActionWait());
+  runScheduledActions();
+  TEST_ASSERT_EQUAL(1, runs[1]);
+  TEST_ASSERT_EQUAL(250000, scheduledActionWait());
+  advance(250000);
+  TEST_ASSERT_EQUAL(SCHEDULER_IDLE, scheduledActionWait());
+}
+
+void test_repeating_action_keeps_its_period()
+{
+  scheduleAction(repeating, 1000);
+  advance(10000000, 10000);
+  TEST_ASSERT_EQUAL(10, runs[2]);
+  TEST_ASSERT_TRUE(actionPending(repeating));
+}
+
+void test_action_that_reschedules_itself_runs_once_per_pass()
+{
+  scheduleAction(repeating, 0);
+  virtualNow += 5000000; // a long stall, it is due many periods over
+  runScheduledActions();
+  TEST_ASSERT_EQUAL(1, runs[2]);
+}
+
+// millis() wraps after 2^32 ms, about 49.7 days. The scheduler must not care.
+void test_across_the_millis_wrap()
+{
+  virtualNow = 4294967296LL * 1000 - 300000; // 300 ms before millis() wraps
+  int64_t start = virtualNow;
+  scheduleAction(first, 1000);
+  scheduleAction(repeating, 100);
+  advance(2000000);
+  TEST_ASSERT_EQUAL(1, runs[0]);
+  TEST_ASSERT_EQUAL(start + 1000000, runsAt[0]);
+  TEST_ASSERT_EQUAL(2, runs[2]); // at +100 ms and +1100 ms
+  TEST_ASSERT_TRUE(runsAt[2] > 4294967296LL * 1000);
+}
+
+// After about 146000 years of uptime, to be sure nothing is kept in 32 bits
+void test_at_a_large_uptime()
+{
+  virtualNow = 1LL << 62;
+  int64_t start = virtualNow;
+  scheduleAction(first, 4000000000UL); // the longest delay that fits 32 bits
+  scheduleAction(second, 1);
+  TEST_ASSERT_EQUAL(1000, scheduledActionWait());
+  advance(1000);
+  TEST_ASSERT_EQUAL(1, runs[1]);
+  TEST_ASSERT_EQUAL(4000000000LL * 1000 - 1000, scheduledActionWait());
+  virtualNow = start + 4000000000LL * 1000 - 1;
+  runScheduledActions();
+  TEST_ASSERT_EQUAL(0, runs[0]);
+  virtualNow += 1;
+  runScheduledActions();
+  TEST_ASSERT_EQUAL(1, runs[0]);
+}
+
+void test_each_table_keeps_its_own_actions()
+{
+  virtualTable = 0;
+  scheduleAction(first, 100);
+  virtualTable = 1;
+  TEST_ASSERT_FALSE(actionPending(first));
+  TEST_ASSERT_EQUAL(SCHEDULER_IDLE, scheduledActionWait());
+  scheduleAction(second, 100);
+  advance(200000);
+  // only table 1 was run
+  TEST_ASSERT_EQUAL(0, runs[0]);
+  TEST_ASSERT_EQUAL(1, runs[1]);
+  virtualTable = 0;
+  TEST_ASSERT_TRUE(actionPending(first));
+  runScheduledActions();
+  TEST_ASSERT_EQUAL(1, runs[0]);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_action_runs_when_due);
+  RUN_TEST(test_scheduling_again_moves_the_action);
+  RUN_TEST(test_cancelled_action_does_not_run);
+  RUN_TEST(test_full_table_refuses);
+  RUN_TEST(test_wait_is_until_the_next_action);
+  RUN_TEST(test_repeating_action_keeps_its_period);
+  RUN_TEST(test_action_that_reschedules_itself_runs_once_per_pass);
+  RUN_TEST(test_across_the_millis_wrap);
+  RUN_TEST(test_at_a_large_uptime);
+  RUN_TEST(test_each_table_keeps_its_own_actions);
+  return UNITY_END();
+}
@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+"""Decode the binary telemetry records published on /intercom/telemetry.
+
+The layout is described in include/telemetry.h. Records only carry the fields
+that changed, so the decoder remembers the last value of every field.
+
+Reads one hex encoded record per line from stdin, for example:
+
+    mosquitto_sub -h <broker> -t /intercom/telemetry -F %x | tools/decode_telemetry.py
+"""
+
+import json
+import sys
+
+VERSION = 1
+FIELDS = [
+    "uptime_s",
+    "rssi_dbm",
+    "free_heap",
+    "loop_p50_us",
+    "loop_p99_us",
+    "loop_max_us",
+    "mqtt_reconnects",
+    "wifi_reconnects",
+    "ring_count",
+]
+
+
+def read_varint(data, position):
+    value = 0
+    shift = 0
+    while True:
+        byte = data[position]
+        position += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, position
+
+
+def unzigzag(value):
+    return (value >> 1) ^ -(value & 1)
+
+
+def decode(data, state):
+    """Decode one record and merge it into state. Returns the changed field names."""
+    if data[0] != VERSION:
+        raise ValueError("unknown telemetry version %d" % data[0])
+    mask, position = read_varint(data, 1)
+    changed = []
+    for index, name in enumerate(FIELDS):
+        if mask & (1 << index):
+            value, position = read_varint(data, position)
+            state[name] = unzigzag(value)
+            changed.append(name)
+    return changed
+
+
+def main():
+    state = {}
+    for line in sys.stdin:
+        line = line.strip()
+        if not line:
+            continue
+        try:
+            changed = decode(bytes.fromhex(line), state)
+        except (ValueError, IndexError) as error:
+            print("bad record %s: %s" % (line, error), file=sys.stderr)
+            continue
+        print(json.dumps({"changed": changed, **state}), flush=True)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+"""Embed the web UI in the firmware.
+
+Gzips web/index.html and writes it as a byte array to include/web_ui.h,
+together with its size and an ETag derived from the content. platformio.ini
+runs this before every build; it only rewrites the header when the page
+changed. It can also be run by hand from the project directory.
+"""
+
+import gzip
+import hashlib
+import os
+
+SOURCE = os.path.join("web", "index.html")
+TARGET = os.path.join("include", "web_ui.h")
+
+
+def render(raw):
+    # mtime 0 keeps the output the same for the same page
+    compressed = gzip.compress(raw, compresslevel=9, mtime=0)
+    etag = hashlib.sha1(raw).hexdigest()[:16]
+    lines = [
+        "#ifndef _WEB_UI_H",
+        "#define _WEB_UI_H",
+        "",
+        "#include <Arduino.h>",
+        "",
+        "// Generated by tools/embed_web.py from web/index.html - do not edit.",
+        "// %d bytes, %d gzipped." % (len(raw), len(compressed)),
+        "",
+        "#define WEB_UI_INDEX_SIZE %d" % len(compressed),
+        "#define WEB_UI_INDEX_ETAG \"\\\"%s\\\"\"" % etag,
+        "",
+        "static const uint8_t WEB_UI_INDEX[] PROGMEM = {",
+    ]
+    for start in range(0, len(compressed), 16):
+        lines.append("  " + " ".join("0x%02x," % byte for byte in compressed[start:start + 16]))
+    lines += ["};", "", "#endif", ""]
+    return "\n".join(lines), len(raw), len(compressed)
+
+
+def embed(project):
+    with open(os.path.join(project, SOURCE), "rb") as source:
+        header, raw, compressed = render(source.read())
+    target = os.path.join(project, TARGET)
+    if os.path.exists(target):
+        with open(target) as existing:
+            if existing.read() == header:
+                return
+    with open(target, "w") as output:
+        output.write(header)
+    print("%s: %d bytes, %d gzipped" % (TARGET, raw, compressed))
+
+
+try:
+    Import("env")  # noqa: F821 - defined when PlatformIO runs this
+except NameError:
+    env = None
+
+if env is not None:
+    embed(env["PROJECT_DIR"])
+elif __name__ == "__main__":
+    embed(os.getcwd())
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+"""Benchmark the HTTP server of the intercom.
+
+Sends requests from several concurrent clients for a while and prints the
+requests per second and the latency percentiles, for example:
+
+    tools/http_bench.py <device-ip> --path / --clients 4 --seconds 30
+
+Run it against the old and the new firmware to compare them. A slow client
+can be simulated with --slow, it opens a connection and sends the request one
+byte every 100 ms while the others measure.
+"""
+
+import argparse
+import http.client
+import socket
+import threading
+import time
+
+
+def client(host, port, path, deadline, latencies, errors, lock):
+    while time.monotonic() < deadline:
+        start = time.monotonic()
+        try:
+            connection = http.client.HTTPConnection(host, port, timeout=10)
+            connection.request("GET", path)
+            response = connection.getresponse()
+            response.read()
+            connection.close()
+            ok = response.status == 200
+        except (OSError, http.client.HTTPException):
+            ok = False
+        elapsed = time.monotonic() - start
+        with lock:
+            if ok:
+                latencies.append(elapsed)
+            else:
+                errors[0] += 1
+
+
+def slow_client(host, port, path, deadline):
+    request = ("GET %s HTTP/1.1\r\nHost: %s\r\n\r\n" % (path, host)).encode()
+    while time.monotonic() < deadline:
+        try:
+            with socket.create_connection((host, port), timeout=10) as connection:
+                for byte in request:
+                    if time.monotonic() >= deadline:
+                        return
+                    connection.send(bytes([byte]))
+                    time.sleep(0.1)
+                connection.recv(4096)
+        except OSError:
+            time.sleep(0.1)
+
+
+def percentile(values, percent):
+    if not values:
+        return 0.0
+    index = min(len(values) - 1, int(len(values) * percent / 100))
+    return values[index]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--path", default="/")
+    parser.add_argument("--clients", type=int, default=4)
+    parser.add_argument("--seconds", type=float, default=30)
+    parser.add_argument("--slow", action="store_true", help="keep one slow client connected as well")
+    arguments = parser.parse_args()
+
+    deadline = time.monotonic() + arguments.seconds
+    latencies = []
+    errors = [0]
+    lock = threading.Lock()
+    threads = [
+        threading.Thread(target=client, args=(arguments.host, arguments.port, arguments.path, deadline, latencies, errors, lock))
+        for _ in range(arguments.clients)
+    ]
+    if arguments.slow:
+        threads.append(threading.Thread(target=slow_client, args=(arguments.host, arguments.port, arguments.path, deadline)))
+    started = time.monotonic()
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    elapsed = time.monotonic() - started
+
+    latencies.sort()
+    print("requests  %d ok, %d failed in %.1f s" % (len(latencies), errors[0], elapsed))
+    print("rate      %.1f requests/s" % (len(latencies) / elapsed))
+    for percent in (50, 90, 99):
+        print("p%-8d %.1f ms" % (percent, percentile(latencies, percent) * 1000))
+    if latencies:
+        print("max       %.1f ms" % (latencies[-1] * 1000))
+
+
+if __name__ == "__main__":
+    main()
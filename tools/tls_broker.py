@@ -0,0 +1,201 @@
+#!/usr/bin/env python3
+"""A local TLS MQTT broker stand-in for testing the TLS client of the intercom.
+
+Accepts TLS connections, answers just enough MQTT for the intercom (CONNACK,
+PUBACK, SUBACK, PINGRESP) and prints for every connection whether the TLS
+session was resumed and how long the handshake took on this side, for example:
+
+    tools/tls_broker.py --port 8883
+
+Without --cert and --key a self-signed certificate for --host is made with
+openssl and its path printed; paste it into MQTT_CA_CERTIFICATE. Add a broker
+with this machine's address and port 8883 to include/credentials.h, then
+restart the intercom a few times: the first connection is a full handshake,
+the ones after it must be resumed. The handshake times the intercom measured
+itself are printed as it publishes /intercom/tls/full and /intercom/tls/resumed.
+
+    --no-tickets  resume by session id instead of session tickets
+    --drop-after  close the connection after that many publishes, to test reconnects
+    --stall       stop reading after the CONNACK, to test the write timeout
+    --self-test   connect twice with a Python client and check the second one resumes
+"""
+
+import argparse
+import os
+import socket
+import ssl
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+
+def make_certificate(host, directory):
+    cert = os.path.join(directory, "broker.crt")
+    key = os.path.join(directory, "broker.key")
+    subprocess.run(["openssl", "req", "-x509", "-newkey", "ec", "-pkeyopt", "ec_paramgen_curve:prime256v1",
+                    "-nodes", "-days", "30", "-subj", "/CN=" + host, "-addext", "subjectAltName=IP:" + host,
+                    "-keyout", key, "-out", cert], check=True, capture_output=True)
+    return cert, key
+
+
+def read_exactly(connection, count):
+    data = b""
+    while len(data) < count:
+        chunk = connection.recv(count - len(data))
+        if not chunk:
+            raise EOFError()
+        data += chunk
+    return data
+
+
+def read_packet(connection):
+    header = read_exactly(connection, 1)[0]
+    length = 0
+    multiplier = 1
+    while True:
+        byte = read_exactly(connection, 1)[0]
+        length += (byte & 0x7F) * multiplier
+        multiplier *= 128
+        if byte & 0x80 == 0:
+            break
+    return header, read_exactly(connection, length)
+
+
+def handle(connection, address, options, number):
+    start = time.monotonic()
+    try:
+        connection.do_handshake()
+    except (OSError, ssl.SSLError) as error:
+        print("#%d %s handshake failed: %s" % (number, address[0], error))
+        connection.close()
+        return
+    elapsed = (time.monotonic() - start) * 1000
+    print("#%d %s %s handshake, %.1f ms, %s" % (number, address[0],
+          "resumed" if connection.session_reused else "full", elapsed, connection.version()))
+    publishes = 0
+    try:
+        while True:
+            header, body = read_packet(connection)
+            kind = header >> 4
+            if kind == 1:  # CONNECT
+                connection.sendall(bytes([0x20, 2, 0, 0]))
+                if options.stall:
+                    print("#%d stalling" % number)
+                    time.sleep(3600)
+            elif kind == 3:  # PUBLISH
+                topic_length = (body[0] << 8) | body[1]
+                topic = body[2:2 + topic_length].decode(errors="replace")
+                offset = 2 + topic_length
+                qos = (header >> 1) & 3
+                if qos > 0:
+                    connection.sendall(bytes([0x40, 2]) + body[offset:offset + 2])
+                    offset += 2
+                if topic.startswith("/intercom/tls/"):
+                    print("#%d %s = %s us" % (number, topic, body[offset:].decode(errors="replace")))
+                publishes += 1
+                if options.drop_after and publishes >= options.drop_after:
+                    print("#%d dropped after %d publishes" % (number, publishes))
+                    break
+            elif kind == 8:  # SUBSCRIBE
+                # every topic filter is followed by its QoS byte
+                offset = 2
+                granted = b""
+                while offset < len(body):
+                    filter_length = (body[offset] << 8) | body[offset + 1]
+                    offset += 2 + filter_length
+                    granted += bytes([min(body[offset] & 3, 1)])
+                    offset += 1
+                connection.sendall(bytes([0x90, 2 + len(granted)]) + body[0:2] + granted)
+            elif kind == 12:  # PINGREQ
+                connection.sendall(bytes([0xD0, 0]))
+            elif kind == 14:  # DISCONNECT
+                break
+    except (EOFError, OSError, ssl.SSLError):
+        pass
+    print("#%d closed" % number)
+    try:
+        # a session is only kept for resumption by id after a clean shutdown
+        connection.unwrap()
+    except (OSError, ssl.SSLError):
+        pass
+    connection.close()
+
+
+def serve(listener, context, options):
+    number = 0
+    while True:
+        client, address = listener.accept()
+        number += 1
+        connection = context.wrap_socket(client, server_side=True, do_handshake_on_connect=False)
+        threading.Thread(target=handle, args=(connection, address, options, number), daemon=True).start()
+
+
+def self_test(port, cert):
+    context = ssl.create_default_context(cafile=cert)
+    context.maximum_version = ssl.TLSVersion.TLSv1_2
+    context.check_hostname = False
+    session = None
+    reused = []
+    for attempt in range(2):
+        with socket.create_connection(("127.0.0.1", port)) as raw:
+            with context.wrap_socket(raw, session=session) as connection:
+                connection.sendall(bytes([0x10, 12, 0, 4]) + b"MQTT" + bytes([4, 2, 0, 120, 0, 0]))
+                header, body = read_packet(connection)
+                if header != 0x20 or body != bytes([0, 0]):
+                    print("self test: no CONNACK")
+                    return False
+                # QoS 1 publish, must be acknowledged with the same packet id
+                connection.sendall(bytes([0x32, 11, 0, 3]) + b"/t1" + bytes([0x12, 0x34]) + b"test")
+                header, body = read_packet(connection)
+                if header != 0x40 or body != bytes([0x12, 0x34]):
+                    print("self test: no PUBACK")
+                    return False
+                session = connection.session
+                reused.append(connection.session_reused)
+                connection.sendall(bytes([0xE0, 0]))
+                connection.unwrap()
+    ok = reused == [False, True]
+    print("self test: %s (resumed %s)" % ("passed" if ok else "FAILED", reused))
+    return ok
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="127.0.0.1", help="address put in the self-signed certificate")
+    parser.add_argument("--port", type=int, default=8883)
+    parser.add_argument("--cert")
+    parser.add_argument("--key")
+    parser.add_argument("--no-tickets", action="store_true")
+    parser.add_argument("--drop-after", type=int, default=0)
+    parser.add_argument("--stall", action="store_true")
+    parser.add_argument("--self-test", action="store_true")
+    options = parser.parse_args()
+
+    directory = tempfile.mkdtemp(prefix="tls_broker")
+    if options.cert and options.key:
+        cert, key = options.cert, options.key
+    else:
+        cert, key = make_certificate(options.host, directory)
+        print("CA certificate: %s" % cert)
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    # the intercom speaks TLS 1.2 (mbedTLS 2.x)
+    context.maximum_version = ssl.TLSVersion.TLSv1_2
+    context.load_cert_chain(cert, key)
+    if options.no_tickets:
+        context.options |= ssl.OP_NO_TICKET
+
+    listener = socket.create_server(("", options.port))
+    print("Listening on port %d%s" % (options.port, ", no session tickets" if options.no_tickets else ""))
+    if options.self_test:
+        threading.Thread(target=serve, args=(listener, context, options), daemon=True).start()
+        sys.exit(0 if self_test(options.port, cert) else 1)
+    try:
+        serve(listener, context, options)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()